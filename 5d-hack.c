@@ -319,9 +319,17 @@ my_init_task(void)
 		build_user
 	);
 	bmp_printf( FONT_MED, 0, 400,
-		"Config file %s: %s",
+		"Config file %s: %s\n"
+		"%d bytes in %d reads (was %d), %d us\n"
+		"%d bytes kept, %d while parsing",
 		config_filename,
-		global_config ? "YES" : "NO"
+		config_stats.snapshot ? "SNAPSHOT" : global_config ? "YES" : "NO",
+		config_stats.bytes,
+		config_stats.reads,
+		config_stats.bytes + 1,
+		config_stats.usec,
+		config_stats.kept,
+		config_stats.arena
 	);
 
 	msleep( 500 );
@@ -0,0 +1,97 @@
+#ifndef _au_h_
+#define _au_h_
+
+/** \file
+ * Sun .au file reader for the host test programs.
+ *
+ * Only 16-bit linear PCM (encoding 3) is supported.  The samples
+ * are big-endian in the file and are returned in host order,
+ * interleaved if there is more than one channel.
+ */
+#ifdef __ARM__
+#error "au.h is only for host tools"
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <arpa/inet.h> // for ntohl
+
+struct au_hdr
+{
+	uint32_t	magic;
+	uint32_t	offset;
+	uint32_t	len;
+	uint32_t	encoding;
+	uint32_t	rate;
+	uint32_t	channels;
+};
+
+
+/** Open an .au file, fill in the header and seek to the samples.
+ * Returns the file descriptor or -1 on error.
+ */
+static inline int
+au_open(
+	const char *		filename,
+	struct au_hdr *		hdr
+)
+{
+	int fd = open( filename, O_RDONLY );
+	if( fd < 0 )
+	{
+		perror( filename );
+		return -1;
+	}
+
+	if( read( fd, hdr, sizeof(*hdr) ) != sizeof(*hdr) )
+		goto fail;
+
+	hdr->magic	= ntohl( hdr->magic );
+	hdr->offset	= ntohl( hdr->offset );
+	hdr->len	= ntohl( hdr->len );
+	hdr->encoding	= ntohl( hdr->encoding );
+	hdr->rate	= ntohl( hdr->rate );
+	hdr->channels	= ntohl( hdr->channels );
+
+	if( hdr->magic != 0x2e736e64
+	||  hdr->encoding != 3 )
+	{
+		fprintf( stderr, "%s: Bad magic or unsupported format!\n", filename );
+		goto fail;
+	}
+
+	if( lseek( fd, hdr->offset, SEEK_SET ) != (off_t) hdr->offset )
+		goto fail;
+
+	return fd;
+
+fail:
+	close( fd );
+	return -1;
+}
+
+
+/** Read up to count samples; returns the number read */
+static inline size_t
+au_read(
+	int			fd,
+	int16_t *		buf,
+	size_t			count
+)
+{
+	ssize_t rc = read( fd, buf, count * sizeof(*buf) );
+	if( rc <= 0 )
+		return 0;
+
+	count = rc / sizeof(*buf);
+
+	size_t i;
+	for( i=0 ; i<count ; i++ )
+		buf[i] = ntohs( buf[i] );
+
+	return count;
+}
+
+#endif
@@ -0,0 +1,547 @@
+/** \file
+ * Block based audio level analysis.
+ *
+ * On the host this builds a test program that runs .au files
+ * through the analysis and reports the levels and the speed.
+ * Define AUDIO_STATS_NO_MAIN to link it into other host tools.
+ */
+/*
+ * Copyright (C) 2009 Trammell Hudson <hudson+ml@osresearch.net>
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+#ifndef __ARM__
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "au.h"
+#else
+#include "dryos.h"
+#endif
+#include "audio-stats.h"
+
+
+uint32_t
+audio_isqrt(
+	uint32_t		x
+)
+{
+	uint32_t root = 0;
+	uint32_t bit = 1 << 30;
+
+	while( bit > x )
+		bit >>= 2;
+
+	while( bit )
+	{
+		if( x >= root + bit )
+		{
+			x -= root + bit;
+			root = (root >> 1) + bit;
+		} else
+			root >>= 1;
+		bit >>= 2;
+	}
+
+	return root;
+}
+
+
+/** log2(1 + i/32) in Q12 for audio_log2() */
+static const uint16_t log2_frac[ 33 ] = {
+	   0,  182,  358,  530,  696,  858, 1016, 1169,
+	1319, 1465, 1607, 1746, 1882, 2015, 2145, 2272,
+	2396, 2518, 2637, 2754, 2869, 2982, 3092, 3200,
+	3307, 3412, 3514, 3615, 3715, 3812, 3908, 4003,
+	4096,
+};
+
+
+/** Fixed point log2 in Q12; x must be non-zero.
+ * The integer part comes from the leading zero count and the
+ * fraction from the table, interpolated with the next eight bits.
+ * Error is below 0.001 in log2, about 0.005 dB.
+ */
+int
+audio_log2(
+	uint32_t		x
+)
+{
+	const int n = 31 - __builtin_clz( x );
+	const uint32_t m = x << (31 - n);
+	const uint32_t i = (m >> 26) & 0x1F;
+	const uint32_t f = (m >> 18) & 0xFF;
+	const int frac = log2_frac[i]
+		+ (( (log2_frac[i+1] - log2_frac[i]) * f ) >> 8);
+
+	return (n << 12) + frac;
+}
+
+
+/** Returns the level in quarter dB relative to full scale.
+ *
+ * Range is -60 to 0 dB, or -240 to 0.
+ * 20 * log10(2) * 4 == 24.0824, which is 24661 / 1024.
+ */
+int
+audio_level_to_qdb(
+	int			raw_level
+)
+{
+	if( raw_level <= 0 )
+		return AUDIO_QDB_MIN;
+
+	const int diff = audio_log2( raw_level ) - AUDIO_FULL_SCALE_LOG2;
+	int qdb = ( diff * 24661 + (1 << 21) ) >> 22;
+
+	if( qdb < AUDIO_QDB_MIN )
+		return AUDIO_QDB_MIN;
+	if( qdb > 0 )
+		return 0;
+	return qdb;
+}
+
+
+/** Returns mean square power, in squared sample units >> 8, in
+ * quarter dB relative to a full scale sine, for the loudness.
+ *
+ * 10 * log10(2) * 4 == 12.0412, which is 12330 / 1024.  A full
+ * scale sine has a mean square of 32767^2 / 2, or 2^21 here.
+ */
+int
+audio_power_to_qdb(
+	uint32_t		power
+)
+{
+	if( power == 0 )
+		return LOUDNESS_QDB_MIN;
+
+	const int diff = audio_log2( power ) - (21 << 12);
+	return ( diff * 12330 + (1 << 21) ) >> 22;
+}
+
+
+void
+audio_stats_init(
+	struct audio_stats *	stats,
+	unsigned		attack_shift,
+	unsigned		release_shift
+)
+{
+	stats->attack_shift	= attack_shift;
+	stats->release_shift	= release_shift;
+	stats->contiguous	= 1;
+	stats->peak		= 0;
+	stats->rms		= 0;
+	stats->avg		= 0;
+	stats->hold		= 0;
+	stats->x[0] = stats->x[1] = stats->x[2] = 0;
+
+	unsigned i;
+	for( i=0 ; i<5 ; i++ )
+		stats->k[0][i] = stats->k[1][i] = 0;
+}
+
+
+/** K-weighting filter from ITU-R BS.1770 for 48 KHz, as two
+ * biquads in Q28: a high shelf for the head and a high pass.
+ * Samples are filtered in Q4 so the high pass keeps its precision.
+ */
+static const int32_t kweight[2][5] = {
+	// b0, b1, b2, a1, a2
+	{  412081942, -722546694,  321691121, -453832898,  196623811 },
+	{  268435456, -536870912,  268435456, -534199296,  265770496 },
+};
+
+
+static inline int32_t
+kweight_biquad(
+	const int32_t *		c,
+	int32_t *		z,	// x1, x2, y1, y2, error
+	int32_t			x
+)
+{
+	// The high pass poles are very close to DC, so the truncation
+	// error is fed into the next sample rather than building up
+	// into a large offset.
+	const int64_t acc = (int64_t) z[4]
+		+ (int64_t) c[0] * x
+		+ (int64_t) c[1] * z[0]
+		+ (int64_t) c[2] * z[1]
+		- (int64_t) c[3] * z[2]
+		- (int64_t) c[4] * z[3];
+	const int32_t y = acc >> 28;
+
+	z[4] = acc & ((1 << 28) - 1);
+	z[1] = z[0];
+	z[0] = x;
+	z[3] = z[2];
+	z[2] = y;
+	return y;
+}
+
+
+static inline int
+iabs( int x )
+{
+	return x < 0 ? -x : x;
+}
+
+
+/** The peak is checked on the samples and on the midpoints between
+ * them, estimated with a four tap half-band interpolator:
+ *
+ *	mid = ( 9 * (x1 + x2) - (x0 + x3) ) / 16
+ *
+ * This 2x oversampling catches most of the inter-sample overs that
+ * the raw samples miss.  The midpoint is one sample behind.
+ */
+void
+audio_stats_block(
+	struct audio_stats *	stats,
+	const int16_t *		samples,
+	unsigned		count,
+	unsigned		stride
+)
+{
+	int x0 = stats->x[0];
+	int x1 = stats->x[1];
+	int x2 = stats->x[2];
+	int peak = 0;
+	uint64_t sum = 0;
+	uint64_t ksum = 0;
+	unsigned i;
+
+	if( count > AUDIO_STATS_MAX_BLOCK )
+		count = AUDIO_STATS_MAX_BLOCK;
+	if( count == 0 )
+		return;
+
+	for( i=0 ; i<count ; i++, samples += stride )
+	{
+		const int x3 = *samples;
+
+		if( iabs( x3 ) > peak )
+			peak = iabs( x3 );
+
+		if( stats->contiguous )
+		{
+			const int mid = ( 9 * (x1 + x2) - (x0 + x3) ) >> 4;
+			if( iabs( mid ) > peak )
+				peak = iabs( mid );
+		}
+
+		// A full scale negative square is 2^30, or 2^22 here,
+		// so a full block needs more than 32 bits
+		sum += (uint32_t)( x3 * x3 ) >> 8;
+
+		if( stats->contiguous )
+		{
+			int32_t k = kweight_biquad( kweight[0], stats->k[0], x3 << 4 );
+			k = kweight_biquad( kweight[1], stats->k[1], k ) >> 4;
+			ksum += (uint64_t)( (int64_t) k * k ) >> 8;
+		} else
+			ksum += (uint32_t)( x3 * x3 ) >> 8;
+
+		x0 = x1;
+		x1 = x2;
+		x2 = x3;
+	}
+
+	stats->x[0] = x0;
+	stats->x[1] = x1;
+	stats->x[2] = x2;
+
+	stats->peak	= peak;
+	stats->rms	= audio_isqrt( (uint32_t)( sum / count ) << 8 );
+	stats->ksum	= ksum;
+	stats->count	= count;
+
+	// Ballistics, in sample units << 8
+	const int rms = stats->rms << 8;
+	if( rms > stats->avg )
+		stats->avg += ( rms - stats->avg ) >> stats->attack_shift;
+	else
+		stats->avg -= ( stats->avg - rms ) >> stats->release_shift;
+
+	if( (peak << 8) > stats->hold )
+		stats->hold = peak << 8;
+	else
+		stats->hold -= ( stats->hold - (peak << 8) ) >> stats->release_shift;
+}
+
+
+void
+audio_loudness_reset(
+	struct audio_loudness *	l
+)
+{
+	unsigned i;
+
+	l->sub_sum	= 0;
+	l->sub_count	= 0;
+	l->sub_index	= 0;
+	l->sub_total	= 0;
+	l->second_peak	= 0;
+	l->blocks	= 0;
+	l->momentary	= LOUDNESS_QDB_MIN;
+	l->integrated	= LOUDNESS_QDB_MIN;
+	l->history_head	= 0;
+
+	for( i=0 ; i<4 ; i++ )
+		l->sub_power[i] = 0;
+
+	for( i=0 ; i<LOUDNESS_HISTORY ; i++ )
+	{
+		l->history[i].momentary	= LOUDNESS_QDB_MIN;
+		l->history[i].peak	= AUDIO_QDB_MIN;
+	}
+
+	for( i=0 ; i<LOUDNESS_BINS ; i++ )
+	{
+		l->hist_count[i] = 0;
+		l->hist_power[i] = 0;
+	}
+}
+
+
+void
+audio_loudness_add(
+	struct audio_loudness *		l,
+	const struct audio_stats *	stats
+)
+{
+	l->sub_sum += stats->ksum;
+	l->sub_count += stats->count;
+	if( stats->peak > l->second_peak )
+		l->second_peak = stats->peak;
+}
+
+
+/** Recompute the gated loudness from the histogram.
+ * The relative gate is 10 LU below the loudness of all of the
+ * blocks above the absolute gate; bins are a quarter LU wide.
+ */
+static void
+audio_loudness_integrate(
+	struct audio_loudness *	l
+)
+{
+	uint64_t power = 0;
+	uint32_t count = 0;
+	unsigned i;
+
+	for( i=0 ; i<LOUDNESS_BINS ; i++ )
+	{
+		power += l->hist_power[i];
+		count += l->hist_count[i];
+	}
+
+	if( !count )
+		return;
+
+	const int ungated = audio_power_to_qdb( power / count ) + LOUDNESS_OFFSET;
+	int gate = ungated - 10 * 4 - LOUDNESS_QDB_MIN;
+	if( gate < 0 )
+		gate = 0;
+
+	power = 0;
+	count = 0;
+	for( i=gate ; i<LOUDNESS_BINS ; i++ )
+	{
+		power += l->hist_power[i];
+		count += l->hist_count[i];
+	}
+
+	if( count )
+		l->integrated = audio_power_to_qdb( power / count ) + LOUDNESS_OFFSET;
+}
+
+
+int
+audio_loudness_subblock(
+	struct audio_loudness *	l
+)
+{
+	if( !l->sub_count )
+		return 0;
+
+	l->sub_power[ l->sub_index++ % 4 ] = l->sub_sum / l->sub_count;
+	l->sub_sum = 0;
+	l->sub_count = 0;
+	l->sub_total++;
+
+	// Each 400 ms block is four sub-blocks, overlapping by 75%
+	if( l->sub_total >= 4 )
+	{
+		const uint32_t power = 0
+			+ (l->sub_power[0] >> 2)
+			+ (l->sub_power[1] >> 2)
+			+ (l->sub_power[2] >> 2)
+			+ (l->sub_power[3] >> 2);
+
+		l->momentary = audio_power_to_qdb( power ) + LOUDNESS_OFFSET;
+		l->blocks++;
+
+		// Absolute gate at -70 LUFS
+		const int bin = l->momentary - LOUDNESS_QDB_MIN;
+		if( bin >= 0 )
+		{
+			const unsigned b = bin < LOUDNESS_BINS ? bin : LOUDNESS_BINS - 1;
+			l->hist_count[b]++;
+			l->hist_power[b] += power;
+		}
+	}
+
+	if( l->sub_total % 10 != 0 )
+		return 0;
+
+	// Once a second add to the history and update the integrated value
+	struct loudness_second * const h = &l->history[ l->history_head % LOUDNESS_HISTORY ];
+	h->momentary	= l->momentary;
+	h->peak		= audio_level_to_qdb( l->second_peak );
+	l->second_peak	= 0;
+	l->history_head++;
+
+	audio_loudness_integrate( l );
+	return 1;
+}
+
+
+#if !defined(__ARM__) && !defined(AUDIO_STATS_NO_MAIN)
+static double
+to_db(
+	int			level
+)
+{
+	if( level <= 0 )
+		return -99.0;
+	return 20 * log10( level / 32767.0 );
+}
+
+
+int main( int argc, char ** argv )
+{
+	const char * filename = argc > 1 ? argv[1] : "audio.au";
+	const unsigned block = argc > 2 ? strtoul( argv[2], 0, 0 ) : 256;
+	const int verbose = argc > 3;
+
+	if( block == 0 || block > AUDIO_STATS_MAX_BLOCK )
+	{
+		fprintf( stderr, "Block size must be 1 to %d\n", AUDIO_STATS_MAX_BLOCK );
+		return -1;
+	}
+
+	struct au_hdr hdr;
+	int fd = au_open( filename, &hdr );
+	if( fd < 0 )
+		return -1;
+
+	const unsigned channels = hdr.channels ? hdr.channels : 1;
+	int16_t * buf = malloc( block * channels * sizeof(*buf) );
+	struct audio_stats * stats = calloc( channels, sizeof(*stats) );
+	unsigned ch;
+
+	for( ch=0 ; ch<channels ; ch++ )
+		audio_stats_init( &stats[ch], 2, 4 );
+
+	// Loudness of the first two channels, summed; 100 ms sub-blocks
+	static struct audio_loudness loudness;
+	audio_loudness_reset( &loudness );
+	const unsigned sub_block = hdr.rate / 10;
+	unsigned sub_samples = 0;
+
+	if( hdr.rate != 48000 )
+		fprintf( stderr, "%s: K-weighting is for 48 KHz, not %d\n",
+			filename,
+			hdr.rate
+		);
+
+	unsigned long samples = 0;
+	int max_peak = 0;
+	clock_t elapsed = 0;
+	size_t n;
+
+	while( (n = au_read( fd, buf, block * channels ) / channels) > 0 )
+	{
+		clock_t start = clock();
+		for( ch=0 ; ch<channels ; ch++ )
+		{
+			audio_stats_block( &stats[ch], buf + ch, n, channels );
+			if( ch < 2 )
+				audio_loudness_add( &loudness, &stats[ch] );
+		}
+
+		// Blocks do not line up with the sub-blocks; close a
+		// sub-block at the first block boundary after 100 ms
+		sub_samples += n;
+		if( sub_samples >= sub_block )
+		{
+			sub_samples -= sub_block;
+			if( audio_loudness_subblock( &loudness ) && verbose )
+				printf( "second %u: momentary %.2f LUFS integrated %.2f LUFS\n",
+					loudness.history_head,
+					loudness.momentary / 4.0,
+					loudness.integrated / 4.0
+				);
+		}
+		elapsed += clock() - start;
+
+		for( ch=0 ; ch<channels ; ch++ )
+		{
+			if( stats[ch].peak > max_peak )
+				max_peak = stats[ch].peak;
+			if( !verbose )
+				continue;
+			printf( "%8lu ch%d: peak %6.2f rms %6.2f avg %6.2f hold %6.2f dBFS\n",
+				samples,
+				ch,
+				to_db( stats[ch].peak ),
+				to_db( stats[ch].rms ),
+				to_db( stats[ch].avg >> 8 ),
+				to_db( stats[ch].hold >> 8 )
+			);
+		}
+
+		samples += n;
+	}
+
+	const double secs = (double) elapsed / CLOCKS_PER_SEC;
+	printf( "%s: %lu samples x %u channels @ %u Hz, true peak %.2f dBFS\n",
+		filename,
+		samples,
+		channels,
+		hdr.rate,
+		to_db( max_peak )
+	);
+	printf( "Integrated loudness %.2f LUFS over %u blocks\n",
+		loudness.integrated / 4.0,
+		loudness.blocks
+	);
+	if( secs > 0 )
+		printf( "%.0f samples/sec, %.0fx realtime\n",
+			samples * channels / secs,
+			hdr.rate ? samples / secs / hdr.rate : 0
+		);
+
+	free( stats );
+	free( buf );
+	close( fd );
+	return 0;
+}
+#endif
@@ -0,0 +1,196 @@
+#ifndef _audio_stats_h_
+#define _audio_stats_h_
+
+/** \file
+ * Block based audio level analysis.
+ *
+ * Each block of samples produces a true peak estimate, the RMS
+ * level and attack/release smoothed levels for the meters, all in
+ * fixed point.  The same code runs on the camera and on the host,
+ * where it can be fed from .au files to benchmark it and check the
+ * meters against reference recordings.
+ */
+/*
+ * Copyright (C) 2009 Trammell Hudson <hudson+ml@osresearch.net>
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include <stdint.h>
+
+/** Largest block that audio_stats_block() takes at once */
+#define AUDIO_STATS_MAX_BLOCK	1024
+
+
+struct audio_stats
+{
+	// Configuration
+	unsigned		attack_shift;	//!< avg rises by 1/2^n per block
+	unsigned		release_shift;	//!< avg and hold fall by 1/2^n
+	int			contiguous;	//!< Samples are adjacent at 48 KHz
+
+	// Results of the last block, in sample units
+	int			peak;		//!< True peak estimate
+	int			rms;
+
+	// Smoothed levels, in sample units << 8
+	int			avg;		//!< RMS with attack/release
+	int			hold;		//!< Peak with instant attack
+
+	// Interpolator history, oldest first
+	int			x[3];
+
+	// K-weighting filter state and the sum of the K-weighted
+	// squares >> 8 of the last block, for the loudness.  Without
+	// contiguous samples the squares are not weighted.
+	int32_t			k[2][5];
+	uint64_t		ksum;
+	unsigned		count;
+};
+
+
+extern void
+audio_stats_init(
+	struct audio_stats *	stats,
+	unsigned		attack_shift,
+	unsigned		release_shift
+);
+
+
+/** Analyze count samples, stride apart for interleaved channels.
+ * count must be at most AUDIO_STATS_MAX_BLOCK.  audio_stats_init()
+ * sets contiguous; clear it for samples taken further apart, which
+ * turns off the inter-sample peak since there is nothing to
+ * interpolate between them, and the K-weighting since its filter
+ * is for adjacent 48 KHz samples.  The loudness then comes from the
+ * unweighted power.
+ */
+extern void
+audio_stats_block(
+	struct audio_stats *	stats,
+	const int16_t *		samples,
+	unsigned		count,
+	unsigned		stride
+);
+
+
+/** Quarter dB conversions.
+ *
+ * audio_level_to_qdb() converts a sample level to quarter dB relative
+ * to full scale, clamped to AUDIO_QDB_MIN..0.  audio_power_to_qdb()
+ * converts a mean square (squares >> 8) relative to a full scale sine.
+ * audio_log2() is log2 in Q12 for a non-zero value.
+ */
+#define AUDIO_FULL_SCALE_LOG2	61440	// log2(32767) in Q12
+#define AUDIO_QDB_MIN		(-60 * 4)
+
+extern int
+audio_log2(
+	uint32_t		x
+);
+
+extern int
+audio_level_to_qdb(
+	int			raw_level
+);
+
+extern int
+audio_power_to_qdb(
+	uint32_t		power
+);
+
+
+/** Integrated loudness, in the style of EBU R128.
+ *
+ * The K-weighted power of each analyzed block is summed into 100 ms
+ * sub-blocks; each group of four overlapping sub-blocks is a 400 ms
+ * gating block.  Gating blocks above -70 LUFS go into a histogram
+ * of quarter LU bins with their power, so the relative gate and the
+ * integrated loudness come from running sums rather than a list of
+ * every block.  Once a second the momentary loudness and the peak
+ * are recorded in a small history ring.  All levels are in quarter
+ * dB (LUFS * 4).
+ *
+ * The power is averaged over the channels and referenced to a full
+ * scale sine, which for a stereo pair is the same as the BS.1770 sum
+ * of the channels referenced to full scale.  A 1 KHz sine at -23 dBFS
+ * on both channels reads -23 LUFS.
+ *
+ * There are no allocations and the only divisions are once per
+ * sub-block and once per second.
+ */
+#define LOUDNESS_QDB_MIN	(-70 * 4)
+#define LOUDNESS_BINS		(-LOUDNESS_QDB_MIN + 1)
+#define LOUDNESS_HISTORY	180	// seconds
+#define LOUDNESS_OFFSET		(-3)	// -0.691 dB
+
+struct loudness_second
+{
+	int16_t			momentary;
+	int16_t			peak;
+};
+
+struct audio_loudness
+{
+	uint64_t		sub_sum;
+	unsigned		sub_count;
+	uint32_t		sub_power[4];
+	unsigned		sub_index;
+	unsigned		sub_total;
+	int			second_peak;
+
+	uint32_t		hist_count[ LOUDNESS_BINS ];
+	uint64_t		hist_power[ LOUDNESS_BINS ];
+	unsigned		blocks;
+
+	int			momentary;
+	int			integrated;
+
+	struct loudness_second	history[ LOUDNESS_HISTORY ];
+	unsigned		history_head;	//!< Seconds since the reset
+};
+
+
+extern void
+audio_loudness_reset(
+	struct audio_loudness *	loudness
+);
+
+/** Add an analyzed block of one channel */
+extern void
+audio_loudness_add(
+	struct audio_loudness *		loudness,
+	const struct audio_stats *	stats
+);
+
+/** Close the current 100 ms sub-block.
+ * Returns 1 if a new second was added to the history.
+ */
+extern int
+audio_loudness_subblock(
+	struct audio_loudness *	loudness
+);
+
+
+/** Integer square root, rounded down */
+extern uint32_t
+audio_isqrt(
+	uint32_t		x
+);
+
+
+#endif
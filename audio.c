@@ -26,6 +26,9 @@
 #include "config.h"
 #include "property.h"
 #include "menu.h"
+#include "audio-stats.h"
+#include "fft.h"
+#include "lens.h"
 
 // Dump the audio registers to a file if defined
 #undef CONFIG_AUDIO_REG_LOG
@@ -34,9 +37,6 @@
 struct gain_struct
 {
 	struct semaphore *	sem;
-	unsigned		alc1;
-	unsigned		sig1;
-	unsigned		sig2;
 };
 
 static struct gain_struct gain = {
@@ -54,6 +54,8 @@ CONFIG_INT( "audio.o2gain",	o2gain,		0 );
 CONFIG_INT( "audio.alc-enable",	alc_enable,	0 );
 CONFIG_INT( "audio.mic-in",	mic_in,		0 );
 CONFIG_INT( "audio.loopback",	loopback,	1 );
+CONFIG_INT( "audio.spectrum",	spectrum_draw,	0 );
+CONFIG_INT( "audio.loudness-graph", loudness_graph, 0 );
 
 static int do_draw_meters = 1;
 
@@ -70,60 +72,139 @@ struct audio_level
 struct audio_level audio_levels[2];
 
 
-
-/** Returns a dB translated from the raw level
+/** Timestamped levels from the level task to the meter task.
  *
- * Range is -40 to 0 dB
+ * compute_audio_level_task is the only writer of level_head and
+ * meter_task is the only writer of level_tail, so no lock is needed
+ * as long as the entry is stored before the head moves.  If the
+ * meters fall behind, new samples are dropped and counted.
  */
-static int
-audio_level_to_db(
-	int			raw_level
-)
+struct level_sample
 {
-	int db;
+	uint32_t		time;		//!< timer_read() after the block
+	int16_t			avg[2];
+	int16_t			peak[2];	//!< Block true peak
+	int16_t			hold[2];
+};
+
+#define LEVEL_RING		64	// must be a power of two
+
+static struct level_sample	level_ring[ LEVEL_RING ];
+static volatile uint32_t	level_head;
+static volatile uint32_t	level_tail;
+static unsigned			level_overruns;
+
 
-	for( db = 40 ; db ; db-- )
+static void
+level_push(
+	const struct level_sample *	sample
+)
+{
+	const uint32_t head = level_head;
+	if( head - level_tail >= LEVEL_RING )
 	{
-		if( audio_thresholds[db] > raw_level )
-			return -db;
+		level_overruns++;
+		return;
 	}
 
-	return 0;
+	level_ring[ head % LEVEL_RING ] = *sample;
+	barrier();
+	level_head = head + 1;
 }
 
 
+static int
+level_pop(
+	struct level_sample *	sample
+)
+{
+	const uint32_t tail = level_tail;
+	if( tail == level_head )
+		return 0;
+
+	barrier();
+	*sample = level_ring[ tail % LEVEL_RING ];
+	barrier();
+	level_tail = tail + 1;
+	return 1;
+}
 
 
 #ifdef OSCOPE_METERS
-void draw_meters(void)
-{
+/** Peak history for the scrolling scope, one column per block */
 #define MAX_SAMPLES 720
-	static int16_t levels[ MAX_SAMPLES ];
-	static uint32_t index;
-	levels[ index++ ] = audio_read_level();
-	if( index >= MAX_SAMPLES )
-		index = 0;
+static int16_t level_history[ MAX_SAMPLES ];
+static uint32_t level_history_index;
+#endif
 
 
+/** Drain the ring into audio_levels[] for the meters.
+ *
+ * The average is the newest one and the peak is the largest held
+ * peak since the last call, so that short transients between the
+ * meter updates are still shown.
+ */
+static void
+audio_levels_update( void )
+{
+	struct level_sample sample;
+	int peak[2] = { 0, 0 };
+	int count = 0;
+	int ch;
+
+	while( level_pop( &sample ) )
+	{
+		for( ch=0 ; ch<2 ; ch++ )
+		{
+			audio_levels[ch].last	= sample.peak[ch];
+			audio_levels[ch].avg	= sample.avg[ch];
+			if( sample.hold[ch] > peak[ch] )
+				peak[ch] = sample.hold[ch];
+		}
+
+#ifdef OSCOPE_METERS
+		level_history[ level_history_index++ ] = sample.peak[0];
+		if( level_history_index >= MAX_SAMPLES )
+			level_history_index = 0;
+#endif
+		count++;
+	}
+
+	if( !count )
+		return;
+
+	for( ch=0 ; ch<2 ; ch++ )
+		audio_levels[ch].peak = peak[ch];
+}
+
+
+
+#ifdef OSCOPE_METERS
+/** Scrolling scope of the left channel peaks from the level history */
+static void draw_meters(void)
+{
 	struct vram_info * vram = &vram_info[ vram_get_number(2) ];
 	//thunk audio_dev_compute_average_level = (void*) 0xFF9725C4;
 	//audio_dev_compute_average_level();
 
-	// The level goes from -40 to 0
+	// Full scale is +/- 128 lines around the center
 	uint32_t x;
 	for( x=0 ; x<MAX_SAMPLES && x<vram->width ; x++ )
 	{
-		uint16_t y = 256 + levels[ x ] / 128;
-		vram->vram[ y * vram->pitch + x ] = 0xFFFF;
+		const int h = level_history[ x ] / 256;
+		vram->vram[ (256 - h) * vram->pitch + x ] = 0xFFFF;
+		vram->vram[ (256 + h) * vram->pitch + x ] = 0xFFFF;
 	}
 
 	uint32_t y;
 	for( y=0 ; y<128 ; y++ )
 	{
-		vram->vram[ y * vram->pitch + index ] = 0x888F;
+		vram->vram[ y * vram->pitch + level_history_index ] = 0x888F;
 	}
 
 }
+
+static void meters_invalidate( void ) {}
 #else
 
 
@@ -156,13 +237,78 @@ db_peak_to_color(
 }
 
 
+/** Meter layout.  Each meter is meter_height rows of width pixels,
+ * after room for the numerical level at the left.
+ */
+#define METER_WIDTH		600
+#define METER_HEIGHT		12
+#define METER_TEXT		8	// words reserved for the level
+#define METER_WORDS		(METER_WIDTH / 4)
+
+/** What is currently on screen for each meter, so that only the
+ * words that change need to be written.
+ */
+struct meter_state
+{
+	int			valid;
+	unsigned		seq;		//!< Damage sequence
+	uint32_t		x_avg;		//!< Words of bar
+	uint32_t		x_peak;		//!< Word of the peak marker
+	uint8_t			bar_color;
+	uint8_t			peak_color;
+	int			db;		//!< Printed level
+};
+
+static struct meter_state meter_state[2];
+static unsigned ticks_seq;
+static int ticks_valid;
+
+
+/** Color word for word x of a meter in the given state */
+static inline uint32_t
+meter_word(
+	const struct meter_state *	m,
+	uint32_t			x
+)
+{
+	if( x < m->x_avg )
+		return color_word( m->bar_color );
+	if( x >= m->x_peak && x < m->x_peak + 4 )
+		return color_word( m->peak_color );
+	return color_word( COLOR_BG );
+}
+
+
+/** Rewrite words [x0,x1) of every row of the meter */
+static void
+meter_span(
+	uint32_t *			row,
+	const struct meter_state *	m,
+	uint32_t			x0,
+	uint32_t			x1
+)
+{
+	const uint32_t pitch = bmp_pitch();
+	if( x1 > METER_WORDS )
+		x1 = METER_WORDS;
+
+	int y;
+	for( y=0 ; y<METER_HEIGHT ; y++, row += pitch/4 )
+	{
+		uint32_t x;
+		for( x=x0 ; x<x1 ; x++ )
+			row[x] = meter_word( m, x );
+	}
+}
+
+
 static void
 draw_meter(
 	int			y_origin,
-	struct audio_level *	level
+	struct audio_level *	level,
+	struct meter_state *	m
 )
 {
-	const uint32_t width = 600; // bmp_width();
 	const uint32_t pitch = bmp_pitch();
 	uint32_t * row = (uint32_t*) bmp_vram();
 	if( !row )
@@ -170,45 +316,63 @@ draw_meter(
 
 	// Skip to the desired y coord and over the
 	// space for the numerical levels
-	row += (pitch/4) * y_origin + 8;
-
-	const int db_avg = audio_level_to_db( level->avg );
-	const int db_peak = audio_level_to_db( level->peak );
-
-	// levels go from -40 to 0, so -40 * 15 == 600
-	const uint32_t x_db_avg = (width + db_avg * 15) / 4;
-	const uint32_t x_db_peak = (width + db_peak * 15) / 4;
-
-	const uint8_t bar_color = db_to_color( db_avg );
-	const uint8_t peak_color = db_peak_to_color( db_peak );
-	const int meter_height = 12;
-
-	const uint32_t bar_color_word = color_word( bar_color );
-	const uint32_t peak_color_word = color_word( peak_color );
-	const uint32_t bg_color_word = color_word( COLOR_BG );
-
-	// Write the meter an entire scan line at a time
-	int y;
-	for( y=0 ; y<meter_height ; y++, row += pitch/4 )
+	row += (pitch/4) * y_origin + METER_TEXT;
+
+	int qdb_avg = audio_level_to_qdb( level->avg );
+	int qdb_peak = audio_level_to_qdb( level->peak );
+	const int db_avg = qdb_avg / 4;
+	const int db_peak = qdb_peak / 4;
+
+	// The meter shows -40 to 0, so -40 * 15 == 600
+	if( qdb_avg < -40 * 4 )
+		qdb_avg = -40 * 4;
+	if( qdb_peak < -40 * 4 )
+		qdb_peak = -40 * 4;
+
+	const struct meter_state old = *m;
+	m->x_avg	= (METER_WIDTH + (qdb_avg * 15) / 4) / 4;
+	m->x_peak	= (METER_WIDTH + (qdb_peak * 15) / 4) / 4;
+	m->bar_color	= db_to_color( db_avg );
+	m->peak_color	= db_peak_to_color( db_peak );
+
+	// Anything else drawn over the meter forces a full repaint
+	const int repaint = !m->valid
+		|| bmp_damaged( 0, y_origin, METER_TEXT * 4 + METER_WIDTH, METER_HEIGHT, &m->seq );
+
+	if( repaint )
 	{
-		uint32_t x;
-		for( x=0 ; x<width/4 ; x++ )
+		meter_span( row, m, 0, METER_WORDS );
+		m->valid = 1;
+	} else {
+		// The bar only changes between the old and new ends,
+		// unless it changed color.
+		uint32_t x0 = old.x_avg < m->x_avg ? old.x_avg : m->x_avg;
+		uint32_t x1 = old.x_avg < m->x_avg ? m->x_avg : old.x_avg;
+		if( old.bar_color != m->bar_color )
+			x0 = 0;
+		if( x0 != x1 )
+			meter_span( row, m, x0, x1 );
+
+		// The peak marker is erased and redrawn if anything moved
+		if( old.x_peak != m->x_peak
+		||  old.peak_color != m->peak_color
+		||  x0 != x1
+		)
 		{
-			if( x < x_db_avg )
-				row[x] = bar_color_word;
-			else
-			if( x < x_db_peak )
-				row[x] = bg_color_word;
-			else
-			if( x < x_db_peak + 4 )
-				row[x] = peak_color_word;
-			else
-				row[x] = bg_color_word;
+			meter_span( row, m, old.x_peak, old.x_peak + 4 );
+			meter_span( row, m, m->x_peak, m->x_peak + 4 );
 		}
 	}
 
-	// Write the current level
-	bmp_printf( FONT_SMALL, 0, y_origin, "%3d", db_avg );
+	// Write the current level if it changed
+	if( db_avg != m->db || repaint )
+	{
+		bmp_printf( FONT_SMALL, 0, y_origin, "%3d", db_avg );
+		m->db = db_avg;
+	}
+
+	// Our own text is not damage
+	bmp_damaged( 0, y_origin, METER_TEXT * 4 + METER_WIDTH, METER_HEIGHT, &m->seq );
 }
 
 
@@ -218,13 +382,18 @@ draw_ticks(
 	int		tick_height
 )
 {
-	const uint32_t width = 600 + 8; // bmp_width();
+	const uint32_t width = METER_WIDTH + METER_TEXT * 4; // bmp_width();
 	const uint32_t pitch = bmp_pitch();
 	uint32_t * row = (uint32_t*) bmp_vram();
 	if( !row )
 		return;
 	row += (pitch/4) * y;
 
+	// The ticks are static; redraw them only if something drew over them
+	if( ticks_valid && !bmp_damaged( 0, y, width, tick_height, &ticks_seq ) )
+		return;
+	ticks_valid = 1;
+
 	const uint32_t white_word = 0
 		| ( COLOR_WHITE << 24 )
 		| ( COLOR_WHITE << 16 )
@@ -243,46 +412,536 @@ draw_ticks(
 }
 
 
-/* Normal VU meter */
+/** Force a full repaint of the meters and ticks */
+static void
+meters_invalidate( void )
+{
+	meter_state[0].valid = meter_state[1].valid = 0;
+	ticks_valid = 0;
+}
+
+
+/* Normal VU meter.
+ * Only the words that changed since the last call are written;
+ * a full repaint happens when the meters are re-enabled or
+ * something else draws over them.
+ */
 static void draw_meters(void)
 {
 	// The db values are multiplied by 8 to make them
 	// smoother.
-	draw_meter( 0, &audio_levels[0] );
+	draw_meter( 0, &audio_levels[0], &meter_state[0] );
 	draw_ticks( 12, 4 );
-	draw_meter( 16, &audio_levels[1] );
+	draw_meter( 16, &audio_levels[1], &meter_state[1] );
 }
 
 #endif
 
 
+/** Sample path.
+ *
+ * This firmware has no stream of samples, only the level register
+ * with the most recent one.  Rather than polling it, a one shot
+ * timer that re-arms itself reads both channels every
+ * AUDIO_SAMPLE_MS into a ring, which costs two register reads per
+ * tick.  The samples are points about a millisecond apart rather
+ * than a contiguous 48 KHz stream, so they are good for levels but
+ * not for anything that looks at adjacent samples.
+ *
+ * The timer is the only writer of audio_ring_head and each reader
+ * keeps its own tail.  A reader that falls half the ring behind
+ * skips ahead, so that the timer cannot overwrite what it copies.
+ */
+#define AUDIO_SAMPLE_MS		1
+#define AUDIO_RING		1024	// pairs, must be a power of two
 
+static int16_t			audio_ring[ AUDIO_RING * 2 ];
+static volatile uint32_t	audio_ring_head;
+static unsigned			audio_ring_skips;
 
 
 static void
-compute_audio_levels(
-	int ch
+audio_sample_tick( void * priv )
+{
+	const uint32_t head = audio_ring_head;
+	int16_t * const pair = &audio_ring[ (head % AUDIO_RING) * 2 ];
+
+	pair[0] = audio_read_level( 0 );
+	pair[1] = audio_read_level( 1 );
+	barrier();
+	audio_ring_head = head + 1;
+
+	oneshot_timer( AUDIO_SAMPLE_MS, audio_sample_tick, audio_sample_tick, 0 );
+}
+
+
+/** Copy up to count pairs after *tail into buf, interleaved.
+ * Returns the number of pairs copied.
+ */
+static unsigned
+audio_ring_read(
+	uint32_t *		tail,
+	int16_t *		buf,
+	unsigned		count
+)
+{
+	const uint32_t head = audio_ring_head;
+	barrier();
+
+	if( head - *tail > AUDIO_RING / 2 )
+	{
+		*tail = head - AUDIO_RING / 2;
+		audio_ring_skips++;
+	}
+
+	if( count > head - *tail )
+		count = head - *tail;
+
+	unsigned i;
+	for( i=0 ; i<count ; i++ )
+	{
+		const int16_t * const pair = &audio_ring[ ((*tail + i) % AUDIO_RING) * 2 ];
+		buf[ 2*i + 0 ] = pair[0];
+		buf[ 2*i + 1 ] = pair[1];
+	}
+
+	*tail += count;
+	return count;
+}
+
+
+/** Spectrum display.
+ *
+ * A compact bar graph to the right of the meters, mainly for
+ * spotting wind rumble and hum.  The blocks come from the sample
+ * ring, so there is no polling and the cost is one FFT for every
+ * FFT_SIZE samples, about four times a second.  At the ring's 1 KHz
+ * the log spaced bars cover 4 to 500 Hz; there is nothing to filter
+ * the register with before it is sampled, so anything higher folds
+ * into the bars.  Like the meters, only the rows that change are
+ * rewritten.
+ */
+#define SPECTRUM_X		640
+#define SPECTRUM_Y		0
+#define SPECTRUM_BARS		20	// one word each
+#define SPECTRUM_HEIGHT		28
+#define SPECTRUM_INTERVAL	250
+
+/** FFT bins at the edges of each bar */
+static const uint8_t spectrum_edges[ SPECTRUM_BARS + 1 ] = {
+	1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 14, 18, 23, 30, 38, 49, 62, 79, 100, 128,
+};
+
+static uint8_t spectrum_heights[ SPECTRUM_BARS ];
+static uint8_t spectrum_colors[ SPECTRUM_BARS ];
+static unsigned spectrum_seq;
+static int spectrum_valid;
+
+
+static void
+draw_spectrum(
+	const uint8_t *		heights
+)
+{
+	const uint32_t pitch = bmp_pitch();
+	uint32_t * const base = (uint32_t*) bmp_vram();
+	if( !base )
+		return;
+
+	const int repaint = !spectrum_valid
+		|| bmp_damaged( SPECTRUM_X, SPECTRUM_Y, SPECTRUM_BARS * 4, SPECTRUM_HEIGHT, &spectrum_seq );
+
+	// The last pixel of each word is the gap between the bars
+	const uint32_t bg_word = color_word( COLOR_BG );
+
+	unsigned b;
+	for( b=0 ; b<SPECTRUM_BARS ; b++ )
+	{
+		const unsigned h = heights[b];
+		const uint8_t color = h > (SPECTRUM_HEIGHT * 3) / 4 ? 0x0c : 0x06;
+		const uint32_t bar_word = (color_word( color ) & 0x00FFFFFF)
+			| ( COLOR_BG << 24 );
+
+		unsigned r0 = spectrum_heights[b];
+		unsigned r1 = h;
+		if( r0 > r1 )
+		{
+			r1 = r0;
+			r0 = h;
+		}
+
+		if( color != spectrum_colors[b] )
+			r0 = 0;
+		if( repaint )
+		{
+			r0 = 0;
+			r1 = SPECTRUM_HEIGHT;
+		}
+
+		// Rows count up from the bottom of the graph
+		uint32_t * row = base
+			+ (pitch/4) * (SPECTRUM_Y + SPECTRUM_HEIGHT - 1 - r0)
+			+ SPECTRUM_X/4 + b;
+
+		unsigned r;
+		for( r=r0 ; r<r1 ; r++, row -= pitch/4 )
+			*row = r < h ? bar_word : bg_word;
+
+		spectrum_heights[b] = h;
+		spectrum_colors[b] = color;
+	}
+
+	spectrum_valid = 1;
+}
+
+
+static void
+spectrum_task( void )
+{
+	static struct fft_work work;
+	static int16_t pairs[ FFT_SIZE * 2 ];
+	static int16_t samples[ FFT_SIZE ];
+	static uint16_t mag[ FFT_SIZE/2 ];
+	uint8_t heights[ SPECTRUM_BARS ];
+	uint32_t tail = audio_ring_head;
+	unsigned fill = 0;
+
+	msleep( 4000 );
+
+	while(1)
+	{
+		msleep( SPECTRUM_INTERVAL );
+
+		if( !spectrum_draw || !do_draw_meters )
+		{
+			spectrum_valid = 0;
+			tail = audio_ring_head;
+			fill = 0;
+			msleep( 500 );
+			continue;
+		}
+
+		fill += audio_ring_read( &tail, pairs + 2 * fill, FFT_SIZE - fill );
+		if( fill < FFT_SIZE )
+			continue;
+		fill = 0;
+
+		unsigned i;
+		for( i=0 ; i<FFT_SIZE ; i++ )
+			samples[i] = ( pairs[ 2*i + 0 ] + pairs[ 2*i + 1 ] ) / 2;
+
+		fft_spectrum( &work, samples, 1, mag );
+
+		unsigned b;
+		for( b=0 ; b<SPECTRUM_BARS ; b++ )
+		{
+			unsigned peak = 0;
+			for( i=spectrum_edges[b] ; i<spectrum_edges[b+1] ; i++ )
+				if( mag[i] > peak )
+					peak = mag[i];
+
+			const int qdb = audio_level_to_qdb( peak ) - AUDIO_QDB_MIN;
+			heights[b] = ( qdb * SPECTRUM_HEIGHT ) / -AUDIO_QDB_MIN;
+		}
+
+		draw_spectrum( heights );
+	}
+}
+
+TASK_CREATE( "spectrum_task", spectrum_task, 0, 0x1f, 0x1000 );
+
+
+
+
+
+/** Samples per channel in each analysis block */
+#define AUDIO_BLOCK		64
+
+static int16_t audio_block[ AUDIO_BLOCK * 2 ];
+static struct audio_stats audio_stats[2];
+static uint32_t audio_level_tail;
+
+
+/** Loudness of the recording.
+ *
+ * The level task feeds every analyzed block into the loudness and
+ * closes a 100 ms sub-block based on the timer.  The sample ring is
+ * not a contiguous stream, so the blocks are not K-weighted and the
+ * measurement is of the unweighted power with the same gating.
+ * The integrated value and the history are reset when a movie
+ * starts, and loudness_clip is counted after the reset so that
+ * meter_task can tell.  meter_task only reads the history once
+ * audio_loudness_subblock() has moved history_head past the new
+ * entry.
+ */
+#define LOUDNESS_SUBBLOCK_TICKS	100000	// 100 ms
+
+static struct audio_loudness	loudness;
+static volatile int		loudness_reset;
+static volatile unsigned	loudness_clip;
+static uint32_t			loudness_last;
+static uint32_t			loudness_ticks;
+
+
+static void
+loudness_update(
+	uint32_t		now
+)
+{
+	if( loudness_reset )
+	{
+		loudness_reset = 0;
+		loudness_ticks = 0;
+		audio_loudness_reset( &loudness );
+		barrier();
+		loudness_clip++;
+	}
+
+	audio_loudness_add( &loudness, &audio_stats[0] );
+	audio_loudness_add( &loudness, &audio_stats[1] );
+
+	loudness_ticks += timer_delta( loudness_last, now );
+	loudness_last = now;
+	if( loudness_ticks < LOUDNESS_SUBBLOCK_TICKS )
+		return;
+
+	// Do not try to catch up if the task was starved
+	loudness_ticks -= LOUDNESS_SUBBLOCK_TICKS;
+	if( loudness_ticks >= LOUDNESS_SUBBLOCK_TICKS )
+		loudness_ticks = 0;
+
+	audio_loudness_subblock( &loudness );
+}
+
+
+/** Analyze the samples that arrived since the last call and queue
+ * the levels.
+ *
+ * The block from the sample ring goes to the analysis code for the
+ * peak, RMS and ballistics, and the result into the level ring for
+ * meter_task.  Returns 0 if there were no new samples.
+ */
+static int
+compute_audio_levels( void )
+{
+	const unsigned count = audio_ring_read(
+		&audio_level_tail,
+		audio_block,
+		AUDIO_BLOCK
+	);
+	if( !count )
+		return 0;
+
+	const uint32_t now = timer_read();
+	struct level_sample sample = {
+		.time		= now,
+	};
+
+	int ch;
+	for( ch=0 ; ch<2 ; ch++ )
+	{
+		struct audio_stats * const stats = &audio_stats[ch];
+
+		audio_stats_block( stats, audio_block + ch, count, 2 );
+
+		sample.avg[ch]	= stats->avg >> 8;
+		sample.peak[ch]	= stats->peak;
+		sample.hold[ch]	= stats->hold >> 8;
+	}
+
+	level_push( &sample );
+	loudness_update( now );
+	return 1;
+}
+
+
+/** Loudness graph.
+ *
+ * One column per second of the momentary loudness, newest on the
+ * right, with the second's peak as a dot and a dotted line at the
+ * -23 LUFS target.  The whole graph is redrawn straight into the
+ * VRAM once a second, which is about 6 KB of writes, and the
+ * integrated and momentary values are printed beside it.
+ */
+#define LOUDNESS_GRAPH_X	0
+#define LOUDNESS_GRAPH_Y	392
+#define LOUDNESS_GRAPH_W	LOUDNESS_HISTORY
+#define LOUDNESS_GRAPH_H	36
+#define LOUDNESS_GRAPH_MIN	(-60 * 4)	// bottom row, in quarter dB
+#define LOUDNESS_TARGET		(-23 * 4)
+
+static unsigned loudness_seconds;
+static unsigned loudness_seq;
+
+
+/** Rows above the bottom of the graph for a quarter dB level */
+static inline unsigned
+loudness_row(
+	int			qdb
+)
+{
+	if( qdb <= LOUDNESS_GRAPH_MIN )
+		return 0;
+	if( qdb >= 0 )
+		return LOUDNESS_GRAPH_H - 1;
+
+	return ( (qdb - LOUDNESS_GRAPH_MIN) * (LOUDNESS_GRAPH_H - 1) )
+		/ -LOUDNESS_GRAPH_MIN;
+}
+
+
+static const char *
+format_qdb(
+	char *			buf,
+	int			qdb
 )
 {
-	struct audio_level * const level = &audio_levels[ch];
+	const unsigned a = qdb < 0 ? -qdb : qdb;
+	snprintf( buf, 8, "%s%d.%02d",
+		qdb < 0 ? "-" : "",
+		a / 4,
+		(a % 4) * 25
+	);
+	return buf;
+}
+
+
+static void
+draw_loudness( void )
+{
+	const uint32_t pitch = bmp_pitch();
+	uint8_t * const vram = bmp_vram();
+	if( !vram )
+		return;
 
-	int raw = audio_read_level( ch );
-	if( raw < 0 )
-		raw = -raw;
+	const unsigned head = loudness.history_head;
+	const unsigned target = loudness_row( LOUDNESS_TARGET );
 
-	level->last	= raw;
-	level->avg	= (level->avg * 15 + raw) / 16;
-	if( raw > level->peak )
-		level->peak = raw;
+	uint32_t x;
+	for( x=0 ; x<LOUDNESS_GRAPH_W ; x++ )
+	{
+		// Oldest second on the left; blank until it is recorded
+		const unsigned age = LOUDNESS_GRAPH_W - 1 - x;
+		unsigned level = 0;
+		unsigned peak = 0;
+		uint8_t color = 0x06;
 
-	// Decay the peak to the average
-	level->peak = ( level->peak * 31 + level->avg ) / 32;
+		if( age < head )
+		{
+			const struct loudness_second * const h
+				= &loudness.history[ (head - 1 - age) % LOUDNESS_HISTORY ];
+			level = loudness_row( h->momentary ) + 1;
+			peak = loudness_row( h->peak ) + 1;
+			if( h->momentary > LOUDNESS_TARGET )
+				color = 0x0c;
+		}
+
+		uint8_t * pixel = vram
+			+ (LOUDNESS_GRAPH_Y + LOUDNESS_GRAPH_H - 1) * pitch
+			+ LOUDNESS_GRAPH_X + x;
+
+		unsigned r;
+		for( r=0 ; r<LOUDNESS_GRAPH_H ; r++, pixel -= pitch )
+		{
+			if( r + 1 == peak )
+				*pixel = COLOR_RED;
+			else
+			if( r < level )
+				*pixel = color;
+			else
+			if( r == target && (x & 2) )
+				*pixel = COLOR_WHITE;
+			else
+				*pixel = COLOR_BG;
+		}
+	}
+
+	char integrated[8], momentary[8];
+	bmp_printf(
+		FONT(FONT_SMALL, COLOR_WHITE, COLOR_BG),
+		LOUDNESS_GRAPH_X + LOUDNESS_GRAPH_W + 4,
+		LOUDNESS_GRAPH_Y,
+		"I %6s\nM %6s\nLUFS",
+		format_qdb( integrated, loudness.integrated ),
+		format_qdb( momentary, loudness.momentary )
+	);
+
+	// Consume the damage from our own text
+	bmp_damaged(
+		LOUDNESS_GRAPH_X,
+		LOUDNESS_GRAPH_Y,
+		LOUDNESS_GRAPH_W,
+		LOUDNESS_GRAPH_H,
+		&loudness_seq
+	);
+}
+
+
+/** Redraw the graph if there is a new second or it was damaged */
+static void
+loudness_display( void )
+{
+	if( !loudness_graph )
+		return;
+
+	const unsigned head = loudness.history_head;
+	if( head == loudness_seconds
+	&&  !bmp_damaged( LOUDNESS_GRAPH_X, LOUDNESS_GRAPH_Y, LOUDNESS_GRAPH_W, LOUDNESS_GRAPH_H, &loudness_seq )
+	)
+		return;
+
+	loudness_seconds = head;
+	draw_loudness();
+}
+
+
+/** Add the new seconds to the movie log.
+ *
+ * This runs whether or not the meters or the graph are drawn.
+ * Seconds count from the start of the clip, since the history is
+ * reset when a movie starts; mvr_log_printf() drops the lines when
+ * nothing is being recorded.
+ */
+static void
+loudness_log( void )
+{
+	static unsigned logged;
+	static unsigned clip;
+
+	const unsigned new_clip = loudness_clip;
+	barrier();
+	const unsigned head = loudness.history_head;
+
+	if( new_clip != clip )
+	{
+		clip = new_clip;
+		logged = 0;
+	}
+
+	// The history is being reset but loudness_clip has not moved yet
+	if( head < logged )
+		return;
+	if( head - logged > LOUDNESS_HISTORY )
+		logged = head - LOUDNESS_HISTORY;
+
+	for( ; logged != head ; logged++ )
+	{
+		const struct loudness_second * const h
+			= &loudness.history[ logged % LOUDNESS_HISTORY ];
+		char momentary[8], peak[8];
+
+		mvr_log_printf( "Loudness,%u,%s,%s\n",
+			logged,
+			format_qdb( momentary, h->momentary ),
+			format_qdb( peak, h->peak )
+		);
+	}
 }
 
 
 /** Task to monitor the audio levels.
  *
- * Compute the average and peak level, periodically calling
+ * Collect the levels queued by the level task, periodically calling
  * the draw_meters() function to display the results on screen.
  * \todo Check that we have live-view enabled and the TFT is on
  * before drawing.
@@ -298,9 +957,14 @@ meter_task( void )
 	{
 		msleep( 50 );
 
+		audio_levels_update();
+		loudness_log();
+
 		if( do_draw_meters )
+		{
 			draw_meters();
-		else
+			loudness_display();
+		} else
 			msleep( 500 );
 	}
 }
@@ -314,20 +978,193 @@ static void
 compute_audio_level_task( void )
 {
 	msleep( 4000 );
-	audio_levels[0].peak = audio_levels[1].peak = 0;
-	audio_levels[1].avg = audio_levels[1].avg = 0;
+	audio_stats_init( &audio_stats[0], 2, 4 );
+	audio_stats_init( &audio_stats[1], 2, 4 );
+	audio_stats[0].contiguous = 0;
+	audio_stats[1].contiguous = 0;
+	audio_loudness_reset( &loudness );
+	loudness_last = timer_read();
+
+	// Start the sample timer; it re-arms itself from now on
+	audio_sample_tick( 0 );
+	audio_level_tail = audio_ring_head;
 
 	while(1)
 	{
 		msleep( 16 );
-		compute_audio_levels( 0 );
-		compute_audio_levels( 1 );
+		while( compute_audio_levels() )
+			;
 	}
 }
 
 TASK_CREATE( "audio_level_task", compute_audio_level_task, 0, 0x1e, 0x1000 );
 
 
+/** Shadow copy of the AK4646 registers.
+ *
+ * Settings are staged into the shadow and audio_ic_flush() writes
+ * only the registers whose values changed, so reapplying all of
+ * the user settings costs a handful of SIO writes instead of a
+ * read-modify-write for every field.  audio_ic_sync() reloads the
+ * shadow from the chip at startup and when the Canon code has
+ * changed it.
+ *
+ * Commands are 0x2000 + (register << 8) + value.
+ */
+#define AUDIO_IC_BASE		0x20
+#define AUDIO_IC_REGS		0x50
+#define AUDIO_IC_REG(cmd)	( (((cmd) >> 8) & 0xFF) - AUDIO_IC_BASE )
+
+static struct
+{
+	int			valid;
+	uint8_t			regs[ AUDIO_IC_REGS ];
+	uint32_t		dirty[ (AUDIO_IC_REGS + 31) / 32 ];
+} audio_shadow;
+
+
+/** Registers that are known to exist, for the sync and the log */
+static const uint16_t audio_regs[] = {
+	AUDIO_IC_PM1,
+	AUDIO_IC_PM2,
+	AUDIO_IC_SIG1,
+	AUDIO_IC_SIG2,
+	AUDIO_IC_ALC1,
+	AUDIO_IC_ALC2,
+	AUDIO_IC_IVL,
+	AUDIO_IC_IVR,
+	AUDIO_IC_OVL,
+	AUDIO_IC_OVR,
+	AUDIO_IC_ALCVOL,
+	AUDIO_IC_MODE3,
+	AUDIO_IC_MODE4,
+	AUDIO_IC_PM3,
+	AUDIO_IC_FIL1,
+	AUDIO_IC_HPF0,
+	AUDIO_IC_HPF1,
+	AUDIO_IC_HPF2,
+	AUDIO_IC_HPF3,
+	AUDIO_IC_LPF0,
+	AUDIO_IC_LPF1,
+	AUDIO_IC_LPF2,
+	AUDIO_IC_LPF3,
+};
+
+
+static inline uint8_t
+audio_ic_get(
+	unsigned		cmd
+)
+{
+	return audio_shadow.regs[ AUDIO_IC_REG(cmd) ];
+}
+
+
+/** Stage a new value; it is written by the next flush if it differs */
+static void
+audio_ic_set(
+	unsigned		cmd,
+	uint8_t			value
+)
+{
+	const unsigned reg = AUDIO_IC_REG(cmd);
+	if( reg >= AUDIO_IC_REGS )
+		return;
+	if( audio_shadow.regs[reg] == value )
+		return;
+
+	audio_shadow.regs[reg] = value;
+	audio_shadow.dirty[ reg / 32 ] |= 1 << (reg % 32);
+}
+
+
+/** Stage a change to some of the bits of a register */
+static inline void
+audio_ic_update(
+	unsigned		cmd,
+	uint8_t			clear,
+	uint8_t			set
+)
+{
+	audio_ic_set( cmd, (audio_ic_get( cmd ) & ~clear) | set );
+}
+
+
+/** Order in which audio_configure() has always programmed the chip:
+ * power first, the LPF coefficients before the LPF is enabled in
+ * FIL1, and the output mode last.  Registers that are not listed are
+ * written after these in address order.
+ */
+static const uint16_t audio_flush_order[] = {
+	AUDIO_IC_PM1,
+	AUDIO_IC_SIG1,
+	AUDIO_IC_SIG2,
+	AUDIO_IC_PM3,
+	AUDIO_IC_ALC1,
+	AUDIO_IC_MODE4,
+	AUDIO_IC_IVR,
+	AUDIO_IC_IVL,
+	AUDIO_IC_LPF0,
+	AUDIO_IC_LPF1,
+	AUDIO_IC_LPF2,
+	AUDIO_IC_LPF3,
+	AUDIO_IC_FIL1,
+	AUDIO_IC_MODE3,
+};
+
+
+static unsigned
+audio_ic_flush_reg(
+	unsigned		reg
+)
+{
+	const uint32_t bit = 1 << (reg % 32);
+	if( (audio_shadow.dirty[ reg / 32 ] & bit) == 0 )
+		return 0;
+
+	audio_shadow.dirty[ reg / 32 ] &= ~bit;
+	audio_ic_write( ((reg + AUDIO_IC_BASE) << 8) | audio_shadow.regs[reg] );
+	return 1;
+}
+
+
+/** Write the changed registers in audio_flush_order.  Each one is
+ * written once with its final value, so the mic gain bits go out
+ * with the first SIG1 and SIG2 writes instead of a second pass.
+ * Returns the number of writes.
+ */
+static unsigned
+audio_ic_flush( void )
+{
+	unsigned writes = 0;
+	unsigned i;
+
+	for( i=0 ; i<COUNT(audio_flush_order) ; i++ )
+		writes += audio_ic_flush_reg( AUDIO_IC_REG( audio_flush_order[i] ) );
+
+	for( i=0 ; i<AUDIO_IC_REGS ; i++ )
+		writes += audio_ic_flush_reg( i );
+
+	return writes;
+}
+
+
+/** Reload the shadow from the chip, discarding any staged changes */
+static void
+audio_ic_sync( void )
+{
+	unsigned i;
+	for( i=0 ; i<COUNT(audio_regs) ; i++ )
+		audio_shadow.regs[ AUDIO_IC_REG( audio_regs[i] ) ]
+			= audio_ic_read( audio_regs[i] );
+
+	for( i=0 ; i<COUNT(audio_shadow.dirty) ; i++ )
+		audio_shadow.dirty[i] = 0;
+
+	audio_shadow.valid = 1;
+}
+
+
 /** Write the MGAIN2-0 bits.
  * Table 19 for the gain values:
  *
@@ -348,18 +1185,8 @@ audio_ic_set_mgain(
 )
 {
 	bits &= 0x7;
-	unsigned sig1 = audio_ic_read( AUDIO_IC_SIG1 );
-	sig1 &= ~0x3;
-	sig1 |= (bits & 1);
-	sig1 |= (bits & 4) >> 1;
-	audio_ic_write( AUDIO_IC_SIG1 | sig1 );
-	gain.sig1 = sig1;
-
-	unsigned sig2 = audio_ic_read( AUDIO_IC_SIG2 );
-	sig2 &= ~(1<<5);
-	sig2 |= (bits & 2) << 4;
-	audio_ic_write( AUDIO_IC_SIG2 | sig2 );
-	gain.sig2 = sig2;
+	audio_ic_update( AUDIO_IC_SIG1, 0x3, (bits & 1) | (bits & 4) >> 1 );
+	audio_ic_update( AUDIO_IC_SIG2, 1<<5, (bits & 2) << 4 );
 }
 
 
@@ -381,45 +1208,16 @@ audio_ic_set_input_volume(
 	int			gain
 )
 {
-	unsigned cmd = audio_gain_to_cmd( gain );
-	if( channel )
-		cmd |= AUDIO_IC_IVL;
-	else
-		cmd |= AUDIO_IC_IVR;
-
-	audio_ic_write( cmd );
+	audio_ic_set(
+		channel ? AUDIO_IC_IVL : AUDIO_IC_IVR,
+		audio_gain_to_cmd( gain )
+	);
 }
 
 
 #ifdef CONFIG_AUDIO_REG_LOG
 
 // Do not write the value; just read them and record to a logfile
-static uint16_t audio_regs[] = {
-	AUDIO_IC_PM1,
-	AUDIO_IC_PM2,
-	AUDIO_IC_SIG1,
-	AUDIO_IC_SIG2,
-	AUDIO_IC_ALC1,
-	AUDIO_IC_ALC2,
-	AUDIO_IC_IVL,
-	AUDIO_IC_IVR,
-	AUDIO_IC_OVL,
-	AUDIO_IC_OVR,
-	AUDIO_IC_ALCVOL,
-	AUDIO_IC_MODE3,
-	AUDIO_IC_MODE4,
-	AUDIO_IC_PM3,
-	AUDIO_IC_FIL1,
-	AUDIO_IC_HPF0,
-	AUDIO_IC_HPF1,
-	AUDIO_IC_HPF2,
-	AUDIO_IC_HPF3,
-	AUDIO_IC_LPF0,
-	AUDIO_IC_LPF1,
-	AUDIO_IC_LPF2,
-	AUDIO_IC_LPF3,
-};
-
 static const char * audio_reg_names[] = {
 	"AUDIO_IC_PM1",
 	"AUDIO_IC_PM2",
@@ -500,39 +1298,49 @@ audio_configure( int force )
 	return;
 #endif
 
+	if( !audio_shadow.valid )
+		audio_ic_sync();
+	else
 	if( !force )
 	{
 		// Check for ALC configuration; do nothing if it is
-		// already disabled
-		if( audio_ic_read( AUDIO_IC_ALC1 ) == gain.alc1
-		&&  audio_ic_read( AUDIO_IC_SIG1 ) == gain.sig1
-		&&  audio_ic_read( AUDIO_IC_SIG2 ) == gain.sig2
+		// still what we left it as
+		if( audio_ic_read( AUDIO_IC_ALC1 ) == audio_ic_get( AUDIO_IC_ALC1 )
+		&&  audio_ic_read( AUDIO_IC_SIG1 ) == audio_ic_get( AUDIO_IC_SIG1 )
+		&&  audio_ic_read( AUDIO_IC_SIG2 ) == audio_ic_get( AUDIO_IC_SIG2 )
 		)
 			return;
 		DebugMsg( DM_AUDIO, 3, "%s: Reseting user settings", __func__ );
+
+		// The Canon code may have changed any of the registers,
+		// not only the ones checked above, so start from what is
+		// really in the chip
+		audio_ic_sync();
 	}
 
-	audio_ic_write( AUDIO_IC_PM1 | 0x6D ); // power up ADC and DAC
-	audio_ic_write( AUDIO_IC_SIG1
+	// Menu changes only stage into the shadow, which is in sync
+	// with the chip, so only the registers that differ are written
+
+	audio_ic_set( AUDIO_IC_PM1, 0x6D ); // power up ADC and DAC
+	audio_ic_set( AUDIO_IC_SIG1, 0
 		| 0x10
 		| ( mic_power ? 0x4 : 0x0 )
 	); // power up, no gain
 
-	audio_ic_write( AUDIO_IC_SIG2
+	audio_ic_set( AUDIO_IC_SIG2, 0
 		| 0x04 // external, no gain
 		| ( lovl & 0x3) << 0 // line output level
 	);
 
 	if( mic_in )
-		audio_ic_write( AUDIO_IC_PM3 | 0x00 ); // internal mic
+		audio_ic_set( AUDIO_IC_PM3, 0x00 ); // internal mic
 	else
-		audio_ic_write( AUDIO_IC_PM3 | 0x07 ); // external input
+		audio_ic_set( AUDIO_IC_PM3, 0x07 ); // external input
 
-	gain.alc1 = alc_enable ? (1<<5) : 0;
-	audio_ic_write( AUDIO_IC_ALC1 | gain.alc1 ); // disable all ALC
+	audio_ic_set( AUDIO_IC_ALC1, alc_enable ? (1<<5) : 0 ); // disable all ALC
 
 	// Control left/right gain independently
-	audio_ic_write( AUDIO_IC_MODE4 | 0x00 );
+	audio_ic_set( AUDIO_IC_MODE4, 0x00 );
 
 	audio_ic_set_input_volume( 0, dgain_r );
 	audio_ic_set_input_volume( 1, dgain_l );
@@ -543,31 +1351,29 @@ audio_configure( int force )
 	audio_ic_set_mgain( mgain ); // 10 dB
 
 	// Disable the HPF
-	//audio_ic_write( AUDIO_IC_HPF0 | 0x00 );
-	//audio_ic_write( AUDIO_IC_HPF1 | 0x00 );
-	//audio_ic_write( AUDIO_IC_HPF2 | 0x00 );
-	//audio_ic_write( AUDIO_IC_HPF3 | 0x00 );
+	//audio_ic_set( AUDIO_IC_HPF0, 0x00 );
+	//audio_ic_set( AUDIO_IC_HPF1, 0x00 );
+	//audio_ic_set( AUDIO_IC_HPF2, 0x00 );
+	//audio_ic_set( AUDIO_IC_HPF3, 0x00 );
 
 	// Enable the LPF
 	// Canon uses F2A/B = 0x0ED4 and 0x3DA9.
-	audio_ic_write( AUDIO_IC_LPF0 | 0xD4 );
-	audio_ic_write( AUDIO_IC_LPF1 | 0x0E );
-	audio_ic_write( AUDIO_IC_LPF2 | 0xA9 );
-	audio_ic_write( AUDIO_IC_LPF3 | 0x3D );
-	audio_ic_write( AUDIO_IC_FIL1
-		| audio_ic_read( AUDIO_IC_FIL1 )
-		| (1<<5)
-	);
+	audio_ic_set( AUDIO_IC_LPF0, 0xD4 );
+	audio_ic_set( AUDIO_IC_LPF1, 0x0E );
+	audio_ic_set( AUDIO_IC_LPF2, 0xA9 );
+	audio_ic_set( AUDIO_IC_LPF3, 0x3D );
+	audio_ic_update( AUDIO_IC_FIL1, 0, 1<<5 );
 
 	// Enable loop mode and output digital volume2
-	uint32_t mode3 = audio_ic_read( AUDIO_IC_MODE3 );
-	mode3 &= ~0x5C; // disable loop, olvc, datt0/1
-	audio_ic_write( AUDIO_IC_MODE3
-		| mode3				// old value
-		| loopback << 6		// loop mode
-		| (o2gain & 0x3) << 2	// output volume
+	audio_ic_update( AUDIO_IC_MODE3,
+		0x5C,				// disable loop, olvc, datt0/1
+		0
+		| loopback << 6			// loop mode
+		| (o2gain & 0x3) << 2		// output volume
 	);
 
+	const unsigned writes = audio_ic_flush();
+
 	//draw_audio_regs();
 	bmp_printf( FONT_SMALL, 500, 400,
 		"Gain %d/%d Mgain %d",
@@ -577,10 +1383,11 @@ audio_configure( int force )
 	);
 
 	DebugMsg( DM_AUDIO, 3,
-		"Gain mgain=%d dgain=%d/%d",
+		"Gain mgain=%d dgain=%d/%d (%d writes)",
 		mgain,
 		dgain_l,
-		dgain_r
+		dgain_r,
+		writes
 	);
 }
 
@@ -728,6 +1535,30 @@ audio_loopback_display( void * priv, int x, int y, int selected )
 	);
 }
 
+static void
+audio_spectrum_display( void * priv, int x, int y, int selected )
+{
+	bmp_printf(
+		selected ? MENU_FONT_SEL : MENU_FONT,
+		x, y,
+		//23456789012
+		"Spectrum:   %s",
+		spectrum_draw ? "ON " : "OFF"
+	);
+}
+
+static void
+audio_loudness_display( void * priv, int x, int y, int selected )
+{
+	bmp_printf(
+		selected ? MENU_FONT_SEL : MENU_FONT,
+		x, y,
+		//23456789012
+		"Loudness:   %s",
+		loudness_graph ? "ON " : "OFF"
+	);
+}
+
 static struct menu_entry audio_menus[] = {
 	{
 		.priv		= &lovl,
@@ -771,6 +1602,16 @@ static struct menu_entry audio_menus[] = {
 		.select		= audio_binary_toggle,
 		.display	= audio_loopback_display,
 	},
+	{
+		.priv		= &spectrum_draw,
+		.select		= menu_binary_toggle,
+		.display	= audio_spectrum_display,
+	},
+	{
+		.priv		= &loudness_graph,
+		.select		= menu_binary_toggle,
+		.display	= audio_loudness_display,
+	},
 #ifdef CONFIG_AUDIO_REG_LOG
 	{
 		.priv		= "Close register log",
@@ -789,10 +1630,12 @@ enable_recording(
 {
 	switch( mode )
 	{
-	case 0:
-		// Movie recording stopped;  (fallthrough)
 	case 2:
-		// Movie recording started
+		// Movie recording started; measure its loudness
+		loudness_reset = 1;
+		// (fallthrough)
+	case 0:
+		// Movie recording stopped
 		give_semaphore( gain.sem );
 		break;
 	case 1:
@@ -811,6 +1654,8 @@ enable_meters(
 {
 	loopback = do_draw_meters = !mode;
 	audio_configure( 1 );
+	meters_invalidate();
+	spectrum_valid = 0;
 }
 
 
@@ -819,14 +1664,12 @@ PROP_HANDLER( PROP_LV_ACTION )
 {
 	const unsigned mode = buf[0];
 	enable_meters( mode );
-	return prop_cleanup( token, property );
 }
 
 PROP_HANDLER( PROP_MVR_REC_START )
 {
 	const unsigned mode = buf[0];
 	enable_recording( mode );
-	return prop_cleanup( token, property );
 }
 
 
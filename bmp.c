@@ -30,6 +30,71 @@
 #include <stdarg.h>
 
 
+/** Ring of recently damaged rectangles.
+ * The sequence number only ever increases; entry seq % BMP_DAMAGE_RING
+ * holds the rectangle for that sequence number.
+ */
+#define BMP_DAMAGE_RING		16
+
+static struct {
+	uint16_t		x0, y0, x1, y1;
+} bmp_damage_ring[ BMP_DAMAGE_RING ];
+
+static volatile unsigned bmp_damage_seq;
+
+
+void
+bmp_damage(
+	uint32_t		x,
+	uint32_t		y,
+	uint32_t		w,
+	uint32_t		h
+)
+{
+	const unsigned seq = bmp_damage_seq;
+	const unsigned i = seq % BMP_DAMAGE_RING;
+
+	bmp_damage_ring[i].x0	= x;
+	bmp_damage_ring[i].y0	= y;
+	bmp_damage_ring[i].x1	= x + w;
+	bmp_damage_ring[i].y1	= y + h;
+
+	bmp_damage_seq = seq + 1;
+}
+
+
+int
+bmp_damaged(
+	uint32_t		x,
+	uint32_t		y,
+	uint32_t		w,
+	uint32_t		h,
+	unsigned *		last_seq
+)
+{
+	const unsigned seq = bmp_damage_seq;
+	unsigned i = *last_seq;
+	*last_seq = seq;
+
+	// If we have fallen too far behind, assume the worst
+	if( seq - i > BMP_DAMAGE_RING )
+		return 1;
+
+	for( ; i != seq ; i++ )
+	{
+		const unsigned j = i % BMP_DAMAGE_RING;
+		if( bmp_damage_ring[j].x0 < x + w
+		&&  bmp_damage_ring[j].x1 > x
+		&&  bmp_damage_ring[j].y0 < y + h
+		&&  bmp_damage_ring[j].y1 > y
+		)
+			return 1;
+	}
+
+	return 0;
+}
+
+
 static void
 _draw_char(
 	unsigned	fontspec,
@@ -99,6 +164,8 @@ bmp_puts(
 	if( !vram || ((uintptr_t)vram & 1) == 1 )
 		return;
 	const unsigned initial_x = *x;
+	const unsigned initial_y = *y;
+	unsigned max_x = initial_x;
 	uint8_t * first_row = vram + (*y) * pitch + (*x);
 	uint8_t * row = first_row;
 
@@ -119,8 +186,16 @@ bmp_puts(
 		_draw_char( fontspec, row, c );
 		row += font->width;
 		(*x) += font->width;
+		if( *x > max_x )
+			max_x = *x;
 	}
 
+	bmp_damage(
+		initial_x,
+		initial_y,
+		max_x - initial_x,
+		*y + font->height - initial_y
+	);
 }
 
 
@@ -159,6 +234,9 @@ con_printf(
 	int len = vsnprintf( buf, sizeof(buf), fmt, ap );
 	va_end( ap );
 
+	// The console wraps around the screen; not worth being precise
+	bmp_damage( 0, 0, bmp_width(), bmp_height() );
+
 	const uint32_t		pitch = bmp_pitch();
 	uint8_t * vram = bmp_vram();
 	if( !vram )
@@ -284,6 +362,7 @@ bmp_fill(
 		return;
 	}
 
+	bmp_damage( start, y, w, y_end - y );
 
 	for( ; y<y_end ; y++, row += pitch/4 )
 	{
@@ -301,6 +380,306 @@ bmp_fill(
 }
 
 
+/** Write one horizontal span of solid color into a row.
+ * The unaligned head and tail are written a byte at a time,
+ * everything in between as whole words.
+ */
+static void
+bmp_span(
+	uint8_t *		row,
+	uint32_t		x0,
+	uint32_t		x1,
+	uint8_t			color
+)
+{
+	while( x0 < x1 && (x0 & 3) )
+		row[ x0++ ] = color;
+
+	const uint32_t word = color_word( color );
+	uint32_t * wrow = (uint32_t*) row;
+
+	for( ; x0 + 4 <= x1 ; x0 += 4 )
+		wrow[ x0/4 ] = word;
+
+	while( x0 < x1 )
+		row[ x0++ ] = color;
+}
+
+
+void
+bmp_draw_sprite(
+	const struct bmp_sprite *	sprite,
+	uint32_t			x,
+	uint32_t			y
+)
+{
+	uint8_t * const vram = bmp_vram();
+	if( !vram || ( 1 & (uintptr_t) vram ) )
+		return;
+	if( !sprite )
+		return;
+
+	const uint32_t width = bmp_width();
+	const uint32_t pitch = bmp_pitch();
+	const uint8_t * run = sprite->runs;
+	uint32_t y_end = y + sprite->height;
+	if( y_end > bmp_height() )
+		y_end = bmp_height();
+
+	bmp_damage( x, y, sprite->width, y_end - y );
+
+	uint8_t * row = vram + y * pitch;
+
+	for( ; y < y_end ; y++, row += pitch )
+	{
+		uint32_t px = x;
+		uint8_t count;
+
+		while( (count = *run++) )
+		{
+			const uint8_t color = *run++;
+			uint32_t end = px + count;
+			if( end > width )
+				end = width;
+
+			if( color != COLOR_EMPTY && px < end )
+				bmp_span( row, px, end, color );
+
+			px += count;
+		}
+	}
+}
+
+
+void
+bmp_hline(
+	uint8_t			color,
+	uint32_t		x0,
+	uint32_t		x1,
+	uint32_t		y
+)
+{
+	uint8_t * const vram = bmp_vram();
+	if( !vram || ( 1 & (uintptr_t) vram ) )
+		return;
+	if( y >= bmp_height() )
+		return;
+	if( x1 > bmp_width() )
+		x1 = bmp_width();
+	if( x0 >= x1 )
+		return;
+
+	bmp_span( vram + y * bmp_pitch(), x0, x1, color );
+	bmp_damage( x0, y, x1 - x0, 1 );
+}
+
+
+void
+bmp_vline(
+	uint8_t			color,
+	uint32_t		x,
+	uint32_t		y0,
+	uint32_t		y1
+)
+{
+	uint8_t * const vram = bmp_vram();
+	if( !vram || ( 1 & (uintptr_t) vram ) )
+		return;
+	if( x >= bmp_width() )
+		return;
+	if( y1 > bmp_height() )
+		y1 = bmp_height();
+	if( y0 >= y1 )
+		return;
+
+	const uint32_t pitch = bmp_pitch();
+	uint8_t * col = vram + y0 * pitch + x;
+	uint32_t y;
+
+	for( y=y0 ; y<y1 ; y++, col += pitch )
+		*col = color;
+
+	bmp_damage( x, y0, 1, y1 - y0 );
+}
+
+
+void
+bmp_rect(
+	uint8_t			color,
+	uint32_t		x,
+	uint32_t		y,
+	uint32_t		w,
+	uint32_t		h
+)
+{
+	if( w == 0 || h == 0 )
+		return;
+
+	bmp_hline( color, x, x + w, y );
+	bmp_hline( color, x, x + w, y + h - 1 );
+	bmp_vline( color, x, y + 1, y + h - 1 );
+	bmp_vline( color, x + w - 1, y + 1, y + h - 1 );
+}
+
+
+static inline void
+bmp_plot(
+	uint8_t *		vram,
+	uint8_t			color,
+	int			x,
+	int			y
+)
+{
+	if( x < 0 || y < 0
+	||  x >= (int) bmp_width()
+	||  y >= (int) bmp_height()
+	)
+		return;
+
+	vram[ x + y * bmp_pitch() ] = color;
+}
+
+
+/** Record damage for a bounding box that may be partly offscreen */
+static void
+bmp_damage_clip(
+	int			x0,
+	int			y0,
+	int			x1,
+	int			y1
+)
+{
+	if( x0 < 0 )
+		x0 = 0;
+	if( y0 < 0 )
+		y0 = 0;
+	if( x1 > (int) bmp_width() )
+		x1 = bmp_width();
+	if( y1 > (int) bmp_height() )
+		y1 = bmp_height();
+	if( x0 >= x1 || y0 >= y1 )
+		return;
+
+	bmp_damage( x0, y0, x1 - x0, y1 - y0 );
+}
+
+
+/** Bresenham line, one pixel at a time.
+ * Horizontal and vertical lines are handed to the span routines.
+ */
+void
+bmp_line(
+	uint8_t			color,
+	int			x0,
+	int			y0,
+	int			x1,
+	int			y1
+)
+{
+	if( y0 == y1 && y0 >= 0 )
+	{
+		if( x0 > x1 )
+		{
+			int t = x0; x0 = x1; x1 = t;
+		}
+		if( x1 >= 0 )
+			bmp_hline( color, x0 < 0 ? 0 : x0, x1 + 1, y0 );
+		return;
+	}
+
+	if( x0 == x1 && x0 >= 0 )
+	{
+		if( y0 > y1 )
+		{
+			int t = y0; y0 = y1; y1 = t;
+		}
+		if( y1 >= 0 )
+			bmp_vline( color, x0, y0 < 0 ? 0 : y0, y1 + 1 );
+		return;
+	}
+
+	uint8_t * const vram = bmp_vram();
+	if( !vram || ( 1 & (uintptr_t) vram ) )
+		return;
+
+	const int dx = x1 > x0 ? x1 - x0 : x0 - x1;
+	const int dy = y1 > y0 ? y1 - y0 : y0 - y1;
+	const int sx = x1 > x0 ? 1 : -1;
+	const int sy = y1 > y0 ? 1 : -1;
+	int err = dx - dy;
+
+	bmp_damage_clip(
+		x0 < x1 ? x0 : x1,
+		y0 < y1 ? y0 : y1,
+		(x0 < x1 ? x1 : x0) + 1,
+		(y0 < y1 ? y1 : y0) + 1
+	);
+
+	while(1)
+	{
+		bmp_plot( vram, color, x0, y0 );
+		if( x0 == x1 && y0 == y1 )
+			break;
+
+		const int e2 = 2 * err;
+		if( e2 > -dy )
+		{
+			err -= dy;
+			x0 += sx;
+		}
+		if( e2 < dx )
+		{
+			err += dx;
+			y0 += sy;
+		}
+	}
+}
+
+
+/** Midpoint circle outline, all eight octants per step */
+void
+bmp_circle(
+	uint8_t			color,
+	int			cx,
+	int			cy,
+	int			r
+)
+{
+	uint8_t * const vram = bmp_vram();
+	if( !vram || ( 1 & (uintptr_t) vram ) )
+		return;
+	if( r <= 0 )
+		return;
+
+	int x = r;
+	int y = 0;
+	int err = 1 - r;
+
+	bmp_damage_clip( cx - r, cy - r, cx + r + 1, cy + r + 1 );
+
+	while( x >= y )
+	{
+		bmp_plot( vram, color, cx + x, cy + y );
+		bmp_plot( vram, color, cx - x, cy + y );
+		bmp_plot( vram, color, cx + x, cy - y );
+		bmp_plot( vram, color, cx - x, cy - y );
+		bmp_plot( vram, color, cx + y, cy + x );
+		bmp_plot( vram, color, cx - y, cy + x );
+		bmp_plot( vram, color, cx + y, cy - x );
+		bmp_plot( vram, color, cx - y, cy - x );
+
+		y++;
+		if( err < 0 )
+			err += 2 * y + 1;
+		else
+		{
+			x--;
+			err += 2 * (y - x) + 1;
+		}
+	}
+}
+
+
 /** Draw a picture of the BMP color palette. */
 void
 bmp_draw_palette( void )
@@ -329,8 +708,6 @@ bmp_draw_palette( void )
 	written = 1;
 }
 
-int retry_count = 0;
-
 
 size_t
 read_file(
@@ -353,79 +730,383 @@ read_file(
 }
 
 
-/** Load a BMP file into memory so that it can be drawn onscreen */
-struct bmp_file_t *
+/** Streaming reader for bmp_load().
+ * The file is read through FIO in fixed size chunks so that only
+ * the decoded sprite is ever held in memory.
+ */
+#define BMP_CHUNK		2048
+
+struct bmp_stream
+{
+	FILE *			file;
+	uint8_t *		buf;
+	uint32_t		len;
+	uint32_t		pos;
+	uint32_t		offset;		//!< File offset of the next byte
+};
+
+
+/** Returns the next byte of the file or -1 at the end */
+static int
+bmp_getc(
+	struct bmp_stream *	s
+)
+{
+	if( s->pos >= s->len )
+	{
+		ssize_t rc = FIO_ReadFile( s->file, s->buf, BMP_CHUNK );
+		if( rc <= 0 )
+			return -1;
+		s->len = rc;
+		s->pos = 0;
+	}
+
+	s->offset++;
+	return s->buf[ s->pos++ ];
+}
+
+
+/** Sprite under construction.
+ * Rows are encoded in file order into a growing buffer with the
+ * start of each row noted, then put back in top-down order.
+ */
+struct bmp_builder
+{
+	uint8_t *		runs;
+	uint32_t		size;
+	uint32_t		alloc;
+	uint32_t *		rows;		//!< Offset of each row, file order
+	uint32_t		width;
+	uint32_t		height;
+	uint32_t		row;		//!< Current row, file order
+	uint32_t		x;		//!< Pixels in the current row
+	uint32_t		count;		//!< Pending run
+	uint8_t			color;
+	int			fail;
+};
+
+
+static void
+bmp_put(
+	struct bmp_builder *	b,
+	uint8_t			byte
+)
+{
+	if( b->size >= b->alloc )
+	{
+		const uint32_t alloc = b->alloc ? b->alloc * 2 : 1024;
+		uint8_t * runs = realloc( b->runs, alloc );
+		if( !runs )
+		{
+			b->fail = 1;
+			return;
+		}
+
+		b->runs = runs;
+		b->alloc = alloc;
+	}
+
+	b->runs[ b->size++ ] = byte;
+}
+
+
+static void
+bmp_flush(
+	struct bmp_builder *	b
+)
+{
+	while( b->count )
+	{
+		const uint32_t n = b->count > 255 ? 255 : b->count;
+		bmp_put( b, n );
+		bmp_put( b, b->color );
+		b->count -= n;
+	}
+}
+
+
+/** Append n pixels of one color to the current row, clipped to the width */
+static void
+bmp_pixels(
+	struct bmp_builder *	b,
+	uint8_t			color,
+	uint32_t		n
+)
+{
+	if( b->row >= b->height || b->x >= b->width )
+		return;
+	if( n > b->width - b->x )
+		n = b->width - b->x;
+
+	if( color != b->color )
+	{
+		bmp_flush( b );
+		b->color = color;
+	}
+
+	b->count += n;
+	b->x += n;
+}
+
+
+/** Terminate the current row and start the next one.
+ * Trailing transparent pixels are dropped; the blitter stops at
+ * the end of the row anyway.
+ */
+static void
+bmp_row_end(
+	struct bmp_builder *	b
+)
+{
+	if( b->row >= b->height )
+		return;
+
+	if( b->color != COLOR_EMPTY )
+		bmp_flush( b );
+
+	b->count = 0;
+	b->color = COLOR_EMPTY;
+	b->x = 0;
+	bmp_put( b, 0 );
+
+	if( ++b->row < b->height )
+		b->rows[ b->row ] = b->size;
+}
+
+
+static int
+bmp_decode_raw(
+	struct bmp_stream *	s,
+	struct bmp_builder *	b,
+	unsigned		bpp
+)
+{
+	const uint32_t stride = ( (b->width * bpp + 31) / 32 ) * 4;
+
+	while( b->row < b->height )
+	{
+		uint32_t i;
+		for( i=0 ; i<stride ; i++ )
+		{
+			int c = bmp_getc( s );
+			if( c < 0 )
+				return -1;
+
+			if( bpp == 8 )
+			{
+				bmp_pixels( b, c, 1 );
+			} else {
+				bmp_pixels( b, (c >> 4) & 0xF, 1 );
+				bmp_pixels( b, (c >> 0) & 0xF, 1 );
+			}
+		}
+
+		bmp_row_end( b );
+	}
+
+	return 0;
+}
+
+
+/** RLE8: (count,color) pairs, or an escape with a zero count:
+ * 0 = end of line, 1 = end of bitmap, 2 = delta (dx,dy) and
+ * anything else is a word-padded literal run of that length.
+ * Pixels skipped by deltas or the end codes are transparent.
+ */
+static int
+bmp_decode_rle8(
+	struct bmp_stream *	s,
+	struct bmp_builder *	b
+)
+{
+	while( b->row < b->height )
+	{
+		const int n = bmp_getc( s );
+		const int c = bmp_getc( s );
+		if( n < 0 || c < 0 )
+			return -1;
+
+		if( n )
+		{
+			bmp_pixels( b, c, n );
+			continue;
+		}
+
+		if( c == 0 )
+		{
+			bmp_row_end( b );
+		} else
+		if( c == 1 )
+		{
+			break;
+		} else
+		if( c == 2 )
+		{
+			const int dx = bmp_getc( s );
+			const int dy = bmp_getc( s );
+			if( dx < 0 || dy < 0 )
+				return -1;
+
+			const uint32_t x = b->x + dx;
+			int i;
+			for( i=0 ; i<dy ; i++ )
+				bmp_row_end( b );
+
+			bmp_pixels( b, COLOR_EMPTY, x - b->x );
+		} else {
+			int i;
+			for( i=0 ; i<c ; i++ )
+			{
+				const int p = bmp_getc( s );
+				if( p < 0 )
+					return -1;
+				bmp_pixels( b, p, 1 );
+			}
+
+			if( c & 1 )
+				bmp_getc( s );
+		}
+	}
+
+	// Anything not covered is transparent
+	while( b->row < b->height )
+		bmp_row_end( b );
+
+	return 0;
+}
+
+
+/** Load a BMP file as a sprite so that it can be drawn onscreen.
+ *
+ * 8 bpp, 4 bpp and RLE8 files are supported.  The palette is
+ * ignored and pixel values are used as bitmap palette indices.
+ * The sprite and its runs are a single allocation; free() it
+ * when it is no longer needed.
+ */
+struct bmp_sprite *
 bmp_load(
 	const char *		filename
 )
 {
-	unsigned size;
-	if( FIO_GetFileSize( filename, &size ) != 0 )
-		goto getfilesize_fail;
+	struct bmp_sprite * sprite = NULL;
+	struct bmp_file_t hdr;
+	struct bmp_stream s = {
+		.file		= INVALID_PTR,
+	};
+	struct bmp_builder b = {
+		.color		= COLOR_EMPTY,
+	};
+
+	s.buf = malloc( BMP_CHUNK );
+	if( !s.buf )
+		goto malloc_fail;
 
-	DebugMsg( DM_MAGIC, 3, "File '%s' size %d bytes",
-		filename,
-		size
-	);
+	s.file = FIO_Open( filename, O_RDONLY | O_SYNC );
+	if( s.file == INVALID_PTR )
+	{
+		DebugMsg( DM_MAGIC, 3, "%s: open failed", filename );
+		goto open_fail;
+	}
 
-	uint8_t * buf = malloc( size );
-	if( !buf )
+	uint32_t i;
+	for( i=0 ; i<sizeof(hdr) ; i++ )
 	{
-		DebugMsg( DM_MAGIC, 3, "%s: malloc failed", filename );
-		goto malloc_fail;
+		int c = bmp_getc( &s );
+		if( c < 0 )
+			goto read_fail;
+		((uint8_t*) &hdr)[i] = c;
 	}
 
-retry:
-	// Retry a few times if necessary
-	DebugMsg( DM_MAGIC, 3, "%s: try %d\n", __func__, retry_count );
+	const uint32_t image_offset = (uint32_t) hdr.image;
+	const int32_t height = (int32_t) hdr.height;
+	const int bottom_up = height > 0;
 
-	size_t i;
-	for( i=0 ; i<size; i++ )
-		buf[i] = 'A' + i;
-	size_t rc = read_file( filename, buf, size );
-	if( rc != size )
+	DebugMsg( DM_MAGIC, 3, "%s: %dx%d @ %d bpp compression %d",
+		filename,
+		hdr.width,
+		height,
+		hdr.bits_per_pixel,
+		hdr.compression
+	);
+
+	if( hdr.signature != 0x4D42
+	||  image_offset < sizeof(hdr)
+	||  hdr.width == 0
+	||  hdr.width > 4096
+	||  height == 0
+	||  height > 4096
+	||  height < -4096
+	)
+		goto format_fail;
+
+	const int rle8 = hdr.bits_per_pixel == 8 && hdr.compression == 1;
+	const int raw = hdr.compression == 0
+		&& ( hdr.bits_per_pixel == 8 || hdr.bits_per_pixel == 4 );
+	if( !raw && !rle8 )
+		goto format_fail;
+
+	// Skip the palette; there is no seek, so read through it
+	while( s.offset < image_offset )
+		if( bmp_getc( &s ) < 0 )
+			goto read_fail;
+
+	b.width = hdr.width;
+	b.height = bottom_up ? height : -height;
+	b.rows = malloc( b.height * sizeof(*b.rows) );
+	if( !b.rows )
+		goto rows_fail;
+	b.rows[0] = 0;
+
+	int rc = rle8
+		? bmp_decode_rle8( &s, &b )
+		: bmp_decode_raw( &s, &b, hdr.bits_per_pixel );
+	if( rc < 0 )
 		goto read_fail;
+	if( b.fail )
+		goto decode_fail;
 
+	// Reassemble the rows top down after the header
+	sprite = malloc( sizeof(*sprite) + b.size );
+	if( !sprite )
+		goto decode_fail;
 
-	struct bmp_file_t * bmp = (struct bmp_file_t *) buf;
-	if( bmp->signature != 0x4D42 )
-	{
-		DebugMsg( DM_MAGIC, 3, "%s: signature %04x", filename, bmp->signature );
-		int i;
-		for( i=0 ; i<64; i += 16 )
-			DebugMsg( DM_MAGIC, 3,
-				"%08x: %08x %08x %08x %08x",
-				buf + i,
-				((uint32_t*)(buf + i))[0],
-				((uint32_t*)(buf + i))[1],
-				((uint32_t*)(buf + i))[2],
-				((uint32_t*)(buf + i))[3]
-			);
-		msleep( 100 );
-		if( retry_count++ < 5 )
-			goto retry;
-
-		goto signature_fail;
-	}
+	uint8_t * const runs = (uint8_t*)( sprite + 1 );
+	uint8_t * out = runs;
+	uint32_t y;
 
-	// Update the offset pointer to point to the image data
-	// if it is within bounds
-	const unsigned image_offset = (unsigned) bmp->image;
-	if( image_offset > size )
+	for( y=0 ; y<b.height ; y++ )
 	{
-		DebugMsg( DM_MAGIC, 3, "%s: size too large: %x > %x", filename, image_offset, size );
-		goto offsetsize_fail;
+		const uint8_t * in = &b.runs[
+			b.rows[ bottom_up ? b.height - 1 - y : y ]
+		];
+
+		while( *in )
+		{
+			*out++ = *in++;
+			*out++ = *in++;
+		}
+
+		*out++ = 0;
 	}
 
-	bmp->image = buf + image_offset;
+	sprite->width	= b.width;
+	sprite->height	= b.height;
+	sprite->size	= b.size;
+	sprite->runs	= runs;
 
-	return bmp;
+	DebugMsg( DM_MAGIC, 3, "%s: %d bytes of runs", filename, b.size );
 
-offsetsize_fail:
-signature_fail:
+decode_fail:
 read_fail:
-	free( buf );
+	if( b.rows )
+		free( b.rows );
+rows_fail:
+format_fail:
+	if( b.runs )
+		free( b.runs );
+	FIO_CloseFile( s.file );
+open_fail:
+	free( s.buf );
 malloc_fail:
-getfilesize_fail:
-	return NULL;
+	return sprite;
 }
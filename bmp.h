@@ -155,6 +155,81 @@ bmp_fill(
 );
 
 
+/** Vector primitives.
+ * Horizontal spans are written as aligned words; everything is
+ * clipped to the screen and recorded as damage.
+ * hline and vline cover [x0,x1) and [y0,y1); line includes both ends.
+ */
+extern void
+bmp_hline(
+	uint8_t			color,
+	uint32_t		x0,
+	uint32_t		x1,
+	uint32_t		y
+);
+
+extern void
+bmp_vline(
+	uint8_t			color,
+	uint32_t		x,
+	uint32_t		y0,
+	uint32_t		y1
+);
+
+extern void
+bmp_line(
+	uint8_t			color,
+	int			x0,
+	int			y0,
+	int			x1,
+	int			y1
+);
+
+extern void
+bmp_circle(
+	uint8_t			color,
+	int			cx,
+	int			cy,
+	int			r
+);
+
+/** Rectangle outline */
+extern void
+bmp_rect(
+	uint8_t			color,
+	uint32_t		x,
+	uint32_t		y,
+	uint32_t		w,
+	uint32_t		h
+);
+
+
+/** Damage tracking.
+ *
+ * All of the drawing routines record the rectangles that they touch.
+ * Incremental renderers keep the last sequence number they saw and
+ * ask if anything has drawn over their region since then, so that
+ * they only need to repaint everything when something else overlapped.
+ * If too much has been drawn since the last check it reports damage.
+ */
+extern void
+bmp_damage(
+	uint32_t		x,
+	uint32_t		y,
+	uint32_t		w,
+	uint32_t		h
+);
+
+extern int
+bmp_damaged(
+	uint32_t		x,
+	uint32_t		y,
+	uint32_t		w,
+	uint32_t		h,
+	unsigned *		last_seq
+);
+
+
 /** Some selected colors */
 #define COLOR_EMPTY		0x00 // total transparent
 #define COLOR_BG		0x03 // transparent black
@@ -203,10 +278,43 @@ struct bmp_file_t
 
 SIZE_CHECK_STRUCT( bmp_file_t, 54 );
 
-extern struct bmp_file_t *
+/** Run-length encoded sprite.
+ *
+ * Each row is a list of (count,color) byte pairs, terminated by
+ * a zero count.  Runs longer than 255 pixels are split.  Runs of
+ * COLOR_EMPTY are transparent and the blitter skips them, so a
+ * mostly empty overlay costs a few bytes per row.
+ *
+ * The mksprite script converts a BMP file into a static sprite.
+ */
+struct bmp_sprite
+{
+	uint16_t		width;
+	uint16_t		height;
+	uint32_t		size;		//!< Bytes of run data
+	const uint8_t *		runs;
+};
+
+
+/** Load an 8 bpp, 4 bpp or RLE8 BMP file as a sprite.
+ * The file is streamed in small chunks; the returned sprite is
+ * a single allocation that can be released with free().
+ */
+extern struct bmp_sprite *
 bmp_load(
 	const char *		name
 );
 
+/** Draw a sprite with its top-left corner at x,y.
+ * Opaque runs are written as aligned words where possible and
+ * anything past the edge of the screen is clipped.
+ */
+extern void
+bmp_draw_sprite(
+	const struct bmp_sprite *	sprite,
+	uint32_t			x,
+	uint32_t			y
+);
+
 
 #endif
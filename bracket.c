@@ -122,6 +122,7 @@ bracket_task( void * priv )
 				new_ae
 			);
 			lens_set_ae( new_ae );
+			lens_settings_wait();
 			lens_take_picture( 1000 );
 		}
 
@@ -32,56 +32,371 @@ is_space( char c )
 	return c == ' ' || c == '\t' || c == '\r' || c == '\n';
 }
 
-struct config *
-config_parse_line(
-	const char *		line
+extern struct config_var	_config_vars_start[];
+extern struct config_var	_config_vars_end[];
+
+/** Set if a variable in the section is missing from the index,
+ * which means config-index.c is out of date.  Lookups then fall
+ * back to scanning the section.
+ */
+static int config_index_stale = -1;
+
+static void
+config_index_check( void )
+{
+	struct config_var * var = _config_vars_start;
+	config_index_stale = 0;
+
+	for( ; var < _config_vars_end ; var++ )
+	{
+		if( config_index[ config_index_slot( var->name ) ] == var )
+			continue;
+
+		DebugMsg( DM_MAGIC, 3,
+			"%s: '%s' is not in the index",
+			__func__,
+			var->name
+		);
+		config_index_stale = 1;
+	}
+}
+
+
+struct config_var *
+config_var_find(
+	const char *		name
 )
 {
-	int name_len = 0;
-	int value_len = 0;
-	struct config *		config = malloc( sizeof(*config) );
-	if( !config )
-		goto malloc_error;
+	if( config_index_stale < 0 )
+		config_index_check();
 
-	config->next = 0;
+	if( !config_index_stale )
+	{
+		struct config_var * const var = config_index[ config_index_slot( name ) ];
+		return var && streq( var->name, name ) ? var : NULL;
+	}
 
+	struct config_var * var = _config_vars_start;
+	for( ; var < _config_vars_end ; var++ )
+		if( streq( var->name, name ) )
+			return var;
+
+	return NULL;
+}
+
+
+static unsigned
+config_clamp(
+	const struct config_var *	var,
+	unsigned		value
+)
+{
+	if( var->min >= var->max )
+		return value;
+	if( (int) value < var->min )
+		return var->min;
+	if( (int) value > var->max )
+		return var->max;
+	return value;
+}
+
+
+void
+config_observe(
+	struct config_var *		var,
+	struct config_observer *	observer
+)
+{
+	observer->next = var->observers;
+	var->observers = observer;
+}
+
+
+void
+config_changed(
+	struct config_var *	var
+)
+{
+	struct config_observer * observer = var->observers;
+	for( ; observer ; observer = observer->next )
+		observer->notify( var, observer->arg );
+}
+
+
+void
+config_value_changed(
+	const void *		value
+)
+{
+	struct config_var * var = _config_vars_start;
+	for( ; var < _config_vars_end ; var++ )
+	{
+		if( var->value != value )
+			continue;
+
+		if( var->type == 0 )
+			*(unsigned *) var->value = config_clamp( var, *(unsigned *) value );
+		config_changed( var );
+		return;
+	}
+}
+
+
+int
+config_set(
+	struct config_var *	var,
+	unsigned		value
+)
+{
+	if( var->type != 0 )
+		return -1;
+
+	value = config_clamp( var, value );
+	if( *(unsigned *) var->value == value )
+		return 0;
+
+	*(unsigned *) var->value = value;
+	config_changed( var );
+	return 0;
+}
+
+
+int
+config_set_int(
+	const char *		name,
+	unsigned		value
+)
+{
+	struct config_var * const var = config_var_find( name );
+	return var ? config_set( var, value ) : -1;
+}
+
+
+unsigned
+config_apply(
+	struct config_var * const *	scope,
+	unsigned			scope_count,
+	const struct config_diff *	diffs,
+	unsigned			count
+)
+{
+	struct config_var * var;
+	struct config_var * const * const scope_end = scope + scope_count;
+	const struct config_diff * const end = diffs + count;
+	const struct config_diff * diff = diffs;
+	unsigned changed = 0;
+
+	// Observers are run by a second pass over the changed ones
+	static uint8_t * changed_mask;
+	if( !changed_mask )
+	{
+		const unsigned vars = _config_vars_end - _config_vars_start;
+		changed_mask = malloc( (vars + 7) / 8 );
+		if( !changed_mask )
+			return 0;
+	}
+
+	for( var = _config_vars_start ; var < _config_vars_end ; var++ )
+	{
+		const unsigned i = var - _config_vars_start;
+		changed_mask[ i / 8 ] &= ~( 1 << (i % 8) );
+
+		if( var->type != 0 )
+			continue;
+
+		while( scope < scope_end && *scope < var )
+			scope++;
+		if( scope == scope_end || *scope != var )
+			continue;
+
+		unsigned value = var->def;
+		while( diff < end && diff->var < var )
+			diff++;
+		if( diff < end && diff->var == var )
+			value = config_clamp( var, diff->value );
+
+		if( *(unsigned *) var->value == value )
+			continue;
+
+		*(unsigned *) var->value = value;
+		changed_mask[ i / 8 ] |= 1 << (i % 8);
+		changed++;
+	}
+
+	for( var = _config_vars_start ; changed && var < _config_vars_end ; var++ )
+	{
+		const unsigned i = var - _config_vars_start;
+		if( changed_mask[ i / 8 ] & ( 1 << (i % 8) ) )
+			config_changed( var );
+	}
+
+	return changed;
+}
+
+
+void
+config_notify_semaphore(
+	struct config_var *	var,
+	void *			arg
+)
+{
+	give_semaphore( arg );
+}
+
+
+static void
+config_auto_parse(
+	struct config *		config
+)
+{
+	struct config_var * const var = config_var_find( config->name );
+	if( !var )
+	{
+		DebugMsg( DM_MAGIC, 3,
+			"%s: '%s' unused?",
+			__func__,
+			config->name
+		);
+		return;
+	}
+
+	DebugMsg( DM_MAGIC, 3,
+		"%s: '%s' => '%s'",
+		__func__,
+		config->name,
+		config->value
+	);
+
+	if( var->type == 0 )
+	{
+		*(unsigned*) var->value = config_clamp( var, atoi( config->value ) );
+	} else {
+		*(char **) var->value = config->value;
+	}
+}
+
+
+/** Scratch space for parsing.
+ * Strings are packed up from the bottom and nodes are taken down
+ * from the top, so the file size bounds both and nothing is
+ * allocated per line.
+ */
+struct config_arena
+{
+	char *			base;
+	char *			strings;	//!< First free byte
+	char *			nodes;		//!< Last node handed out
+};
+
+
+/** Every config line needs at least "a=" and a newline, and the name
+ * and value strings with their terminators are never longer than the
+ * line that they came from.
+ */
+static size_t
+config_arena_size(
+	size_t			file_size
+)
+{
+	const size_t strings = (file_size + 1 + 3) & ~3;
+	const size_t nodes = file_size / 3 + 1;
+	return strings + nodes * sizeof(struct config);
+}
+
+
+static char *
+config_arena_strdup(
+	struct config_arena *	arena,
+	const char *		s,
+	size_t			len
+)
+{
+	if( (size_t)( arena->nodes - arena->strings ) < len + 1 )
+		return NULL;
+
+	char * const copy = arena->strings;
+	memcpy( copy, s, len );
+	copy[ len ] = '\0';
+	arena->strings += len + 1;
+	return copy;
+}
+
+
+static struct config *
+config_arena_node(
+	struct config_arena *	arena
+)
+{
+	if( (size_t)( arena->nodes - arena->strings ) < sizeof(struct config) )
+		return NULL;
+
+	arena->nodes -= sizeof(struct config);
+	return (struct config *) arena->nodes;
+}
+
+
+static inline int
+config_arena_owns(
+	const struct config_arena *	arena,
+	const char *		s
+)
+{
+	return s >= arena->base && s < arena->strings;
+}
+
+
+/** Split a line in place and copy it into the arena.
+ * Returns NULL on a parse error or if the arena is full.
+ */
+static struct config *
+config_parse_line(
+	struct config_arena *	arena,
+	char *			line
+)
+{
 	// Trim any leading whitespace
-	int i = 0;
-	while( line[i] && is_space( line[i] ) )
-		i++;
-
-	// Copy the name to the name buffer
-	while( line[i]
-	&& !is_space( line[i] )
-	&& line[i] != '='
-	&& name_len < MAX_NAME_LEN
-	)
-		config->name[ name_len++ ] = line[i++];
+	while( is_space( *line ) )
+		line++;
 
-	if( name_len == MAX_NAME_LEN )
-		goto parse_error;
+	char * const name = line;
+	while( *line
+	&& !is_space( *line )
+	&& *line != '='
+	)
+		line++;
 
-	// And nul terminate it
-	config->name[ name_len ] = '\0';
+	const size_t name_len = line - name;
 
 	// Skip any white space and = signs
-	while( line[i] && is_space( line[i] ) )
-		i++;
-	if( line[i++] != '=' )
+	while( is_space( *line ) )
+		line++;
+	if( *line++ != '=' || name_len >= MAX_NAME_LEN )
 		goto parse_error;
-	while( line[i] && is_space( line[i] ) )
-		i++;
+	while( is_space( *line ) )
+		line++;
 
-	// Copy the value to the value buffer
-	while( line[i] && value_len < MAX_VALUE_LEN )
-		config->value[ value_len++ ] = line[ i++ ];
+	char * const value = line;
+	size_t value_len = 0;
+	while( value[ value_len ] && value_len < MAX_VALUE_LEN )
+		value_len++;
 
 	// Back up to trim any white space
-	while( value_len > 0 && is_space( config->value[ value_len-1 ] ) )
+	while( value_len > 0 && is_space( value[ value_len-1 ] ) )
 		value_len--;
 
-	// And nul terminate it
-	config->value[ value_len ] = '\0';
+	name[ name_len ] = '\0';
+
+	struct config * const config = config_arena_node( arena );
+	if( !config )
+		goto arena_error;
+
+	const struct config_var * const var = config_var_find( name );
+
+	config->next	= 0;
+	config->name	= var ? var->name : config_arena_strdup( arena, name, name_len );
+	config->value	= config_arena_strdup( arena, value, value_len );
+	if( !config->name || !config->value )
+		goto arena_error;
 
 	DebugMsg( DM_MAGIC, 3,
 		"%s: '%s' => '%s'",
@@ -94,105 +409,716 @@ config_parse_line(
 
 parse_error:
 	DebugMsg( DM_MAGIC, 3,
-		"%s: PARSE ERROR: len=%d,%d string='%s'",
+		"%s: PARSE ERROR: len=%d string='%s'",
 		__func__,
 		name_len,
-		value_len,
-		line
+		name
 	);
+	return 0;
 
-	free( config );
-malloc_error:
+arena_error:
+	DebugMsg( DM_MAGIC, 3, "%s: arena full", __func__ );
 	return 0;
 }
 
 
-int
-read_line(
-	FILE *			file,
-	char *			buf,
-	size_t			size
+/** Copy the list out of the arena into one exact-size block.
+ * The strings are packed already, so they move with one memcpy()
+ * and the pointers into them are relocated.  String variables that
+ * pointed at values in the arena are moved to the copies too.  The
+ * order of the list is preserved.
+ */
+static struct config *
+config_compact(
+	struct config_arena *	arena,
+	struct config *		config
 )
 {
-	size_t			len = 0;
+	struct config * node;
+	size_t count = 0;
+
+	for( node = config ; node ; node = node->next )
+		count++;
+
+	const size_t bytes = arena->strings - arena->base;
+	const size_t size = count * sizeof(*node) + bytes;
+	struct config * const list = malloc( size );
+	if( !list )
+		return NULL;
 
-	while( len < size )
+	char * const strings = (char *)( list + count );
+	memcpy( strings, arena->base, bytes );
+
+	struct config * copy = list;
+	for( node = config ; node ; node = node->next, copy++ )
 	{
-		int rc = FIO_ReadFile( file, buf+len, 1 );
-		if( rc <= 0 )
-			return -1;
+		copy->next	= node->next ? copy + 1 : 0;
+		copy->name	= node->name;
+		copy->value	= strings + ( node->value - arena->base );
 
-		if( buf[len] == '\r' )
+		if( config_arena_owns( arena, node->name ) )
+		{
+			copy->name = strings + ( node->name - arena->base );
 			continue;
-		if( buf[len] == '\n' )
+		}
+
+		struct config_var * const var = config_var_find( node->name );
+		if( var
+		&&  var->type == 1
+		&&  *(char **) var->value == node->value
+		)
+			*(char **) var->value = copy->value;
+	}
+
+	config_stats.kept = size;
+	return list;
+}
+
+
+/** The file is read in CONFIG_CHUNK pieces and split into lines in
+ * place.  A line that runs off the end of a chunk is moved to the
+ * front of the buffer and completed by the next read, so a typical
+ * config costs one or two FIO calls instead of one per byte.
+ */
+#define CONFIG_CHUNK		4096
+#define CONFIG_LINE		( MAX_NAME_LEN + MAX_VALUE_LEN )
+
+struct config_stats config_stats;
+struct config_save_stats config_save_stats;
+
+static char config_buf[ CONFIG_CHUNK + CONFIG_LINE + 1 ];
+
+
+/** Parse one nul terminated line and add it to the list.
+ * Returns -1 on a parse error.
+ */
+static int
+config_parse_buf_line(
+	struct config_arena *	arena,
+	char *			line,
+	struct config **	config,
+	int			apply
+)
+{
+	// Ignore any line that begins with # or is empty
+	if( line[0] == '#'
+	||  line[0] == '\0' )
+		return 0;
+
+	struct config * new_config = config_parse_line( arena, line );
+	if( !new_config )
+		return -1;
+
+	new_config->next = *config;
+	*config = new_config;
+	config_stats.lines++;
+
+	if( apply )
+		config_auto_parse( new_config );
+	return 0;
+}
+
+
+static struct config *
+config_parse_list(
+	FILE *			file,
+	size_t			size,
+	int			apply
+) {
+	struct config *	config = 0;
+	size_t carry = 0;
+	int skipping = 0;
+	int eof = 0;
+
+	struct config_arena arena;
+	config_stats.arena = config_arena_size( size );
+	arena.base = malloc( config_stats.arena );
+	if( !arena.base )
+		return NULL;
+	arena.strings	= arena.base;
+	arena.nodes	= arena.base + config_stats.arena;
+
+	while( !eof )
+	{
+		ssize_t rc = FIO_ReadFile( file, config_buf + carry, CONFIG_CHUNK );
+		config_stats.reads++;
+
+		// A short read is the end of the file
+		if( rc < CONFIG_CHUNK )
+			eof = 1;
+		if( rc < 0 )
+			rc = 0;
+		config_stats.bytes += rc;
+
+		size_t len = carry + rc;
+		if( eof && len && config_buf[len-1] != '\n' )
+			config_buf[ len++ ] = '\n';
+
+		char * line = config_buf;
+		char * const end = config_buf + len;
+		char * p;
+
+		for( p = line ; p < end ; p++ )
 		{
-			buf[len] = '\0';
-			return len;
+			if( *p != '\n' )
+				continue;
+
+			// Terminate the line and drop any DOS line ending
+			*p = '\0';
+			if( p > line && p[-1] == '\r' )
+				p[-1] = '\0';
+
+			if( skipping )
+				skipping = 0;
+			else
+			if( config_parse_buf_line( &arena, line, &config, apply ) < 0 )
+			{
+				// The lines before it have been applied to
+				// the variables already, so keep them
+				DebugMsg( DM_MAGIC, 3, "%s: ERROR after line %d",
+					__func__,
+					config_stats.lines
+				);
+				eof = 1;
+				break;
+			}
+
+			line = p + 1;
 		}
 
-		len++;
+		// Keep the partial line for the next chunk, unless it is
+		// already too long to be valid
+		carry = end - line;
+		if( carry > CONFIG_LINE )
+		{
+			DebugMsg( DM_MAGIC, 3, "%s: line too long", __func__ );
+			skipping = 1;
+			carry = 0;
+		}
+
+		size_t i;
+		for( i=0 ; i<carry ; i++ )
+			config_buf[i] = line[i];
 	}
 
-	return -1;
+	if( config )
+	{
+		struct config * const list = config_compact( &arena, config );
+		if( !list && !apply )
+		{
+			free( arena.base );
+			return NULL;
+		}
+
+		if( !list )
+		{
+			// Run from the arena rather than lose the values
+			config_stats.kept = config_stats.arena;
+			return config;
+		}
+
+		config = list;
+	}
+
+	free( arena.base );
+
+	DebugMsg( DM_MAGIC, 3, "%s: Read %d config values in %d reads, kept %d of %d bytes",
+		__func__,
+		config_stats.lines,
+		config_stats.reads,
+		config_stats.kept,
+		config_stats.arena
+	);
+	return config;
 }
 
 
-extern struct config_var	_config_vars_start[];
-extern struct config_var	_config_vars_end[];
+struct config *
+config_parse(
+	FILE *			file,
+	size_t			size
+)
+{
+	return config_parse_list( file, size, 1 );
+}
+
+
+struct config *
+config_read_list(
+	const char *		filename
+)
+{
+	unsigned size;
+	if( FIO_GetFileSize( filename, &size ) != 0 )
+		return NULL;
+
+	FILE * file = FIO_Open( filename, O_SYNC );
+	if( file == INVALID_PTR )
+		return NULL;
 
+	struct config * const list = config_parse_list( file, size, 0 );
+	FIO_CloseFile( file );
+	return list;
+}
+
+
+/** The snapshot and the journal go next to the text file, with the
+ * extension replaced by ext, which must be four bytes like ".bin".
+ */
 static void
-config_auto_parse(
-	struct config *		config
+config_file_name(
+	char *			buf,
+	size_t			len,
+	const char *		filename,
+	const char *		ext
 )
 {
-	struct config_var *		var = _config_vars_start;
+	size_t i;
+	size_t dot = 0;
+
+	for( i=0 ; filename[i] && i < len - 5 ; i++ )
+	{
+		buf[i] = filename[i];
+		if( filename[i] == '.' )
+			dot = i;
+		if( filename[i] == '/' )
+			dot = 0;
+	}
+
+	if( !dot )
+		dot = i;
+	memcpy( buf + dot, ext, 5 );
+}
+
+
+/** The directory functions are not in every firmware's stubs; where
+ * they are missing these are NULL and the timestamp is not known.
+ */
+#pragma weak FIO_FindFirstEx
+#pragma weak FIO_FindNextEx
+
+static int
+config_name_eq(
+	const char *		a,
+	const char *		b
+)
+{
+	while( *a && *b )
+	{
+		char ca = *a++;
+		char cb = *b++;
+		if( ca >= 'a' && ca <= 'z' )
+			ca -= 'a' - 'A';
+		if( cb >= 'a' && cb <= 'z' )
+			cb -= 'a' - 'A';
+		if( ca != cb )
+			return 0;
+	}
+
+	return *a == *b;
+}
+
+
+/** Directory timestamp of a file, or 0 if it can not be found */
+static uint32_t
+config_file_time(
+	const char *		filename
+)
+{
+	if( !FIO_FindFirstEx || !FIO_FindNextEx )
+		return 0;
+
+	char dir[ MAX_VALUE_LEN ];
+	size_t i;
+	size_t base = 0;
+
+	for( i=0 ; filename[i] && i < sizeof(dir) - 1 ; i++ )
+	{
+		dir[i] = filename[i];
+		if( filename[i] == '/' )
+			base = i + 1;
+	}
+	dir[ base ] = '\0';
+
+	struct fio_file file;
+	struct fio_dirent * const dirent = FIO_FindFirstEx( dir, &file );
+	if( IS_ERROR( dirent ) )
+		return 0;
+
+	do {
+		if( config_name_eq( file.name, filename + base ) )
+			return file.timestamp;
+	} while( FIO_FindNextEx( dirent, &file ) == 0 );
+
+	return 0;
+}
+
+
+/** Replace a file with one write */
+static int
+config_write_file(
+	const char *		filename,
+	const void *		buf,
+	size_t			len
+)
+{
+	FILE * file = FIO_CreateFile( filename );
+	if( file == INVALID_PTR )
+		return -1;
 
+	const ssize_t rc = len ? FIO_WriteFile( file, buf, len ) : 0;
+	FIO_CloseFile( file );
+	config_save_stats.writes++;
+
+	return rc == (ssize_t) len ? 0 : -1;
+}
+
+
+/** Names, types and order of the variables in the section */
+static uint32_t
+config_layout_hash(
+	unsigned *		count
+)
+{
+	struct config_var * var = _config_vars_start;
+	uint32_t h = 0;
+
+	*count = 0;
 	for( ; var < _config_vars_end ; var++ )
 	{
-		if( !streq( var->name, config->name ) )
-			continue;
+		h = config_hash( var->name, h ^ var->type );
+		(*count)++;
+	}
 
-		DebugMsg( DM_MAGIC, 3,
-			"%s: '%s' => '%s'",
-			__func__,
-			config->name,
-			config->value
-		);
+	return h;
+}
+
+
+static inline size_t
+config_strsize(
+	const char *		s
+)
+{
+	size_t len = 1;
+	while( *s++ )
+		len++;
+	return len;
+}
+
+
+int
+config_snapshot_save(
+	const char *		filename,
+	uint32_t		text_size
+)
+{
+	char name[ MAX_VALUE_LEN ];
+	config_file_name( name, sizeof(name), filename, ".bin" );
+
+	struct config_var * var;
+	unsigned count;
+	const uint32_t layout = config_layout_hash( &count );
+
+	size_t size = sizeof(struct config_snapshot) + count * sizeof(uint32_t);
+	for( var = _config_vars_start ; var < _config_vars_end ; var++ )
+		if( var->type == 1 )
+			size += config_strsize( *(const char **) var->value );
 
+	struct config_snapshot * const snap = malloc( size );
+	if( !snap )
+		return -1;
+
+	snap->magic	= CONFIG_SNAPSHOT_MAGIC;
+	snap->layout	= layout;
+	snap->count	= count;
+	snap->size	= size;
+	snap->text_size	= text_size;
+	snap->text_time	= config_file_time( filename );
+
+	char * const strings = (char *) &snap->values[ count ];
+	uint32_t offset = 0;
+	unsigned i = 0;
+
+	for( var = _config_vars_start ; var < _config_vars_end ; var++, i++ )
+	{
 		if( var->type == 0 )
 		{
-			*(unsigned*) var->value = atoi( config->value );
-		} else {
-			*(char **) var->value = config->value;
+			snap->values[i] = *(unsigned *) var->value;
+			continue;
 		}
 
-		return;
+		const char * const str = *(const char **) var->value;
+		const size_t len = config_strsize( str );
+		snap->values[i] = offset;
+		memcpy( strings + offset, str, len );
+		offset += len;
 	}
 
-	DebugMsg( DM_MAGIC, 3,
-		"%s: '%s' unused?",
+	const int rc = config_write_file( name, snap, size );
+	free( snap );
+
+	DebugMsg( DM_MAGIC, 3, "%s: %s: %d variables, %d bytes",
 		__func__,
-		config->name
+		name,
+		count,
+		size
 	);
+
+	return rc;
 }
 
 
 int
-config_save_file(
-	struct config *		config,
+config_snapshot_load(
+	const char *		filename,
+	uint32_t		text_size
+)
+{
+	char name[ MAX_VALUE_LEN ];
+	config_file_name( name, sizeof(name), filename, ".bin" );
+
+	unsigned count;
+	const uint32_t layout = config_layout_hash( &count );
+	const size_t min_size = sizeof(struct config_snapshot)
+		+ count * sizeof(uint32_t);
+
+	unsigned size;
+	if( FIO_GetFileSize( name, &size ) != 0
+	||  size < min_size )
+		return -1;
+
+	// Strings point into the snapshot, so it is kept on success
+	struct config_snapshot * const snap = malloc( size );
+	if( !snap )
+		return -1;
+
+	FILE * file = FIO_Open( name, O_SYNC );
+	if( file == INVALID_PTR )
+		goto fail;
+
+	const ssize_t rc = FIO_ReadFile( file, snap, size );
+	config_stats.reads++;
+	FIO_CloseFile( file );
+
+	if( rc != (ssize_t) size
+	||  snap->magic != CONFIG_SNAPSHOT_MAGIC
+	||  snap->layout != layout
+	||  snap->count != count
+	||  snap->size != size
+	)
+	{
+		DebugMsg( DM_MAGIC, 3, "%s: %s: layout changed", __func__, name );
+		goto fail;
+	}
+
+	if( snap->text_size != text_size
+	||  snap->text_time != config_file_time( filename )
+	) {
+		DebugMsg( DM_MAGIC, 3, "%s: %s: text changed", __func__, filename );
+		goto fail;
+	}
+
+	// Check every string before touching any of the variables
+	const char * const strings = (const char *) &snap->values[ count ];
+	const size_t strings_size = size - min_size;
+	struct config_var * var;
+	unsigned i = 0;
+
+	for( var = _config_vars_start ; var < _config_vars_end ; var++, i++ )
+		if( var->type == 1
+		&&  ( snap->values[i] >= strings_size
+		||    strings[ strings_size - 1 ] != '\0' )
+		)
+			goto fail;
+
+	i = 0;
+	for( var = _config_vars_start ; var < _config_vars_end ; var++, i++ )
+	{
+		if( var->type == 0 )
+			*(unsigned *) var->value = config_clamp( var, snap->values[i] );
+		else
+			*(const char **) var->value = strings + snap->values[i];
+	}
+
+	config_stats.bytes	+= size;
+	config_stats.kept	= size;
+	config_stats.snapshot	= 1;
+	return 0;
+
+fail:
+	free( snap );
+	return -1;
+}
+
+
+/** Values as of the last load or save, to tell if a save is needed.
+ * Strings are compared by hash.
+ */
+static uint32_t *	config_shadow;
+
+static uint32_t
+config_var_state(
+	const struct config_var *	var
+)
+{
+	if( var->type == 0 )
+		return *(unsigned *) var->value;
+	return config_hash( *(const char **) var->value, 0 );
+}
+
+
+static void
+config_shadow_update( void )
+{
+	struct config_var * var;
+	unsigned i = 0;
+
+	if( !config_shadow )
+	{
+		unsigned count;
+		config_layout_hash( &count );
+		config_shadow = malloc( count * sizeof(*config_shadow) );
+		if( !config_shadow )
+			return;
+	}
+
+	for( var = _config_vars_start ; var < _config_vars_end ; var++ )
+		config_shadow[ i++ ] = config_var_state( var );
+}
+
+
+static int
+config_dirty( void )
+{
+	struct config_var * var;
+	unsigned i = 0;
+
+	if( !config_shadow )
+		return 1;
+
+	for( var = _config_vars_start ; var < _config_vars_end ; var++ )
+		if( config_shadow[ i++ ] != config_var_state( var ) )
+			return 1;
+
+	return 0;
+}
+
+
+/** Finish a save that was interrupted after the journal was written */
+static void
+config_journal_recover(
 	const char *		filename
 )
 {
-	FILE * file = FIO_CreateFile( filename );
+	char journal[ MAX_VALUE_LEN ];
+	config_file_name( journal, sizeof(journal), filename, ".new" );
+
+	const size_t end_len = sizeof(CONFIG_END) - 1;
+	unsigned size;
+	if( FIO_GetFileSize( journal, &size ) != 0
+	||  size == 0 )
+		return;
+
+	char * const buf = malloc( size + 1 );
+	if( !buf )
+		return;
+
+	FILE * file = FIO_Open( journal, O_SYNC );
 	if( file == INVALID_PTR )
-		return -1;
+		goto done;
 
-	struct config_var * var = _config_vars_start;
+	const ssize_t rc = FIO_ReadFile( file, buf, size );
+	config_stats.reads++;
+	FIO_CloseFile( file );
+
+	buf[ rc > 0 ? rc : 0 ] = '\0';
+	if( rc == (ssize_t) size
+	&&  size >= end_len
+	&&  streq( buf + size - end_len, CONFIG_END )
+	)
+	{
+		DebugMsg( DM_MAGIC, 3, "%s: recovering %s", __func__, journal );
+		if( config_write_file( filename, buf, size ) < 0 )
+			goto done;
+
+		// The snapshot was made from the old text; the parser
+		// makes a new one
+		char bin[ MAX_VALUE_LEN ];
+		config_file_name( bin, sizeof(bin), filename, ".bin" );
+		config_write_file( bin, NULL, 0 );
+	} else {
+		// The journal is torn, so the file was never touched
+		DebugMsg( DM_MAGIC, 3, "%s: dropping %s", __func__, journal );
+	}
+
+	config_write_file( journal, NULL, 0 );
+
+done:
+	free( buf );
+}
+
+
+/** Formatted output into the save buffer, which is sized up front */
+struct config_out
+{
+	char *			buf;
+	size_t			len;
+	size_t			size;
+};
+
+static void
+config_out_printf(
+	struct config_out *	out,
+	const char *		fmt,
+	...
+)
+{
+	va_list			ap;
+
+	va_start( ap, fmt );
+	int len = vsnprintf( out->buf + out->len, out->size - out->len, fmt, ap );
+	va_end( ap );
+
+	if( len > 0 )
+		out->len += len;
+	if( out->len >= out->size )
+		out->len = out->size - 1;
+}
+
+
+int
+config_save_file(
+	struct config *		config,
+	const char *		filename
+)
+{
+	struct config_var * var;
+	unsigned size;
 	int count = 0;
 
+	if( !config_dirty()
+	&&  FIO_GetFileSize( filename, &size ) == 0 )
+	{
+		DebugMsg( DM_MAGIC, 3, "%s: nothing changed", __func__ );
+		config_save_stats.skipped++;
+		return 0;
+	}
+
 	DebugMsg( DM_MAGIC, 3, "%s: saving to %s", __func__, filename );
 
-	fprintf( file,
+	// Header, then at most "name = value\n" for each variable
+	struct config_out out = { .size = 256 + sizeof(CONFIG_END) };
+	for( var = _config_vars_start ; var < _config_vars_end ; var++ )
+		out.size += config_strsize( var->name ) + 3 + ( var->type == 0
+			? 11
+			: config_strsize( *(const char **) var->value )
+		);
+
+	out.buf = malloc( out.size );
+	if( !out.buf )
+		return -1;
+
+	config_out_printf( &out,
 		"# Magic Lantern %s (%s)\n"
 		"# Build on %s by %s\n",
 		build_version,
@@ -204,7 +1130,7 @@ config_save_file(
 	struct tm now;
 	LoadCalendarFromRTC( &now );
 
-	fprintf( file,
+	config_out_printf( &out,
 		"# Configuration saved on %04d/%02d/%02d %02d:%02d:%02d\n",
 		now.tm_year + 1900,
 		now.tm_mon + 1,
@@ -214,16 +1140,16 @@ config_save_file(
 		now.tm_sec
 	);
 
-	for( ; var < _config_vars_end ; var++ )
+	for( var = _config_vars_start ; var < _config_vars_end ; var++ )
 	{
 		if( var->type == 0 )
-			fprintf( file,
+			config_out_printf( &out,
 				"%s = %d\n",
 				var->name,
 				*(unsigned*) var->value
 			);
 		else
-			fprintf( file,
+			config_out_printf( &out,
 				"%s = %s\n",
 				var->name,
 				*(const char**) var->value
@@ -232,55 +1158,35 @@ config_save_file(
 		count++;
 	}
 
-	FIO_CloseFile( file );
-	return count;
-}
-
+	config_out_printf( &out, "%s", CONFIG_END );
 
-struct config *
-config_parse(
-	FILE *			file
-) {
-	char line_buf[ MAX_NAME_LEN + MAX_VALUE_LEN ];
-	struct config *	config = 0;
-	int count = 0;
+	char journal[ MAX_VALUE_LEN ];
+	config_file_name( journal, sizeof(journal), filename, ".new" );
 
-	while( read_line( file, line_buf, sizeof(line_buf) ) >= 0 )
+	if( config_write_file( journal, out.buf, out.len ) < 0
+	||  config_write_file( filename, out.buf, out.len ) < 0 )
 	{
-		// Ignore any line that begins with # or is empty
-		if( line_buf[0] == '#'
-		||  line_buf[0] == '\0' )
-			continue;
+		free( out.buf );
+		return -1;
+	}
 
-		struct config * new_config = config_parse_line( line_buf );
-		if( !new_config )
-			goto error;
+	// The file is complete, so the journal is no longer needed
+	config_write_file( journal, NULL, 0 );
 
-		new_config->next = config;
-		config = new_config;
-		count++;
+	if( config_snapshot_save( filename, out.len ) < 0 )
+		DebugMsg( DM_MAGIC, 3, "%s: snapshot failed", __func__ );
 
-		config_auto_parse( config );
-	}
+	free( out.buf );
+	config_shadow_update();
 
-	DebugMsg( DM_MAGIC, 3, "%s: Read %d config values", __func__, count );
-	return config;
+	// It used to take an fprintf() per variable and three for the
+	// header; the journal, the file and emptying the journal take
+	// three now.
+	config_save_stats.saves++;
+	config_save_stats.bytes = out.len;
+	config_save_stats.calls_saved += count;
 
-error:
-	DebugMsg( DM_MAGIC, 3, "%s: ERROR Deleting config", __func__ );
-	while( config )
-	{
-		struct config * next = config->next;
-		DebugMsg( DM_MAGIC, 3, "%s: Deleting '%s' => '%s'",
-			__func__,
-			config->name,
-			config->value
-		);
-		free( config );
-		config = next;
-	}
-
-	return NULL;
+	return count;
 }
 
 
@@ -333,25 +1239,61 @@ config_int(
 }
 
 
-struct config head = { .name = "config.file", .value = "" };
+static char config_filename[ MAX_VALUE_LEN ];
+struct config head = { .name = "config.file", .value = config_filename };
 struct config fail = { .name = "config.failure", .value = "1" };
+static struct config snapshot = { .name = "config.snapshot", .value = "1" };
 
 struct config *
 config_parse_file(
 	const char *		filename
 )
 {
-	FILE * file = FIO_Open( filename, O_SYNC );
-	strcpy( head.value, filename );
+	const uint32_t start = timer_read();
+
+	config_stats.reads	= 0;
+	config_stats.bytes	= 0;
+	config_stats.lines	= 0;
+	config_stats.arena	= 0;
+	config_stats.kept	= 0;
+	config_stats.snapshot	= 0;
+
+	snprintf( config_filename, sizeof(config_filename), "%s", filename );
+	config_journal_recover( filename );
+
+	unsigned size;
+	FILE * file = INVALID_PTR;
+	if( FIO_GetFileSize( filename, &size ) == 0 )
+	{
+		if( config_snapshot_load( filename, size ) == 0 )
+		{
+			head.next = &snapshot;
+			config_stats.usec = timer_delta( start, timer_read() );
+			config_shadow_update();
+			return &head;
+		}
+
+		file = FIO_Open( filename, O_SYNC );
+	}
+
 	if( file == INVALID_PTR )
 	{
 		head.next = &fail;
+		config_shadow_update();
 		return &head;
 	}
 
-	struct config * config = config_parse( file );
+	struct config * config = config_parse( file, size );
 	FIO_CloseFile( file );
 	head.next = config;
+
+	config_stats.usec = timer_delta( start, timer_read() );
+
+	// Restore from the snapshot next time
+	if( config && config_snapshot_save( filename, size ) < 0 )
+		DebugMsg( DM_MAGIC, 3, "%s: snapshot failed", __func__ );
+
+	config_shadow_update();
 	return &head;
 }
 
@@ -35,18 +35,28 @@
 #define MAX_VALUE_LEN		60
 
 
+/** Parsed config entries.
+ * The whole list lives in a single allocation made by config_parse().
+ * Names of auto-parsed variables are interned: they point at the
+ * name in the config_var instead of a copy.
+ */
 struct config
 {
 	struct config *		next;
-	char			name[ MAX_NAME_LEN ];
-	char			value[ MAX_VALUE_LEN ];
+	const char *		name;
+	char *			value;
 };
 
 extern struct config * global_config;
 
+/** Parse size bytes of config file.
+ * The entries are built in a scratch arena sized from the file and
+ * copied into one exact-size block when parsing is done.
+ */
 extern struct config *
 config_parse(
-	FILE *			file
+	FILE *			file,
+	size_t			size
 );
 
 
@@ -69,13 +79,114 @@ config_parse_file(
 	const char *		filename
 );
 
+/** How the last config_parse_file() went, for the boot screen */
+struct config_stats
+{
+	unsigned		reads;		//!< FIO_ReadFile() calls
+	unsigned		bytes;
+	unsigned		lines;
+	unsigned		usec;
+	unsigned		arena;		//!< Scratch bytes while parsing
+	unsigned		kept;		//!< Bytes in the final list
+	unsigned		snapshot;	//!< Restored from the snapshot
+};
+
+extern struct config_stats config_stats;
 
+
+/** Write the variables as text, followed by a binary snapshot.
+ *
+ * Nothing is written if no variable has changed since the config was
+ * loaded or last saved.  Otherwise the text is built in one buffer
+ * and written to a .new journal before it replaces the file, so a
+ * power loss leaves either the old or the new config intact.  The
+ * journal is emptied once the file is complete; a complete journal
+ * found at boot is copied over the file before it is read.
+ *
+ * Returns the number of variables written, 0 if the save was
+ * skipped or -1 on error.
+ */
 extern int
 config_save_file(
 	struct config *		config,
 	const char *		filename
 );
 
+/** Last line of every saved file, so a torn journal can be told apart */
+#define CONFIG_END		"# End of config\n"
+
+struct config_save_stats
+{
+	unsigned		saves;
+	unsigned		skipped;	//!< Nothing was dirty
+	unsigned		bytes;		//!< Text in the last save
+	unsigned		writes;		//!< FIO_WriteFile() calls, total
+	unsigned		calls_saved;	//!< vs. one write per line
+};
+
+extern struct config_save_stats config_save_stats;
+
+
+/** Binary snapshot of the auto-parsed variables.
+ *
+ * Stored next to the text file with a .bin extension.  The header
+ * has a hash of the layout of the .config_vars section and the size
+ * and directory timestamp of the text file it was made with.
+ * Integers follow as raw words, in section order, and strings are
+ * offsets into a trailing block of nul terminated strings.
+ *
+ * config_parse_file() restores the snapshot instead of parsing the
+ * text when the layout, the size and the timestamp match, so a text
+ * file that was edited since falls back to the parser, which then
+ * rewrites the snapshot.  The timestamp comes from FIO_FindFirstEx();
+ * on firmware without that stub only the size is checked, and an
+ * edit that keeps the size needs the .bin to be deleted.
+ */
+#define CONFIG_SNAPSHOT_MAGIC	0x33434C4D	// "MLC3"
+
+struct config_snapshot
+{
+	uint32_t		magic;
+	uint32_t		layout;		//!< config_layout_hash()
+	uint32_t		count;		//!< Variables in the section
+	uint32_t		size;		//!< Bytes, including the header
+	uint32_t		text_size;
+	uint32_t		text_time;	//!< 0 if it is not known
+	uint32_t		values[];
+};
+
+/** Write the snapshot for a text file of text_size bytes */
+extern int
+config_snapshot_save(
+	const char *		filename,
+	uint32_t		text_size
+);
+
+/** Returns 0 if the variables were restored */
+extern int
+config_snapshot_load(
+	const char *		filename,
+	uint32_t		text_size
+);
+
+
+struct config_var;
+
+/** Called after a variable has changed.
+ * Observers run in the task that made the change, so they should do
+ * no more than wake up the task that cares, like
+ * config_notify_semaphore() does.
+ */
+struct config_observer
+{
+	struct config_observer *	next;
+	void			(*notify)(
+		struct config_var *	var,
+		void *			arg
+	);
+	void *			arg;
+};
+
 
 /** Create an auto-parsed config variable */
 struct config_var
@@ -83,10 +194,14 @@ struct config_var
 	const char *		name;
 	int			type;	//!< 0 == int, 1 == char *
 	void *			value;	//!< int* if len == 0
+	int			min;	//!< No limit unless min < max
+	int			max;
+	unsigned		def;	//!< Default for integers
+	struct config_observer *	observers;
 };
 
 
-#define _CONFIG_VAR( NAME, TYPE_ENUM, TYPE, VAR, VALUE ) \
+#define _CONFIG_VAR( NAME, TYPE_ENUM, TYPE, VAR, VALUE, DEF, MIN, MAX ) \
 static TYPE VAR = VALUE; \
 struct config_var \
 __attribute__((section(".config_vars"))) \
@@ -95,13 +210,149 @@ __config_##VAR = \
 	.name		= NAME, \
 	.type		= TYPE_ENUM, \
 	.value		= &VAR, \
+	.min		= MIN, \
+	.max		= MAX, \
+	.def		= DEF, \
 }
 
 #define CONFIG_INT( NAME, VAR, VALUE ) \
-	_CONFIG_VAR( NAME, 0, unsigned, VAR, VALUE )
+	_CONFIG_VAR( NAME, 0, unsigned, VAR, VALUE, VALUE, 0, 0 )
+
+/** Values outside of [MIN,MAX] are clamped when they are loaded or set */
+#define CONFIG_INT_RANGE( NAME, VAR, VALUE, MIN, MAX ) \
+	_CONFIG_VAR( NAME, 0, unsigned, VAR, VALUE, VALUE, MIN, MAX )
 
 #define CONFIG_STR( NAME, VAR, VALUE ) \
-	_CONFIG_VAR( NAME, 1, char *, VAR, VALUE )
+	_CONFIG_VAR( NAME, 1, char *, VAR, VALUE, 0, 0, 0 )
+
+/** The struct config_var for a variable declared in this file */
+#define CONFIG_VAR( VAR )	( &__config_##VAR )
+
+
+/** Watch a variable.  The observer is owned by the caller and stays
+ * on the list for good, so it is usually static.
+ */
+extern void
+config_observe(
+	struct config_var *		var,
+	struct config_observer *	observer
+);
+
+/** Run the observers after writing to the variable directly */
+extern void
+config_changed(
+	struct config_var *	var
+);
+
+/** Same, for code that only has the address of the value, like
+ * menu_binary_toggle().  Does nothing if it is not a config variable.
+ */
+extern void
+config_value_changed(
+	const void *		value
+);
+
+/** Clamp, store and notify if the value changed.
+ * Returns -1 if the variable is not an integer.
+ */
+extern int
+config_set(
+	struct config_var *	var,
+	unsigned		value
+);
+
+/** For scripts, which only know the name */
+extern int
+config_set_int(
+	const char *		name,
+	unsigned		value
+);
+
+/** A value that differs from the default of an integer variable */
+struct config_diff
+{
+	struct config_var *	var;
+	unsigned		value;
+};
+
+/** Set every integer variable in scope to the value in diffs, or
+ * to its default if it is not listed; variables outside of scope
+ * are left alone.  scope and diffs must be sorted by var, so that
+ * they can be merged with the section in one pass.  All of the
+ * values are stored before any observer runs, and observers only
+ * run for variables that changed.  Returns how many changed.
+ */
+extern unsigned
+config_apply(
+	struct config_var * const *	scope,
+	unsigned			scope_count,
+	const struct config_diff *	diffs,
+	unsigned			count
+);
+
+/** Parse a file in the config format without assigning any of the
+ * variables.  The list is a single block to free() when done.
+ */
+extern struct config *
+config_read_list(
+	const char *		filename
+);
+
+/** Observer callback that gives the semaphore in arg */
+extern void
+config_notify_semaphore(
+	struct config_var *	var,
+	void *			arg
+);
+
+
+/** Perfect hash index over the config variables.
+ *
+ * mkconfigindex generates config-index.c from the CONFIG_INT() and
+ * CONFIG_STR() declarations in the linked sources.  Each name hashes
+ * into a bucket whose displacement moves it to a slot of its own,
+ * so a lookup is two hashes and a single streq().  The generator
+ * computes the same hash, so they must be changed together.
+ */
+static inline uint32_t
+config_hash(
+	const char *		name,
+	uint32_t		seed
+)
+{
+	// FNV-1a with the seed mixed into the offset basis
+	uint32_t h = 2166136261u ^ seed;
+
+	while( *name )
+	{
+		h ^= (uint8_t) *name++;
+		h *= 16777619;
+	}
+
+	return h;
+}
+
+extern const uint32_t		config_index_buckets;	//!< power of two
+extern const uint32_t		config_index_slots;	//!< power of two
+extern const uint16_t		config_index_disp[];
+extern struct config_var * const config_index[];
+
+static inline uint32_t
+config_index_slot(
+	const char *		name
+)
+{
+	const uint32_t bucket = config_hash( name, 0 ) & (config_index_buckets - 1);
+	return config_hash( name, config_index_disp[ bucket ] )
+		& (config_index_slots - 1);
+}
+
+
+/** Find an auto-parsed variable by name, or NULL */
+extern struct config_var *
+config_var_find(
+	const char *		name
+);
 
 
 #endif
@@ -8,6 +8,7 @@
 #include "menu.h"
 #include "property.h"
 #include "config.h"
+#include "prop-trace.h"
 //#include "lua.h"
 
 #if 0
@@ -104,13 +105,12 @@ void call_dispcheck( void * priv )
 }
 
 
-static PROP_INT( PROP_EFIC_TEMP, efic_temp );
+PROP_WATCH( PROP_EFIC_TEMP );
 
 
 PROP_HANDLER( PROP_HDMI_CHANGE_CODE )
 {
 	DebugMsg( DM_MAGIC, 3, "They try to set code to %d", buf[0] );
-	return prop_cleanup( token, property );
 }
 
 
@@ -127,7 +127,7 @@ efic_temp_display(
 		x, y,
 		//23456789012
 		"CMOS temp:  %d",
-		efic_temp
+		prop_cache_int( PROP_EFIC_TEMP, 0 )
 	);
 }
 
@@ -200,27 +200,360 @@ draw_prop_select( void * priv )
 }
 
 
+/** Property trace ring.
+ *
+ * The handler only copies a fixed size record and bumps the head,
+ * so it can stay on while recording.  The head counts every record
+ * ever stored; the ring holds the last PROP_TRACE_RECORDS of them.
+ *
+ * The 24 bit hardware timer wraps every 16.7 seconds, so the trace
+ * task extends it to 32 bits once a second, which is good for 71
+ * minutes.  It writes the clock it is not publishing and then flips
+ * the index, so the handler never sees half of an update.  While
+ * tracing is off the task sleeps on prop_trace_wake instead, and
+ * prop_trace_reset() re-bases the stale clock before it starts again.
+ */
+CONFIG_INT( "debug.prop-trace",		prop_trace_enabled, 0 );
+
+struct prop_trace_clock
+{
+	uint32_t		usec;
+	uint32_t		timer;		//!< timer_read() at usec
+};
+
+static struct prop_trace_record *	prop_trace;
+static volatile uint32_t		prop_trace_head;
+static volatile int			prop_trace_paused;
+static uint32_t				prop_trace_dropped;
+static struct prop_trace_clock		prop_trace_clocks[2];
+static volatile unsigned		prop_trace_clock;
+static uint32_t				prop_trace_start;
+static uint32_t				prop_trace_dumped;
+static struct semaphore *		prop_trace_wake;
+static struct config_observer		prop_trace_observer;
+
+
+/** Microseconds on the extended clock */
+static inline uint32_t
+prop_trace_now( void )
+{
+	const struct prop_trace_clock * const clock
+		= &prop_trace_clocks[ prop_trace_clock ];
+	return clock->usec + timer_delta( clock->timer, timer_read() );
+}
+
+
+/** Publish the next clock.  If the timer may have wrapped since the
+ * last tick the elapsed time is not counted, only the base is moved.
+ */
+static void
+prop_trace_tick(
+	int			stale
+)
+{
+	const uint32_t now = timer_read();
+	const struct prop_trace_clock * const clock
+		= &prop_trace_clocks[ prop_trace_clock ];
+	struct prop_trace_clock * const next
+		= &prop_trace_clocks[ !prop_trace_clock ];
+
+	next->usec	= clock->usec;
+	if( !stale )
+		next->usec += timer_delta( clock->timer, now );
+	next->timer	= now;
+
+	barrier();
+	prop_trace_clock = !prop_trace_clock;
+}
+
+
+static void
+prop_trace_task( void * priv )
+{
+	prop_trace_observer.notify	= config_notify_semaphore;
+	prop_trace_observer.arg		= prop_trace_wake;
+	config_observe( CONFIG_VAR( prop_trace_enabled ), &prop_trace_observer );
+
+	while( 1 )
+	{
+		if( !prop_trace_enabled )
+		{
+			take_semaphore( prop_trace_wake, 0 );
+			continue;
+		}
+
+		msleep( 1000 );
+		prop_trace_tick( 0 );
+	}
+}
+
+TASK_CREATE( "prop_trace", prop_trace_task, 0, 0x1f, 0x1000 );
+
+
+static void
+prop_trace_reset( void )
+{
+	// Only called while tracing is off, so the task is not ticking
+	prop_trace_tick( 1 );
+
+	prop_trace_head		= 0;
+	prop_trace_dropped	= 0;
+	prop_trace_start	= prop_trace_now();
+}
+
+
+static inline void
+prop_trace_add(
+	unsigned		property,
+	const void *		buf,
+	unsigned		len
+)
+{
+	if( prop_trace_paused )
+	{
+		prop_trace_dropped++;
+		return;
+	}
+
+	struct prop_trace_record * const rec
+		= &prop_trace[ prop_trace_head & (PROP_TRACE_RECORDS - 1) ];
+	const unsigned copy = len < PROP_TRACE_BYTES ? len : PROP_TRACE_BYTES;
+	unsigned i;
+
+	rec->property	= property;
+	rec->usec	= prop_trace_now() - prop_trace_start;
+	rec->len	= len;
+	memcpy( rec->data, buf, copy );
+
+	// Do not leave bytes of an older record behind a short value
+	for( i=copy ; i<PROP_TRACE_BYTES ; i++ )
+		rec->data[i] = 0;
+
+	barrier();
+	prop_trace_head++;
+}
+
+
+static void
+prop_trace_toggle( void * priv )
+{
+	if( !prop_trace_enabled )
+		prop_trace_reset();
+
+	barrier();
+	prop_trace_enabled = !prop_trace_enabled;
+	config_value_changed( &prop_trace_enabled );
+}
+
+
+static void
+prop_trace_display(
+	void *			priv,
+	int			x,
+	int			y,
+	int			selected
+)
+{
+	const uint32_t head = prop_trace_head;
+
+	bmp_printf(
+		selected ? MENU_FONT_SEL : MENU_FONT,
+		x, y,
+		//23456789012
+		"Prop trace: %s %d",
+		prop_trace_enabled ? "ON " : "OFF",
+		head < PROP_TRACE_RECORDS ? head : PROP_TRACE_RECORDS
+	);
+}
+
+
+/** Write the ring to the card, oldest record first, and empty it.
+ * Properties that arrive while the card is being written are only
+ * counted in the header.
+ */
+static void
+prop_trace_dump( void * priv )
+{
+	if( !prop_trace )
+		return;
+
+	prop_trace_paused = 1;
+	barrier();
+
+	// Let a record that was being stored finish
+	msleep( 10 );
+
+	const uint32_t head = prop_trace_head;
+	const uint32_t count = head < PROP_TRACE_RECORDS ? head : PROP_TRACE_RECORDS;
+	const uint32_t first = (head - count) & (PROP_TRACE_RECORDS - 1);
+	const uint32_t tail = first + count > PROP_TRACE_RECORDS
+		? PROP_TRACE_RECORDS - first
+		: count;
+
+	struct prop_trace_header hdr = {
+		.magic		= PROP_TRACE_MAGIC,
+		.version	= PROP_TRACE_VERSION,
+		.record_size	= sizeof(struct prop_trace_record),
+		.count		= count,
+		.overwritten	= head - count,
+		.dropped	= prop_trace_dropped,
+		.clock_hz	= 1000000,
+	};
+
+	FILE * file = FIO_CreateFile( (const char*) priv );
+	if( file == INVALID_PTR )
+		goto done;
+
+	FIO_WriteFile( file, &hdr, sizeof(hdr) );
+	FIO_WriteFile( file, &prop_trace[first], tail * sizeof(*prop_trace) );
+	if( count > tail )
+		FIO_WriteFile( file, prop_trace, (count - tail) * sizeof(*prop_trace) );
+	FIO_CloseFile( file );
+
+	prop_trace_dumped = count;
+
+	DebugMsg( DM_MAGIC, 3, "%s: %d records, %d overwritten, %d dropped",
+		__func__,
+		count,
+		hdr.overwritten,
+		hdr.dropped
+	);
+
+done:
+	prop_trace_head = 0;
+	prop_trace_dropped = 0;
+	barrier();
+	prop_trace_paused = 0;
+}
+
+
+static void
+prop_trace_dump_display(
+	void *			priv,
+	int			x,
+	int			y,
+	int			selected
+)
+{
+	if( !prop_trace_dumped )
+	{
+		menu_print( "Dump prop trace", x, y, selected );
+		return;
+	}
+
+	bmp_printf(
+		selected ? MENU_FONT_SEL : MENU_FONT,
+		x, y,
+		//23456789012
+		"Dumped %d props",
+		prop_trace_dumped
+	);
+}
+
+
 static void
 save_config( void * priv )
 {
 	config_save_file( global_config, "A:/magiclantern.cfg" );
 }
 
+static void
+save_config_display(
+	void *			priv,
+	int			x,
+	int			y,
+	int			selected
+)
+{
+	if( !config_save_stats.saves )
+	{
+		menu_print(
+			config_save_stats.skipped ? "Save config: unchanged" : priv,
+			x, y, selected
+		);
+		return;
+	}
+
+	bmp_printf(
+		selected ? MENU_FONT_SEL : MENU_FONT,
+		x, y,
+		//23456789012
+		"Saved %5d B, -%d calls",
+		config_save_stats.bytes,
+		config_save_stats.calls_saved
+	);
+}
+
+
+static void
+prop_bus_display(
+	void *			priv,
+	int			x,
+	int			y,
+	int			selected
+)
+{
+	bmp_printf(
+		selected ? MENU_FONT_SEL : MENU_FONT,
+		x, y,
+		//23456789012
+		"Prop bus:   %d/%d %d",
+		prop_bus_stats.properties,
+		prop_bus_stats.handlers,
+		prop_bus_stats.deliveries
+	);
+}
+
+
+static void
+prop_queue_display(
+	void *			priv,
+	int			x,
+	int			y,
+	int			selected
+)
+{
+	bmp_printf(
+		selected ? MENU_FONT_SEL : MENU_FONT,
+		x, y,
+		//23456789012
+		"Prop queue: %d/%d -%d",
+		prop_queue_stats.sent,
+		prop_queue_stats.queued,
+		prop_queue_stats.coalesced
+	);
+}
+
 
 struct menu_entry debug_menus[] = {
 	{
 		.display	= efic_temp_display,
 	},
+	{
+		.display	= prop_bus_display,
+	},
+	{
+		.display	= prop_queue_display,
+	},
 	{
 		.priv		= "Save config",
 		.select		= save_config,
-		.display	= menu_print,
+		.display	= save_config_display,
 	},
 	{
 		.priv		= "Draw palette",
 		.select		= bmp_draw_palette,
 		.display	= menu_print,
 	},
+	{
+		.select		= prop_trace_toggle,
+		.display	= prop_trace_display,
+	},
+	{
+		.priv		= "A:/proptrace.bin",
+		.select		= prop_trace_dump,
+		.display	= prop_trace_dump_display,
+	},
 	{
 		.priv		= "Toggle draw_prop",
 		.select		= draw_prop_select,
@@ -280,6 +613,12 @@ debug_property_handler(
 {
 	const uint32_t * const addr = buf;
 
+	if( prop_trace_enabled && prop_trace )
+		prop_trace_add( property, buf, len );
+
+	if( !draw_prop )
+		goto ack;
+
 	DebugMsg( DM_MAGIC, 3, "Prop %08x: %d: %08x %08x %08x %08x",
 		property,
 		len,
@@ -288,9 +627,6 @@ debug_property_handler(
 		len > 0x08 ? addr[2] : 0,
 		len > 0x0c ? addr[3] : 0
 	);
-		
-	if( !draw_prop )
-		goto ack;
 
 	const unsigned x = 80;
 	static unsigned y = 32;
@@ -328,6 +664,11 @@ debug_init( void )
 {
 	draw_prop = 0;
 
+	prop_trace_clocks[0].timer = timer_read();
+	prop_trace_wake = create_named_semaphore( "prop_trace_wake", 0 );
+	prop_trace = malloc( PROP_TRACE_RECORDS * sizeof(*prop_trace) );
+	prop_trace_reset();
+
 #if 1
 	unsigned i, j, k;
 	unsigned actual_num_properties = 0;
@@ -71,6 +71,34 @@ msleep(
 
 
 
+/** Free running hardware timer.
+ *
+ * It counts at 1 MHz but only the low 24 bits are valid, so it
+ * wraps every 16.7 seconds.  Use timer_delta() to compare readings.
+ */
+#define TIMER_MASK		0x00FFFFFF
+
+static inline uint32_t
+timer_read( void )
+{
+	uint32_t (*read_clock)(void) = (void*) 0xff9948d8;
+	return read_clock() & TIMER_MASK;
+}
+
+static inline uint32_t
+timer_delta(
+	uint32_t		start,
+	uint32_t		end
+)
+{
+	return (end - start) & TIMER_MASK;
+}
+
+
+/** Compiler barrier to order stores to memory shared between tasks */
+#define barrier()		asm volatile( "" ::: "memory" )
+
+
 /** Create a new user level task.
  *
  * The arguments are not really known yet.
@@ -0,0 +1,309 @@
+/** \file
+ * Fixed point FFT for the audio spectrum display.
+ *
+ * 256 point radix-4 decimation in frequency, Q15 with a divide by
+ * four at each of the four stages so that nothing can overflow.
+ * The output is scaled by 1/N.  All of the tables are constant.
+ *
+ * On the host this builds a test program that checks the FFT
+ * against a floating point DFT and known tones.
+ */
+/*
+ * Copyright (C) 2009 Trammell Hudson <hudson+ml@osresearch.net>
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+#ifndef __ARM__
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#else
+#include "dryos.h"
+#endif
+#include "fft.h"
+#include "audio-stats.h"
+
+
+/** cos( 2 pi k / N ) in Q15.  sin() is the same table a quarter
+ * turn later and the Hann window is ( 1 - cos ) / 2.
+ */
+static const int16_t fft_cos[ FFT_SIZE ] = {
+	 32767,  32758,  32729,  32679,  32610,  32522,  32413,  32286,
+	 32138,  31972,  31786,  31581,  31357,  31114,  30853,  30572,
+	 30274,  29957,  29622,  29269,  28899,  28511,  28106,  27684,
+	 27246,  26791,  26320,  25833,  25330,  24812,  24279,  23732,
+	 23170,  22595,  22006,  21403,  20788,  20160,  19520,  18868,
+	 18205,  17531,  16846,  16151,  15447,  14733,  14010,  13279,
+	 12540,  11793,  11039,  10279,   9512,   8740,   7962,   7180,
+	  6393,   5602,   4808,   4011,   3212,   2411,   1608,    804,
+	     0,   -804,  -1608,  -2411,  -3212,  -4011,  -4808,  -5602,
+	 -6393,  -7180,  -7962,  -8740,  -9512, -10279, -11039, -11793,
+	-12540, -13279, -14010, -14733, -15447, -16151, -16846, -17531,
+	-18205, -18868, -19520, -20160, -20788, -21403, -22006, -22595,
+	-23170, -23732, -24279, -24812, -25330, -25833, -26320, -26791,
+	-27246, -27684, -28106, -28511, -28899, -29269, -29622, -29957,
+	-30274, -30572, -30853, -31114, -31357, -31581, -31786, -31972,
+	-32138, -32286, -32413, -32522, -32610, -32679, -32729, -32758,
+	-32768, -32758, -32729, -32679, -32610, -32522, -32413, -32286,
+	-32138, -31972, -31786, -31581, -31357, -31114, -30853, -30572,
+	-30274, -29957, -29622, -29269, -28899, -28511, -28106, -27684,
+	-27246, -26791, -26320, -25833, -25330, -24812, -24279, -23732,
+	-23170, -22595, -22006, -21403, -20788, -20160, -19520, -18868,
+	-18205, -17531, -16846, -16151, -15447, -14733, -14010, -13279,
+	-12540, -11793, -11039, -10279,  -9512,  -8740,  -7962,  -7180,
+	 -6393,  -5602,  -4808,  -4011,  -3212,  -2411,  -1608,   -804,
+	     0,    804,   1608,   2411,   3212,   4011,   4808,   5602,
+	  6393,   7180,   7962,   8740,   9512,  10279,  11039,  11793,
+	 12540,  13279,  14010,  14733,  15447,  16151,  16846,  17531,
+	 18205,  18868,  19520,  20160,  20788,  21403,  22006,  22595,
+	 23170,  23732,  24279,  24812,  25330,  25833,  26320,  26791,
+	 27246,  27684,  28106,  28511,  28899,  29269,  29622,  29957,
+	 30274,  30572,  30853,  31114,  31357,  31581,  31786,  31972,
+	 32138,  32286,  32413,  32522,  32610,  32679,  32729,  32758,
+};
+
+
+/** Base 4 digit reversal of the output index */
+static const uint8_t fft_rev[ FFT_SIZE ] = {
+	  0,  64, 128, 192,  16,  80, 144, 208,  32,  96, 160, 224,  48, 112, 176, 240,
+	  4,  68, 132, 196,  20,  84, 148, 212,  36, 100, 164, 228,  52, 116, 180, 244,
+	  8,  72, 136, 200,  24,  88, 152, 216,  40, 104, 168, 232,  56, 120, 184, 248,
+	 12,  76, 140, 204,  28,  92, 156, 220,  44, 108, 172, 236,  60, 124, 188, 252,
+	  1,  65, 129, 193,  17,  81, 145, 209,  33,  97, 161, 225,  49, 113, 177, 241,
+	  5,  69, 133, 197,  21,  85, 149, 213,  37, 101, 165, 229,  53, 117, 181, 245,
+	  9,  73, 137, 201,  25,  89, 153, 217,  41, 105, 169, 233,  57, 121, 185, 249,
+	 13,  77, 141, 205,  29,  93, 157, 221,  45, 109, 173, 237,  61, 125, 189, 253,
+	  2,  66, 130, 194,  18,  82, 146, 210,  34,  98, 162, 226,  50, 114, 178, 242,
+	  6,  70, 134, 198,  22,  86, 150, 214,  38, 102, 166, 230,  54, 118, 182, 246,
+	 10,  74, 138, 202,  26,  90, 154, 218,  42, 106, 170, 234,  58, 122, 186, 250,
+	 14,  78, 142, 206,  30,  94, 158, 222,  46, 110, 174, 238,  62, 126, 190, 254,
+	  3,  67, 131, 195,  19,  83, 147, 211,  35,  99, 163, 227,  51, 115, 179, 243,
+	  7,  71, 135, 199,  23,  87, 151, 215,  39, 103, 167, 231,  55, 119, 183, 247,
+	 11,  75, 139, 203,  27,  91, 155, 219,  43, 107, 171, 235,  59, 123, 187, 251,
+	 15,  79, 143, 207,  31,  95, 159, 223,  47, 111, 175, 239,  63, 127, 191, 255,
+};
+
+
+static inline int
+fft_sin(
+	unsigned		k
+)
+{
+	return fft_cos[ (k - FFT_SIZE/4) % FFT_SIZE ];
+}
+
+
+void
+fft_radix4(
+	struct fft_work *	w
+)
+{
+	int16_t * const re = w->re;
+	int16_t * const im = w->im;
+	unsigned n2;
+
+	for( n2 = FFT_SIZE ; n2 > 1 ; n2 >>= 2 )
+	{
+		const unsigned n1 = n2 / 4;
+		const unsigned step = FFT_SIZE / n2;
+		unsigned j;
+
+		for( j=0 ; j<n1 ; j++ )
+		{
+			// Twiddles W^(q * j * step) = cos - i sin
+			const unsigned k = j * step;
+			const int c1 = fft_cos[ k*1 ], s1 = fft_sin( k*1 );
+			const int c2 = fft_cos[ k*2 ], s2 = fft_sin( k*2 );
+			const int c3 = fft_cos[ k*3 ], s3 = fft_sin( k*3 );
+			unsigned i0;
+
+			for( i0 = j ; i0 < FFT_SIZE ; i0 += n2 )
+			{
+				const unsigned i1 = i0 + n1;
+				const unsigned i2 = i1 + n1;
+				const unsigned i3 = i2 + n1;
+
+				const int t0r = (re[i0] + re[i2]) >> 2;
+				const int t0i = (im[i0] + im[i2]) >> 2;
+				const int t1r = (re[i0] - re[i2]) >> 2;
+				const int t1i = (im[i0] - im[i2]) >> 2;
+				const int t2r = (re[i1] + re[i3]) >> 2;
+				const int t2i = (im[i1] + im[i3]) >> 2;
+				const int t3r = (re[i1] - re[i3]) >> 2;
+				const int t3i = (im[i1] - im[i3]) >> 2;
+
+				// y1 = t1 - i t3, y2 = t0 - t2, y3 = t1 + i t3
+				const int y1r = t1r + t3i;
+				const int y1i = t1i - t3r;
+				const int y2r = t0r - t2r;
+				const int y2i = t0i - t2i;
+				const int y3r = t1r - t3i;
+				const int y3i = t1i + t3r;
+
+				re[i0] = t0r + t2r;
+				im[i0] = t0i + t2i;
+
+				re[i1] = ( y1r * c1 + y1i * s1 ) >> 15;
+				im[i1] = ( y1i * c1 - y1r * s1 ) >> 15;
+				re[i2] = ( y2r * c2 + y2i * s2 ) >> 15;
+				im[i2] = ( y2i * c2 - y2r * s2 ) >> 15;
+				re[i3] = ( y3r * c3 + y3i * s3 ) >> 15;
+				im[i3] = ( y3i * c3 - y3r * s3 ) >> 15;
+			}
+		}
+	}
+}
+
+
+void
+fft_spectrum(
+	struct fft_work *	w,
+	const int16_t *		samples,
+	unsigned		stride,
+	uint16_t *		mag
+)
+{
+	unsigned i;
+
+	for( i=0 ; i<FFT_SIZE ; i++, samples += stride )
+	{
+		const int hann = (32767 - fft_cos[i]) >> 1;
+		w->re[i] = ( *samples * hann ) >> 15;
+		w->im[i] = 0;
+	}
+
+	fft_radix4( w );
+
+	// A full scale sine is N/2 before the 1/N scaling and the
+	// Hann window halves it again, so scale by four.
+	for( i=0 ; i<FFT_SIZE/2 ; i++ )
+	{
+		const unsigned k = fft_rev[i];
+		const int r = w->re[k];
+		const int m = w->im[k];
+		uint32_t a = audio_isqrt( r*r + m*m ) * 4;
+		mag[i] = a > 0xFFFF ? 0xFFFF : a;
+	}
+}
+
+
+#ifndef __ARM__
+static int
+check_dft( void )
+{
+	struct fft_work w;
+	double in_re[ FFT_SIZE ], in_im[ FFT_SIZE ];
+	unsigned i, k;
+
+	srand( 1 );
+	for( i=0 ; i<FFT_SIZE ; i++ )
+	{
+		in_re[i] = w.re[i] = (rand() % 65536) - 32768;
+		in_im[i] = w.im[i] = (rand() % 65536) - 32768;
+	}
+
+	fft_radix4( &w );
+
+	double max_err = 0;
+	for( k=0 ; k<FFT_SIZE ; k++ )
+	{
+		double xr = 0, xi = 0;
+		for( i=0 ; i<FFT_SIZE ; i++ )
+		{
+			const double a = -2 * M_PI * i * k / FFT_SIZE;
+			xr += in_re[i] * cos(a) - in_im[i] * sin(a);
+			xi += in_re[i] * sin(a) + in_im[i] * cos(a);
+		}
+
+		const unsigned j = fft_rev[k];
+		const double er = fabs( xr / FFT_SIZE - w.re[j] );
+		const double ei = fabs( xi / FFT_SIZE - w.im[j] );
+		if( er > max_err )
+			max_err = er;
+		if( ei > max_err )
+			max_err = ei;
+	}
+
+	printf( "DFT check: max error %.2f LSB\n", max_err );
+	return max_err < 8;
+}
+
+
+static int
+check_tone(
+	double			bin,
+	double			amplitude
+)
+{
+	struct fft_work w;
+	int16_t samples[ FFT_SIZE ];
+	uint16_t mag[ FFT_SIZE/2 ];
+	unsigned i;
+
+	for( i=0 ; i<FFT_SIZE ; i++ )
+		samples[i] = amplitude * 32767 * sin( 2 * M_PI * bin * i / FFT_SIZE );
+
+	fft_spectrum( &w, samples, 1, mag );
+
+	unsigned peak = 0;
+	for( i=1 ; i<FFT_SIZE/2 ; i++ )
+		if( mag[i] > mag[peak] )
+			peak = i;
+
+	const double expected = amplitude * 32767;
+	const double db = 20 * log10( mag[peak] / expected );
+	const int ok = fabs( peak - bin ) <= 0.5 && db > -1.5 && db < 0.5;
+
+	printf( "Tone bin %6.2f amp %.3f: peak bin %3u %6.2f dB %s\n",
+		bin,
+		amplitude,
+		peak,
+		db,
+		ok ? "ok" : "FAIL"
+	);
+
+	return ok;
+}
+
+
+int main( void )
+{
+	int ok = check_dft();
+	ok &= check_tone( 10, 0.5 );
+	ok &= check_tone( 37, 1.0 );
+	ok &= check_tone( 64, 0.1 );
+	ok &= check_tone( 100.5, 0.5 );
+	ok &= check_tone( 3, 0.01 );
+
+	// Benchmark
+	struct fft_work w;
+	int16_t samples[ FFT_SIZE ] = { 0 };
+	uint16_t mag[ FFT_SIZE/2 ];
+	const int count = 100000;
+	clock_t start = clock();
+	for( int i=0 ; i<count ; i++ )
+	{
+		samples[i % FFT_SIZE] = i;
+		fft_spectrum( &w, samples, 1, mag );
+	}
+	const double secs = (double)( clock() - start ) / CLOCKS_PER_SEC;
+	printf( "%.2f usec per %d point spectrum\n", secs * 1e6 / count, FFT_SIZE );
+
+	return ok ? 0 : 1;
+}
+#endif
@@ -0,0 +1,60 @@
+#ifndef _fft_h_
+#define _fft_h_
+
+/** \file
+ * Fixed point FFT for the audio spectrum display.
+ */
+/*
+ * Copyright (C) 2009 Trammell Hudson <hudson+ml@osresearch.net>
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include <stdint.h>
+
+#define FFT_SIZE		256
+
+/** Working buffers; the caller provides them so the FFT is reentrant */
+struct fft_work
+{
+	int16_t			re[ FFT_SIZE ];
+	int16_t			im[ FFT_SIZE ];
+};
+
+
+/** In place forward FFT, scaled by 1/N.
+ * The output is in base 4 digit reversed order.
+ */
+extern void
+fft_radix4(
+	struct fft_work *	w
+);
+
+
+/** Hann windowed magnitude spectrum of FFT_SIZE samples, stride
+ * apart.  mag[] gets FFT_SIZE/2 bins in sample units, so a full
+ * scale sine centered on a bin reads about 32767.
+ */
+extern void
+fft_spectrum(
+	struct fft_work *	w,
+	const int16_t *		samples,
+	unsigned		stride,
+	uint16_t *		mag
+);
+
+#endif
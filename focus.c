@@ -96,13 +96,16 @@ focus_stack(
 		if( count-1 == i )
 			break;
 
-		lens_focus( 0xD, step );
+		// Stop the stack rather than shoot the same plane twice
+		if( lens_focus( 0xD, step ) < 0 )
+			break;
 		lens_focus_wait();
 		msleep( 50 );
 	}
 
 	// Restore to the starting focus position
-	lens_focus( 0, -step * (count-1) );
+	if( i )
+		lens_focus( 0, -step * (int) i );
 }
 
 
@@ -257,8 +260,10 @@ rack_focus(
 		if( speed > delta )
 			speed = delta;
 
+		// Give up on a lens that has stopped answering
+		if( lens_focus( 0x7, speed_cmd ) < 0 )
+			break;
 		delta -= speed;
-		lens_focus( 0x7, speed_cmd );
 	}
 }
 
@@ -292,8 +297,10 @@ focus_task( void )
 
 		while( focus_task_dir )
 		{
-			lens_focus( 1, step );
-			focus_task_delta += step;
+			// Only count the steps that were sent; the next
+			// pass retries while the button is still held.
+			if( lens_focus( 1, step ) == 0 )
+				focus_task_delta += step;
 			if( step > 0 && step < 1000 )
 				step = ((step+1) * 100) / 99;
 			else
@@ -353,18 +360,22 @@ PTP_HANDLER( 0x9998, 0 )
 {
 	int step = (int) param1;
 
-	focus_position += step;
-	if( focus_position < 0 )
-		focus_position = 0;
-	else
-	if( focus_position > FOCUS_MAX )
-		focus_position = FOCUS_MAX;
+	// The host sees the error and can send the step again
+	const int rc = lens_focus( 0x7, step );
+	if( rc == 0 )
+	{
+		focus_position += step;
+		if( focus_position < 0 )
+			focus_position = 0;
+		else
+		if( focus_position > FOCUS_MAX )
+			focus_position = FOCUS_MAX;
+	}
 
-	lens_focus( 0x7, (int) param1 );
 	bmp_printf( FONT_MED, 650, 35, "%04d", focus_position );
 
 	struct ptp_msg msg = {
-		.id		= PTP_RC_OK,
+		.id		= rc == 0 ? PTP_RC_OK : PTP_RC_ERROR,
 		.session	= session,
 		.transaction	= transaction,
 		.param_count	= 2,
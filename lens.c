@@ -31,6 +31,7 @@
 static struct semaphore * lens_sem;
 static struct semaphore * focus_done_sem;
 static struct semaphore * job_sem;
+static struct semaphore * mvr_log_sem;
 
 
 struct lens_info lens_info = {
@@ -306,15 +307,36 @@ lens_focus_wait( void )
 }
 
 
-void
+static void
+lens_focus_done(
+	unsigned		property,
+	void *			arg,
+	int			status
+)
+{
+	give_semaphore( focus_done_sem );
+}
+
+
+/** The queue completes every request within PROP_REQUEST_TIMEOUT of
+ * sending it, acked or not; the extra time covers the queue pass.
+ */
+#define LENS_FOCUS_TIMEOUT	( PROP_REQUEST_TIMEOUT + 100 )	// ms
+
+int
 lens_focus(
 	unsigned		mode,
 	int			step
 )
 {
-	// Should we timeout to avoid hanging?
-	if( take_semaphore( focus_done_sem, 100 ) != 0 )
-		return;
+	// Steps are relative, so they are not left to coalesce in the
+	// queue; wait for the last one instead.  If it never completes
+	// the step is not sent and the caller decides what to do.
+	if( take_semaphore( focus_done_sem, LENS_FOCUS_TIMEOUT ) != 0 )
+	{
+		DebugMsg( DM_MAGIC, 3, "%s: step %d dropped", __func__, step );
+		return -1;
+	}
 
 	struct prop_focus focus = {
 		.active		= 1,
@@ -323,7 +345,9 @@ lens_focus(
 		.step_lo	= (step >> 0) & 0xFF,
 	};
 
-	prop_request_change( PROP_LV_FOCUS, &focus, sizeof(focus) );
+	prop_request_queue( PROP_LV_FOCUS, &focus, sizeof(focus),
+		PROP_LV_FOCUS_DONE, 0, lens_focus_done, 0 );
+	return 0;
 }
 
 
@@ -361,9 +385,16 @@ lens_take_picture(
 }
 
 
+/** Movie log.
+ * The file is opened and closed by the PROP_MVR_REC_START handler
+ * and written by the lens task and by other modules, so every use of
+ * mvr_logfile is under mvr_log_sem.
+ */
 static FILE * mvr_logfile = INVALID_PTR;
 
-/** Write the current lens info into the logfile */
+/** Write the current lens info into the logfile.
+ * Called with mvr_log_sem held.
+ */
 static void
 mvr_update_logfile(
 	struct lens_info *	info,
@@ -396,15 +427,30 @@ mvr_update_logfile(
 	last_focal_len	= info->focal_len;
 	last_focus_dist	= info->focus_dist;
 
-	struct tm now;
-	LoadCalendarFromRTC( &now );
+	// Stamp the line with timecode if the clock has been jammed
+	char stamp[ 16 ];
+	struct tc_time tc;
+	if( timecode_now( &tc ) )
+		snprintf( stamp, sizeof(stamp), "%02d:%02d:%02d:%02d",
+			tc.hours,
+			tc.minutes,
+			tc.seconds,
+			tc.frames
+		);
+	else {
+		struct tm now;
+		LoadCalendarFromRTC( &now );
+		snprintf( stamp, sizeof(stamp), "%02d:%02d:%02d",
+			now.tm_hour,
+			now.tm_min,
+			now.tm_sec
+		);
+	}
 
 	fprintf(
 		mvr_logfile,
-		"%02d:%02d:%02d,%d,%d,%d.%d,%d,%d\n",
-		now.tm_hour,
-		now.tm_min,
-		now.tm_sec,
+		"%s,%d,%d,%d.%d,%d,%d\n",
+		stamp,
 		info->iso,
 		info->shutter,
 		info->aperture / 10,
@@ -414,8 +460,40 @@ mvr_update_logfile(
 	);
 }
 
+/** Append a line to the movie log from other modules.
+ * Nothing is written if no movie is being recorded.
+ */
+void
+mvr_log_printf(
+	const char *		fmt,
+	...
+)
+{
+	if( mvr_logfile == INVALID_PTR )
+		return;
+
+	va_list			ap;
+	char			buf[ 128 ];
+
+	va_start( ap, fmt );
+	int len = vsnprintf( buf, sizeof(buf), fmt, ap );
+	va_end( ap );
+
+	if( len > (int) sizeof(buf) - 1 )
+		len = sizeof(buf) - 1;
+
+	// The check above only skips the formatting; the movie may
+	// have stopped since
+	take_semaphore( mvr_log_sem, 0 );
+	if( mvr_logfile != INVALID_PTR )
+		FIO_WriteFile( mvr_logfile, buf, len );
+	give_semaphore( mvr_log_sem );
+}
+
+
 /** Create a logfile for each movie.
  * Record a logfile with the lens info for each movie.
+ * Called with mvr_log_sem held.
  */
 static void
 mvr_create_logfile(
@@ -463,6 +541,16 @@ mvr_create_logfile(
 
 	fprintf( mvr_logfile, "Lens: %s\n", lens_info.name );
 
+	struct tc_time tc;
+	if( timecode_now( &tc ) )
+		fprintf( mvr_logfile, "Timecode: %02d:%02d:%02d:%02d @ %d fps\n",
+			tc.hours,
+			tc.minutes,
+			tc.seconds,
+			tc.frames,
+			tc.fps
+		);
+
 	fprintf( mvr_logfile, "%s\n",
 		"Frame,ISO,Shutter,Aperture,Focal_Len,Focus_Dist"
 	);
@@ -484,8 +572,9 @@ bswap16(
 
 PROP_HANDLER( PROP_MVR_REC_START )
 {
+	take_semaphore( mvr_log_sem, 0 );
 	mvr_create_logfile( *(unsigned*) buf );
-	return prop_cleanup( token, property );
+	give_semaphore( mvr_log_sem );
 }
 
 
@@ -494,7 +583,6 @@ PROP_HANDLER( PROP_LENS_NAME )
 	if( len > sizeof(lens_info.name) )
 		len = sizeof(lens_info.name);
 	memcpy( lens_info.name, buf, len );
-	return prop_cleanup( token, property );
 }
 
 
@@ -505,7 +593,6 @@ PROP_HANDLER( PROP_APERTURE )
 	lens_info.aperture = raw/2 < COUNT(aperture_values)
 		? aperture_values[ raw / 2 ]
 		: 0;
-	return prop_cleanup( token, property );
 }
 
 
@@ -516,7 +603,6 @@ PROP_HANDLER( PROP_SHUTTER )
 	lens_info.shutter = raw/2 < COUNT(shutter_values)
 		? shutter_values[ raw / 2 ]
 		: 0;
-	return prop_cleanup( token, property );
 }
 
 
@@ -527,25 +613,19 @@ PROP_HANDLER( PROP_ISO )
 	lens_info.iso = raw/2 < COUNT(iso_values)
 		? iso_values[ raw / 2 ]
 		: 0;
-	return prop_cleanup( token, property );
 }
 
 
+/** The lens task reads the whole structure from the cache */
 PROP_HANDLER( PROP_LV_LENS )
 {
-	const struct prop_lv_lens * const lv_lens = (void*) buf;
-	lens_info.focal_len	= bswap16( lv_lens->focal_len );
-	lens_info.focus_dist	= bswap16( lv_lens->focus_dist );
-
 	give_semaphore( lens_sem );
-	return prop_cleanup( token, property );
 }
 
 
 PROP_HANDLER( PROP_LVCAF_STATE )
 {
 	bmp_hexdump( FONT_SMALL, 200, 50, buf, len );
-	return prop_cleanup( token, property );
 }
 
 
@@ -561,21 +641,34 @@ PROP_HANDLER( PROP_LV_FOCUS )
 			(unsigned) step & 0xFFFF,
 			focus->mode
 		);
-	return prop_cleanup( token, property );
 }
 
 
-PROP_HANDLER( PROP_LV_FOCUS_DONE )
-{
-	// The last focus command has completed
-	give_semaphore( focus_done_sem );
-	return prop_cleanup( token, property );
-}
+/** Completes the queued focus command, see lens_focus() */
+PROP_WATCH( PROP_LV_FOCUS_DONE );
+
+/** The setting changes complete when this is delivered */
+PROP_WATCH( PROP_AE );
 
 
 PROP_HANDLER( PROP_LAST_JOB_STATE )
 {
 	const uint32_t state = *(uint32_t*) buf;
+
+	// Stamp the timecode when a new capture starts
+	if( state != 0xA && lens_info.job_state == 0xA )
+	{
+		lens_info.job_timecode_valid = timecode_now( &lens_info.job_timecode );
+		if( lens_info.job_timecode_valid )
+			DebugMsg( DM_MAGIC, 3, "%s: capture at %02d:%02d:%02d:%02d",
+				__func__,
+				lens_info.job_timecode.hours,
+				lens_info.job_timecode.minutes,
+				lens_info.job_timecode.seconds,
+				lens_info.job_timecode.frames
+			);
+	}
+
 	lens_info.job_state = state;
 	if( state == 0xA )
 	{
@@ -586,19 +679,35 @@ PROP_HANDLER( PROP_LAST_JOB_STATE )
 		);
 		give_semaphore( job_sem );
 	}
-	return prop_cleanup( token, property );
 }
 
 
 static void
 lens_task( void * priv )
 {
+	const struct prop_cache * const lv_lens_cache
+		= prop_cache_find( PROP_LV_LENS );
+
 	while(1)
 	{
 		take_semaphore( lens_sem, 0 );
+
+		// A consistent copy, even if the next delivery is racing
+		// us, so the focal length and distance always match
+		struct prop_lv_lens lv_lens;
+		if( prop_cache_read( lv_lens_cache, &lv_lens, sizeof(lv_lens) )
+			>= (int) sizeof(lv_lens)
+		) {
+			lens_info.focal_len	= bswap16( lv_lens.focal_len );
+			lens_info.focus_dist	= bswap16( lv_lens.focus_dist );
+		}
+
 		calc_dof( &lens_info );
 		update_lens_display( &lens_info );
+
+		take_semaphore( mvr_log_sem, 0 );
 		mvr_update_logfile( &lens_info, 0 ); // do not force it
+		give_semaphore( mvr_log_sem );
 	}
 }
 
@@ -613,6 +722,7 @@ lens_init( void )
 	lens_sem = create_named_semaphore( "lens_info", 1 );
 	focus_done_sem = create_named_semaphore( "focus_sem", 1 );
 	job_sem = create_named_semaphore( "job", 1 );
+	mvr_log_sem = create_named_semaphore( "mvr_log", 1 );
 }
 
 INIT_FUNC( "lens", lens_init );
@@ -29,6 +29,7 @@
  */
 
 #include "property.h"
+#include "timecode.h"
 
 struct lens_info
 {
@@ -44,6 +45,10 @@ struct lens_info
 	unsigned		dof_far; // in mm
 	unsigned		job_state; // see PROP_LAST_JOB_STATE
 
+	// Timecode at the start of the last capture, if jammed
+	struct tc_time		job_timecode;
+	int			job_timecode_valid;
+
 	// Store the raw values before the lookup tables
 	uint8_t			raw_aperture;
 	uint8_t			raw_shutter;
@@ -168,13 +173,22 @@ SIZE_CHECK_STRUCT( prop_focus, 4 );
 #define ISO_12500 128
 
 
-/** Camera control functions */
+/** Camera control functions.
+ *
+ * These go through the property request queue, so a burst of changes
+ * to one setting only sends the last one.  Each change completes when
+ * the camera broadcasts the new value; use lens_settings_wait() before
+ * anything that depends on it, like taking a picture.
+ */
+#define LENS_SETTING_INTERVAL	20	// ms
+
 static inline void
 lens_set_aperture(
 	unsigned		aperture
 )
 {
-	prop_request_change( PROP_APERTURE, &aperture, sizeof(aperture) );
+	prop_request_queue( PROP_APERTURE, &aperture, sizeof(aperture),
+		PROP_APERTURE, LENS_SETTING_INTERVAL, NULL, NULL );
 }
 
 
@@ -183,7 +197,8 @@ lens_set_iso(
 	unsigned		iso
 )
 {
-	prop_request_change( PROP_ISO, &iso, sizeof(iso) );
+	prop_request_queue( PROP_ISO, &iso, sizeof(iso),
+		PROP_ISO, LENS_SETTING_INTERVAL, NULL, NULL );
 }
 
 
@@ -192,7 +207,8 @@ lens_set_shutter(
 	unsigned		shutter
 )
 {
-	prop_request_change( PROP_SHUTTER, &shutter, sizeof(shutter) );
+	prop_request_queue( PROP_SHUTTER, &shutter, sizeof(shutter),
+		PROP_SHUTTER, LENS_SETTING_INTERVAL, NULL, NULL );
 }
 
 
@@ -201,19 +217,31 @@ lens_set_ae(
 	int			cmd
 )
 {
-	prop_request_change( PROP_AE, &cmd, sizeof(cmd) );
+	prop_request_queue( PROP_AE, &cmd, sizeof(cmd),
+		PROP_AE, LENS_SETTING_INTERVAL, NULL, NULL );
 }
 
 
-// This is currently broken.
+/** Wait until the queued setting changes have been applied.
+ * Returns 0 if they were, -1 if one of them timed out.
+ */
 static inline int
-lens_get_ae( void )
+lens_settings_wait( void )
 {
-	int ae = 0;
-	//size_t size = sizeof(ae);
-	//prop_get_value( PROP_AE, &ae, &size );
+	return 0
+		| prop_request_wait( PROP_APERTURE, PROP_REQUEST_TIMEOUT )
+		| prop_request_wait( PROP_ISO, PROP_REQUEST_TIMEOUT )
+		| prop_request_wait( PROP_SHUTTER, PROP_REQUEST_TIMEOUT )
+		| prop_request_wait( PROP_AE, PROP_REQUEST_TIMEOUT )
+		;
+}
+
 
-	return ae;
+/** PROP_AE is a signed 8-bit value, kept by the property bus */
+static inline int
+lens_get_ae( void )
+{
+	return (int8_t) prop_cache_int( PROP_AE, 0 );
 }
 
 
@@ -223,8 +251,11 @@ lens_take_picture(
 );
 
 
-/** Will block if it is not safe to send the focus command */
-extern void
+/** Will block until the previous focus command has completed.
+ * Returns 0 if the step was queued, -1 if the previous one did not
+ * complete in time and the step was not sent.
+ */
+extern int
 lens_focus(
 	unsigned		mode,
 	int			step
@@ -242,6 +273,13 @@ lens_focus_start( int dir );
 extern void
 lens_focus_stop( void );
 
+/** Append to the movie log, if a movie is being recorded */
+extern void
+mvr_log_printf(
+	const char *		fmt,
+	...
+) __attribute__((format(printf,1,2)));
+
 /** Format a distance in mm into something useful */
 extern const char *
 lens_format_dist(
@@ -82,6 +82,7 @@ menu_binary_toggle(
 {
 	unsigned * val = priv;
 	*val = !*val;
+	config_value_changed( val );
 }
 
 
@@ -0,0 +1,192 @@
+/** \file
+ * Generate SMPTE linear timecode as a Sun .au file.
+ *
+ * The timecode host program benchmarks the decoder on an .au file;
+ * this writes one with a known start time so the decoded frames can
+ * be checked without a timecode generator.
+ *
+ *	mkltc [-r rate] [-f fps] [-s seconds] [-t hh:mm:ss:ff] file.au
+ *
+ * The output is mono 16 bit PCM with a square biphase mark signal.
+ * Drop frame counting is not generated.
+ */
+/*
+ * Copyright (C) 2009 Trammell Hudson <hudson+ml@osresearch.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h> // for htonl
+#include "timecode.h"
+
+#define LTC_AMPLITUDE		16000
+
+
+/** Set count bits of the frame starting at bit, LSB first */
+static void
+ltc_bits(
+	uint8_t *		bits,
+	unsigned		bit,
+	unsigned		count,
+	unsigned		value
+)
+{
+	unsigned i;
+	for( i=0 ; i<count ; i++ )
+		bits[ bit + i ] = (value >> i) & 1;
+}
+
+
+/** Lay out one frame, with the sync word in transmission order */
+static void
+ltc_encode(
+	uint8_t *		bits,
+	unsigned		hours,
+	unsigned		minutes,
+	unsigned		seconds,
+	unsigned		frames
+)
+{
+	unsigned i;
+
+	memset( bits, 0, LTC_FRAME_BITS );
+	ltc_bits( bits,  0, 4, frames % 10 );
+	ltc_bits( bits,  8, 2, frames / 10 );
+	ltc_bits( bits, 16, 4, seconds % 10 );
+	ltc_bits( bits, 24, 3, seconds / 10 );
+	ltc_bits( bits, 32, 4, minutes % 10 );
+	ltc_bits( bits, 40, 3, minutes / 10 );
+	ltc_bits( bits, 48, 4, hours % 10 );
+	ltc_bits( bits, 56, 2, hours / 10 );
+
+	// LTC_SYNC has the newest bit first, so the last bit sent is bit 0
+	for( i=0 ; i<16 ; i++ )
+		bits[ 64 + i ] = (LTC_SYNC >> (15 - i)) & 1;
+}
+
+
+static void
+write_be32(
+	FILE *			file,
+	uint32_t		value
+)
+{
+	value = htonl( value );
+	fwrite( &value, sizeof(value), 1, file );
+}
+
+
+int main( int argc, char ** argv )
+{
+	unsigned rate = 48000;
+	unsigned fps = 30;
+	unsigned secs = 10;
+	unsigned hh = 1, mm = 0, ss = 0, ff = 0;
+	int opt;
+
+	while( (opt = getopt( argc, argv, "r:f:s:t:" )) != -1 )
+	{
+		switch( opt )
+		{
+		case 'r': rate = strtoul( optarg, 0, 0 ); break;
+		case 'f': fps = strtoul( optarg, 0, 0 ); break;
+		case 's': secs = strtoul( optarg, 0, 0 ); break;
+		case 't':
+			if( sscanf( optarg, "%u:%u:%u:%u", &hh, &mm, &ss, &ff ) == 4 )
+				break;
+			// fall through
+		default:
+			goto usage;
+		}
+	}
+
+	if( optind != argc - 1 || fps == 0 || rate < fps * LTC_FRAME_BITS * 4 )
+		goto usage;
+
+	const char * const name = argv[optind];
+	FILE * const file = fopen( name, "wb" );
+	if( !file )
+	{
+		perror( name );
+		return EXIT_FAILURE;
+	}
+
+	const uint64_t frame_count = (uint64_t) secs * fps;
+	const uint64_t half_bits = frame_count * LTC_FRAME_BITS * 2;
+	const uint64_t samples = half_bits * rate / (fps * LTC_FRAME_BITS * 2);
+
+	write_be32( file, 0x2e736e64 );
+	write_be32( file, 24 );
+	write_be32( file, samples * sizeof(int16_t) );
+	write_be32( file, 3 );		// 16 bit linear
+	write_be32( file, rate );
+	write_be32( file, 1 );
+
+	uint8_t bits[ LTC_FRAME_BITS ];
+	int level = LTC_AMPLITUDE;
+	uint64_t sample = 0;
+	uint64_t half = 0;
+	uint64_t f;
+
+	for( f=0 ; f<frame_count ; f++ )
+	{
+		ltc_encode( bits, hh, mm, ss, ff );
+
+		unsigned b;
+		for( b=0 ; b<LTC_FRAME_BITS ; b++ )
+		{
+			unsigned h;
+			for( h=0 ; h<2 ; h++ )
+			{
+				// Every cell starts with a transition, and a
+				// one has another in the middle
+				if( h == 0 || bits[b] )
+					level = -level;
+
+				const uint64_t end = ++half * rate / (fps * LTC_FRAME_BITS * 2);
+				const int16_t out = htons( (int16_t) level );
+				for( ; sample < end ; sample++ )
+					fwrite( &out, sizeof(out), 1, file );
+			}
+		}
+
+		if( ++ff < fps )
+			continue;
+		ff = 0;
+		if( ++ss < 60 )
+			continue;
+		ss = 0;
+		if( ++mm < 60 )
+			continue;
+		mm = 0;
+		hh = (hh + 1) % 24;
+	}
+
+	fclose( file );
+	return 0;
+
+usage:
+	fprintf( stderr,
+		"Usage: %s [-r rate] [-f fps] [-s seconds] [-t hh:mm:ss:ff] file.au\n",
+		argv[0]
+	);
+	return -1;
+}
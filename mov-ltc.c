@@ -0,0 +1,753 @@
+/** \file
+ * Extract SMPTE LTC from the audio track of recorded movies.
+ *
+ * For each clip the moov atom is parsed for the first sound track,
+ * then only its PCM chunks are read, in file order, with adjacent
+ * chunks merged into large reads.  The samples are run through the
+ * same decoder that the camera uses and a line is printed with the
+ * start timecode of the clip and how far the audio clock drifted
+ * against the timecode.  Clips are spread over worker threads so a
+ * card of movies is limited by the disk, not the decoder.
+ *
+ *	mov-ltc [-j threads] [-c channel] [-g gap] file.mov|dir ...
+ *
+ * Only uncompressed 16 bit PCM ('sowt', 'twos' or 'lpcm') is handled,
+ * which is what the camera records.
+ */
+/*
+ * Copyright (C) 2009 Trammell Hudson <hudson+ml@osresearch.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "compiler.h"
+#include "timecode.h"
+
+#define FOURCC(a,b,c,d)	( ((a) << 24) | ((b) << 16) | ((c) << 8) | (d) )
+
+/** Reads are merged until they reach this size */
+#define READ_SIZE		(4 << 20)
+
+/** Samples converted per decoder call */
+#define DECODE_BLOCK		4096
+
+
+static unsigned ltc_channel;
+static uint64_t max_gap;
+
+
+static inline uint32_t
+be32( const uint8_t * p )
+{
+	return ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static inline uint16_t
+be16( const uint8_t * p )
+{
+	return (p[0] << 8) | p[1];
+}
+
+static inline uint64_t
+be64( const uint8_t * p )
+{
+	return ((uint64_t) be32( p ) << 32) | be32( p + 4 );
+}
+
+
+/** The parts of a sound track that are needed to find its samples */
+struct mov_track
+{
+	uint32_t		handler;
+	uint32_t		format;
+	unsigned		channels;
+	unsigned		bits;
+	unsigned		rate;
+	int			big_endian;
+
+	uint64_t *		chunks;		//!< File offsets
+	uint32_t		num_chunks;
+
+	const uint8_t *		stsc;		//!< Points into the moov copy
+	uint32_t		num_stsc;
+};
+
+
+struct clip
+{
+	const char *		name;
+	const char *		error;
+
+	unsigned		rate;
+	unsigned		channels;
+	uint64_t		bytes;
+	uint64_t		samples;
+
+	struct ltc_decoder	dec;
+	unsigned		fps;
+	unsigned		frames;
+	unsigned		jumps;		//!< Frames that did not follow on
+	uint32_t		first_num;
+	uint64_t		first_pos;
+	uint32_t		last_num;
+	uint64_t		last_pos;
+};
+
+
+static void
+parse_stsd(
+	struct mov_track *	track,
+	const uint8_t *		p,
+	uint64_t		len
+)
+{
+	// version/flags, entry count, then the first entry
+	if( len < 8 + 36 || be32( p + 4 ) < 1 )
+		return;
+
+	const uint8_t * e = p + 8;
+	const unsigned version = be16( e + 16 );
+
+	track->format	= be32( e + 4 );
+	track->channels	= be16( e + 24 );
+	track->bits	= be16( e + 26 );
+	track->rate	= be32( e + 32 ) >> 16;
+	track->big_endian = track->format == FOURCC('t','w','o','s');
+
+	// Version 2 moves everything into a larger structure
+	if( version == 2 && len >= 8 + 72 )
+	{
+		union { uint64_t u; double d; } rate = { .u = be64( e + 40 ) };
+		track->rate	= rate.d;
+		track->channels	= be32( e + 48 );
+		track->bits	= be32( e + 56 );
+		track->big_endian = be32( e + 60 ) & 2;
+	}
+}
+
+
+/** Walk the atoms in [p, p+len), descending into the containers */
+static void
+parse_atoms(
+	struct mov_track *	track,
+	struct mov_track *	sound,
+	const uint8_t *		p,
+	uint64_t		len
+)
+{
+	while( len >= 8 )
+	{
+		uint64_t size = be32( p );
+		const uint32_t type = be32( p + 4 );
+		unsigned hdr = 8;
+
+		if( size == 1 && len >= 16 )
+		{
+			size = be64( p + 8 );
+			hdr = 16;
+		} else
+		if( size == 0 )
+			size = len;
+
+		if( size < hdr || size > len )
+			return;
+
+		const uint8_t * const body = p + hdr;
+		const uint64_t body_len = size - hdr;
+		uint32_t i;
+
+		switch( type )
+		{
+		case FOURCC('t','r','a','k'):
+		{
+			struct mov_track t = { .handler = 0 };
+			parse_atoms( &t, sound, body, body_len );
+			if( t.handler == FOURCC('s','o','u','n') && !sound->chunks )
+				*sound = t;
+			else
+				free( t.chunks );
+			break;
+		}
+
+		case FOURCC('m','d','i','a'):
+		case FOURCC('m','i','n','f'):
+		case FOURCC('s','t','b','l'):
+			parse_atoms( track, sound, body, body_len );
+			break;
+
+		case FOURCC('h','d','l','r'):
+			if( body_len >= 12 )
+				track->handler = be32( body + 8 );
+			break;
+
+		case FOURCC('s','t','s','d'):
+			parse_stsd( track, body, body_len );
+			break;
+
+		case FOURCC('s','t','s','c'):
+			if( body_len < 8 )
+				break;
+			track->num_stsc = be32( body + 4 );
+			if( 8 + (uint64_t) track->num_stsc * 12 > body_len )
+				track->num_stsc = 0;
+			track->stsc = body + 8;
+			break;
+
+		case FOURCC('s','t','c','o'):
+		case FOURCC('c','o','6','4'):
+		{
+			const unsigned width = type == FOURCC('c','o','6','4') ? 8 : 4;
+			if( body_len < 8 || track->chunks )
+				break;
+
+			uint32_t count = be32( body + 4 );
+			if( 8 + (uint64_t) count * width > body_len )
+				count = (body_len - 8) / width;
+
+			track->chunks = malloc( count * sizeof(*track->chunks) );
+			track->num_chunks = count;
+			for( i=0 ; i<count ; i++ )
+				track->chunks[i] = width == 8
+					? be64( body + 8 + 8*i )
+					: be32( body + 8 + 4*i );
+			break;
+		}
+
+		default:
+			break;
+		}
+
+		p += size;
+		len -= size;
+	}
+}
+
+
+/** Samples in chunk i from the sample-to-chunk runs */
+static uint32_t
+chunk_samples(
+	const struct mov_track *	track,
+	uint32_t			chunk,
+	uint32_t *			run
+)
+{
+	// Chunks are numbered from 1 and are visited in order
+	while( *run + 1 < track->num_stsc
+	&&     be32( track->stsc + 12 * (*run + 1) ) <= chunk + 1
+	)
+		(*run)++;
+
+	return track->num_stsc ? be32( track->stsc + 12 * *run + 4 ) : 0;
+}
+
+
+/** Read the whole moov atom, wherever it is in the file */
+static uint8_t *
+read_moov(
+	int			fd,
+	uint64_t *		moov_len
+)
+{
+	struct stat st;
+	if( fstat( fd, &st ) < 0 )
+		return NULL;
+
+	uint64_t offset = 0;
+	while( offset + 8 <= (uint64_t) st.st_size )
+	{
+		uint8_t hdr[16];
+		if( pread( fd, hdr, sizeof(hdr), offset ) < 8 )
+			return NULL;
+
+		uint64_t size = be32( hdr );
+		unsigned hdr_len = 8;
+		if( size == 1 )
+		{
+			size = be64( hdr + 8 );
+			hdr_len = 16;
+		} else
+		if( size == 0 )
+			size = st.st_size - offset;
+
+		if( size < hdr_len )
+			return NULL;
+
+		if( be32( hdr + 4 ) == FOURCC('m','o','o','v') )
+		{
+			const uint64_t len = size - hdr_len;
+			uint8_t * moov = malloc( len );
+			if( !moov )
+				return NULL;
+			if( pread( fd, moov, len, offset + hdr_len ) != (ssize_t) len )
+			{
+				free( moov );
+				return NULL;
+			}
+
+			*moov_len = len;
+			return moov;
+		}
+
+		offset += size;
+	}
+
+	return NULL;
+}
+
+
+static inline uint32_t
+frame_number(
+	const struct ltc_frame *	frame,
+	unsigned			fps
+)
+{
+	return frame->frames + fps * ( frame->seconds
+		+ 60 * ( frame->minutes + 60 * frame->hours ) );
+}
+
+
+static void
+clip_frame(
+	struct clip *			clip,
+	const struct ltc_frame *	frame,
+	uint64_t			pos
+)
+{
+	// 80 bits per frame; the bit period is in Q8 samples
+	if( !clip->fps )
+	{
+		const unsigned fps = ( (uint64_t) clip->rate << 8 )
+			/ ( 80 * (uint64_t) clip->dec.period );
+		clip->fps = fps < 25 ? 24 : fps < 28 ? 25 : 30;
+	}
+
+	const uint32_t num = frame_number( frame, clip->fps );
+
+	if( clip->frames++ == 0 )
+	{
+		clip->first_num	= num;
+		clip->first_pos	= pos;
+	} else
+	if( num != clip->last_num + 1 )
+		clip->jumps++;
+
+	clip->last_num	= num;
+	clip->last_pos	= pos;
+}
+
+
+/** Convert one channel of a chunk and run it through the decoder */
+static void
+decode_chunk(
+	struct clip *			clip,
+	const struct mov_track *	track,
+	const uint8_t *			buf,
+	uint32_t			samples
+)
+{
+	const unsigned frame_bytes = track->channels * 2;
+	const uint8_t * p = buf + ltc_channel * 2;
+	int16_t block[ DECODE_BLOCK ];
+	struct ltc_frame frames[ 8 ];
+
+	while( samples )
+	{
+		const unsigned n = samples < DECODE_BLOCK ? samples : DECODE_BLOCK;
+		unsigned i;
+
+		if( track->big_endian )
+			for( i=0 ; i<n ; i++, p += frame_bytes )
+				block[i] = (p[0] << 8) | p[1];
+		else
+			for( i=0 ; i<n ; i++, p += frame_bytes )
+				block[i] = (p[1] << 8) | p[0];
+
+		const unsigned found = ltc_decoder_block(
+			&clip->dec,
+			block,
+			n,
+			1,
+			frames,
+			COUNT(frames)
+		);
+
+		for( i=0 ; i<found ; i++ )
+			clip_frame( clip, &frames[i], frames[i].position );
+
+		clip->samples += n;
+		samples -= n;
+	}
+}
+
+
+static void
+scan_clip(
+	struct clip *		clip,
+	uint8_t *		buf
+)
+{
+	struct mov_track sound = { .handler = 0 };
+	uint64_t moov_len = 0;
+	uint8_t * moov = NULL;
+
+	int fd = open( clip->name, O_RDONLY );
+	if( fd < 0 )
+	{
+		clip->error = "open failed";
+		return;
+	}
+
+	moov = read_moov( fd, &moov_len );
+	if( !moov )
+	{
+		clip->error = "no moov atom";
+		goto done;
+	}
+
+	struct mov_track top = { .handler = 0 };
+	parse_atoms( &top, &sound, moov, moov_len );
+	free( top.chunks );
+
+	if( !sound.chunks )
+	{
+		clip->error = "no sound track";
+		goto done;
+	}
+
+	if( sound.bits != 16
+	||  sound.channels == 0
+	||  ( sound.format != FOURCC('s','o','w','t')
+	&&    sound.format != FOURCC('t','w','o','s')
+	&&    sound.format != FOURCC('l','p','c','m') )
+	)
+	{
+		clip->error = "not 16 bit PCM";
+		goto done;
+	}
+
+	if( ltc_channel >= sound.channels )
+	{
+		clip->error = "no such channel";
+		goto done;
+	}
+
+	clip->rate	= sound.rate;
+	clip->channels	= sound.channels;
+
+	// Nominal 30 fps; the decoder tracks 24 and 25 fps as well
+	ltc_decoder_init( &clip->dec, sound.rate / 2400 );
+
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise( fd, 0, 0, POSIX_FADV_SEQUENTIAL );
+#endif
+
+	const unsigned frame_bytes = sound.channels * 2;
+	uint32_t run = 0;
+	uint32_t i = 0;
+
+	while( i < sound.num_chunks )
+	{
+		// Merge chunks until the read is large enough or the gap
+		// of video between them is too big to read through.
+		const uint64_t start = sound.chunks[i];
+		uint64_t end = start;
+		uint32_t first = i;
+		uint32_t first_run = run;
+
+		while( i < sound.num_chunks )
+		{
+			const uint64_t offset = sound.chunks[i];
+			const uint64_t len = (uint64_t) chunk_samples( &sound, i, &run )
+				* frame_bytes;
+
+			if( offset < end || offset - end > max_gap )
+				if( i != first )
+					break;
+			if( offset + len - start > READ_SIZE && i != first )
+				break;
+			if( len > READ_SIZE )
+			{
+				clip->error = "chunk too large";
+				goto done;
+			}
+
+			end = offset + len;
+			i++;
+		}
+
+		const ssize_t len = end - start;
+		if( pread( fd, buf, len, start ) != len )
+		{
+			clip->error = "short read";
+			goto done;
+		}
+		clip->bytes += len;
+
+		uint32_t j;
+		run = first_run;
+		for( j=first ; j<i ; j++ )
+		{
+			const uint32_t samples = chunk_samples( &sound, j, &run );
+			decode_chunk( clip, &sound, buf + sound.chunks[j] - start, samples );
+		}
+	}
+
+done:
+	free( sound.chunks );
+	free( moov );
+	close( fd );
+}
+
+
+static struct clip *	clips;
+static unsigned		num_clips;
+static unsigned		next_clip;
+static pthread_mutex_t	clip_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static void *
+worker( void * arg )
+{
+	uint8_t * buf = malloc( READ_SIZE );
+	(void) arg;
+
+	while(1)
+	{
+		pthread_mutex_lock( &clip_lock );
+		const unsigned index = next_clip++;
+		pthread_mutex_unlock( &clip_lock );
+
+		if( index >= num_clips )
+			break;
+
+		scan_clip( &clips[index], buf );
+	}
+
+	free( buf );
+	return NULL;
+}
+
+
+static void
+add_clip( const char * name )
+{
+	clips = realloc( clips, (num_clips + 1) * sizeof(*clips) );
+	memset( &clips[num_clips], 0, sizeof(*clips) );
+	clips[num_clips++].name = name;
+}
+
+
+static int
+name_compare( const void * a, const void * b )
+{
+	return strcmp( *(char * const *) a, *(char * const *) b );
+}
+
+
+/** Add every .MOV file in a directory, sorted by name */
+static void
+add_dir( const char * dirname )
+{
+	DIR * dir = opendir( dirname );
+	if( !dir )
+	{
+		perror( dirname );
+		return;
+	}
+
+	char ** names = NULL;
+	unsigned count = 0;
+	struct dirent * ent;
+
+	while( (ent = readdir( dir )) )
+	{
+		const size_t len = strlen( ent->d_name );
+		if( len < 4 || strcasecmp( ent->d_name + len - 4, ".mov" ) != 0 )
+			continue;
+
+		char * path = malloc( strlen( dirname ) + len + 2 );
+		sprintf( path, "%s/%s", dirname, ent->d_name );
+		names = realloc( names, (count + 1) * sizeof(*names) );
+		names[count++] = path;
+	}
+	closedir( dir );
+
+	qsort( names, count, sizeof(*names), name_compare );
+
+	unsigned i;
+	for( i=0 ; i<count ; i++ )
+		add_clip( names[i] );
+	free( names );
+}
+
+
+static void
+print_tc(
+	int32_t			num,
+	unsigned		fps
+)
+{
+	const int32_t day = fps * 86400;
+	num = ( (num % day) + day ) % day;
+
+	printf( "%02d:%02d:%02d:%02d",
+		num / (fps * 3600),
+		(num / (fps * 60)) % 60,
+		(num / fps) % 60,
+		num % fps
+	);
+}
+
+
+/** One line per clip:
+ *
+ *	file,start,first,first_sample,frames,fps,drift_ppm,jumps,bad_edges
+ *
+ * start is the timecode at the first audio sample, extrapolated back
+ * from the first good frame.  drift_ppm is how many more audio samples
+ * there were than the timecode says there should have been, so a
+ * positive drift means the camera audio clock runs fast.
+ */
+static void
+print_clip(
+	const struct clip *	clip
+)
+{
+	if( clip->error || !clip->frames )
+	{
+		printf( "%s,,,,0,,,,%u # %s\n",
+			clip->name,
+			clip->dec.bad_edges,
+			clip->error ? clip->error : "no timecode"
+		);
+		return;
+	}
+
+	const unsigned fps = clip->fps;
+
+	// The sync word ends the frame, so the next frame starts there
+	const int32_t start = clip->first_num + 1
+		- (int32_t)( (clip->first_pos * fps + clip->rate / 2) / clip->rate );
+
+	double drift = 0;
+	if( clip->last_num > clip->first_num )
+	{
+		const double expected = (double)( clip->last_num - clip->first_num )
+			* clip->rate / fps;
+		drift = ( (clip->last_pos - clip->first_pos) - expected ) / expected * 1e6;
+	}
+
+	printf( "%s,", clip->name );
+	print_tc( start, fps );
+	printf( "," );
+	print_tc( clip->first_num, fps );
+	printf( ",%llu,%u,%u,%+.1f,%u,%u\n",
+		(unsigned long long) clip->first_pos,
+		clip->frames,
+		fps,
+		drift,
+		clip->jumps,
+		clip->dec.bad_edges
+	);
+}
+
+
+int main( int argc, char ** argv )
+{
+	long threads = sysconf( _SC_NPROCESSORS_ONLN );
+	int opt;
+
+	max_gap = 256 << 10;
+
+	while( (opt = getopt( argc, argv, "j:c:g:" )) != -1 )
+	{
+		switch( opt )
+		{
+		case 'j': threads = strtol( optarg, 0, 0 ); break;
+		case 'c': ltc_channel = strtoul( optarg, 0, 0 ); break;
+		case 'g': max_gap = strtoull( optarg, 0, 0 ); break;
+		default:
+			fprintf( stderr,
+				"Usage: %s [-j threads] [-c channel] [-g gap] file.mov|dir ...\n",
+				argv[0]
+			);
+			return -1;
+		}
+	}
+
+	for( ; optind < argc ; optind++ )
+	{
+		struct stat st;
+		if( stat( argv[optind], &st ) == 0 && S_ISDIR( st.st_mode ) )
+			add_dir( argv[optind] );
+		else
+			add_clip( argv[optind] );
+	}
+
+	if( threads < 1 )
+		threads = 1;
+	if( (unsigned long) threads > num_clips )
+		threads = num_clips;
+
+	struct timespec t0, t1;
+	clock_gettime( CLOCK_MONOTONIC, &t0 );
+
+	pthread_t * tids = calloc( threads, sizeof(*tids) );
+	long i;
+	for( i=0 ; i<threads ; i++ )
+		pthread_create( &tids[i], NULL, worker, NULL );
+	for( i=0 ; i<threads ; i++ )
+		pthread_join( tids[i], NULL );
+
+	clock_gettime( CLOCK_MONOTONIC, &t1 );
+
+	printf( "file,start,first,first_sample,frames,fps,drift_ppm,jumps,bad_edges\n" );
+
+	uint64_t bytes = 0;
+	double audio_secs = 0;
+	unsigned c;
+	for( c=0 ; c<num_clips ; c++ )
+	{
+		print_clip( &clips[c] );
+		bytes += clips[c].bytes;
+		if( clips[c].rate )
+			audio_secs += (double) clips[c].samples / clips[c].rate;
+	}
+
+	const double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	fprintf( stderr, "%u clips, %.1f MB read in %.2f s with %ld threads: %.1f MB/s, %.0fx realtime\n",
+		num_clips,
+		bytes / 1e6,
+		secs,
+		threads,
+		secs > 0 ? bytes / 1e6 / secs : 0,
+		secs > 0 ? audio_secs / secs : 0
+	);
+
+	return 0;
+}
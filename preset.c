@@ -0,0 +1,327 @@
+/** \file
+ * Named configuration presets.
+ *
+ * A:/presets.cfg holds lines in the config format, with the name of
+ * the preset in front of the variable:
+ * <code>
+ * interview:zebra.draw = 0
+ * interview:audio.mgain = 2
+ * timelapse:hist.draw = 0
+ * </code>
+ *
+ * The file is read once at boot.  Each preset keeps only the values
+ * that differ from the defaults, sorted so that config_apply() can
+ * switch to it in one pass over the variables without touching the
+ * card.
+ *
+ * Selecting a preset sets every variable that any of the presets
+ * mentions: to the preset's value, or to the default if this preset
+ * does not list it, so switching between presets never leaves one
+ * of the previous preset's values behind.  Variables that no preset
+ * mentions keep the user's values, so "Defaults" only undoes what
+ * the presets change and a later "Save config" does not lose the
+ * rest of magiclantern.cfg.
+ */
+/*
+ * Copyright (C) 2009 Trammell Hudson <hudson+ml@osresearch.net>
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include "dryos.h"
+#include "bmp.h"
+#include "menu.h"
+#include "config.h"
+
+#define PRESET_FILE		"A:/presets.cfg"
+#define PRESET_MAX		8
+#define PRESET_NAME_LEN		16
+
+struct preset
+{
+	char			name[ PRESET_NAME_LEN ];
+	struct config_diff *	diffs;
+	unsigned		count;
+};
+
+/** presets[0] is the defaults, with no diffs */
+static struct preset		presets[ PRESET_MAX + 1 ] = {
+	[0] = { .name = "Defaults" },
+};
+static unsigned			preset_count = 1;
+static struct config_var **	preset_scope;	//!< Sorted, mentioned by any
+static unsigned			preset_scope_count;
+static struct preset *		preset_current;
+static unsigned			preset_changed;
+
+
+/** The integer variable in "name:variable", or NULL */
+static struct config_var *
+preset_var(
+	const char *		key
+)
+{
+	while( *key != ':' )
+		if( !*key++ )
+			return NULL;
+
+	struct config_var * const var = config_var_find( key + 1 );
+	return var && var->type == 0 ? var : NULL;
+}
+
+
+/** The preset in "name:variable", created if there is room */
+static struct preset *
+preset_lookup(
+	const char *		key
+)
+{
+	unsigned len = 0;
+	while( key[len] != ':' )
+		if( !key[len++] )
+			return NULL;
+
+	if( len == 0 || len >= PRESET_NAME_LEN )
+		return NULL;
+
+	unsigned i, j;
+	for( i=1 ; i<preset_count ; i++ )
+	{
+		for( j=0 ; j<len ; j++ )
+			if( presets[i].name[j] != key[j] )
+				break;
+		if( j == len && presets[i].name[len] == '\0' )
+			return &presets[i];
+	}
+
+	if( preset_count > PRESET_MAX )
+		return NULL;
+
+	struct preset * const preset = &presets[ preset_count++ ];
+	for( j=0 ; j<len ; j++ )
+		preset->name[j] = key[j];
+	preset->name[len] = '\0';
+	return preset;
+}
+
+
+/** Insert in order of the variable.  The list has the last line of
+ * the file first, so a variable that is already there wins.  Values
+ * equal to the default are inserted too, so that a later line that
+ * resets a variable still overrides an earlier one; preset_trim()
+ * drops them once every line has been seen.
+ */
+static void
+preset_insert(
+	struct preset *		preset,
+	struct config_var *	var,
+	unsigned		value
+)
+{
+	unsigned i = preset->count;
+	while( i > 0 && preset->diffs[i-1].var > var )
+		i--;
+	if( i > 0 && preset->diffs[i-1].var == var )
+		return;
+
+	unsigned j;
+	for( j = preset->count ; j > i ; j-- )
+		preset->diffs[j] = preset->diffs[j-1];
+
+	preset->diffs[i].var	= var;
+	preset->diffs[i].value	= value;
+	preset->count++;
+}
+
+
+/** Add a variable to the sorted scope, if it is not already there */
+static void
+preset_scope_add(
+	struct config_var *	var
+)
+{
+	unsigned i = preset_scope_count;
+	while( i > 0 && preset_scope[i-1] > var )
+		i--;
+	if( i > 0 && preset_scope[i-1] == var )
+		return;
+
+	unsigned j;
+	for( j = preset_scope_count ; j > i ; j-- )
+		preset_scope[j] = preset_scope[j-1];
+
+	preset_scope[i] = var;
+	preset_scope_count++;
+}
+
+
+/** Drop the diffs that only restore the default */
+static void
+preset_trim(
+	struct preset *		preset
+)
+{
+	unsigned i, j;
+	for( i=0, j=0 ; i<preset->count ; i++ )
+		if( preset->diffs[i].value != preset->diffs[i].var->def )
+			preset->diffs[j++] = preset->diffs[i];
+	preset->count = j;
+}
+
+
+static void
+preset_load( void )
+{
+	struct config * const list = config_read_list( PRESET_FILE );
+	struct config * config;
+	unsigned total = 0;
+
+	// Find the presets and count their values
+	for( config = list ; config ; config = config->next )
+	{
+		struct config_var * const var = preset_var( config->name );
+		if( !var || !preset_lookup( config->name ) )
+		{
+			DebugMsg( DM_MAGIC, 3, "%s: ignoring '%s'",
+				__func__,
+				config->name
+			);
+			continue;
+		}
+
+		total++;
+	}
+
+	// The list has the end of the file first, so put the presets
+	// back in the order of the file
+	unsigned i, j;
+	for( i=1, j=preset_count-1 ; i<j ; i++, j-- )
+	{
+		const struct preset swap = presets[i];
+		presets[i] = presets[j];
+		presets[j] = swap;
+	}
+
+	struct config_diff * const diffs = total
+		? malloc( total * sizeof(*diffs) )
+		: NULL;
+	preset_scope = total
+		? malloc( total * sizeof(*preset_scope) )
+		: NULL;
+	if( total && ( !diffs || !preset_scope ) )
+	{
+		// Leave only "Defaults", which has nothing in scope
+		if( diffs )
+			free( diffs );
+		if( preset_scope )
+			free( preset_scope );
+		preset_scope = NULL;
+		preset_count = 1;
+		goto done;
+	}
+
+	// Give each preset its share of the diffs
+	unsigned offset = 0;
+	for( i=1 ; i<preset_count ; i++ )
+	{
+		presets[i].diffs = diffs + offset;
+		for( config = list ; config ; config = config->next )
+		{
+			struct config_var * const var = preset_var( config->name );
+			if( var
+			&&  preset_lookup( config->name ) == &presets[i]
+			) {
+				preset_insert( &presets[i], var, atoi( config->value ) );
+				preset_scope_add( var );
+			}
+		}
+
+		preset_trim( &presets[i] );
+
+		offset += presets[i].count;
+		DebugMsg( DM_MAGIC, 3, "%s: '%s' has %d values",
+			__func__,
+			presets[i].name,
+			presets[i].count
+		);
+	}
+
+done:
+	free( list );
+}
+
+
+static void
+preset_select( void * priv )
+{
+	struct preset * const preset = priv;
+	preset_changed = config_apply(
+		preset_scope,
+		preset_scope_count,
+		preset->diffs,
+		preset->count
+	);
+	preset_current = preset;
+}
+
+
+static void
+preset_display(
+	void *			priv,
+	int			x,
+	int			y,
+	int			selected
+)
+{
+	const struct preset * const preset = priv;
+
+	if( preset != preset_current )
+	{
+		menu_print( (void*) preset->name, x, y, selected );
+		return;
+	}
+
+	bmp_printf(
+		selected ? MENU_FONT_SEL : MENU_FONT,
+		x, y,
+		"%s: %d changed",
+		preset->name,
+		preset_changed
+	);
+}
+
+
+static struct menu_entry preset_menus[ PRESET_MAX + 1 ];
+
+
+static void
+preset_init( void )
+{
+	preset_load();
+
+	unsigned i;
+	for( i=0 ; i<preset_count ; i++ )
+	{
+		preset_menus[i].priv	= &presets[i];
+		preset_menus[i].select	= preset_select;
+		preset_menus[i].display	= preset_display;
+	}
+
+	menu_add( "Preset", preset_menus, preset_count );
+}
+
+INIT_FUNC( __FILE__, preset_init );
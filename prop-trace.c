@@ -0,0 +1,314 @@
+/** \file
+ * Decode and summarize property traces from the camera.
+ *
+ * "Dump prop trace" in the debug menu writes A:/proptrace.bin.  By
+ * default this prints one line per property with how often it was
+ * broadcast and the time between broadcasts, busiest first, so the
+ * property traffic while recording can be profiled.  With -d every
+ * record is printed instead.  -p limits either output to a property
+ * and can be repeated.
+ *
+ *	prop-trace [-d] [-p property] ... proptrace.bin
+ */
+/*
+ * Copyright (C) 2009 Trammell Hudson <hudson+ml@osresearch.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include "prop-trace.h"
+
+#define MAX_FILTERS		64
+
+
+static uint32_t filters[ MAX_FILTERS ];
+static unsigned num_filters;
+
+
+struct prop_summary
+{
+	uint32_t		property;
+	unsigned		count;
+	unsigned		changes;	//!< Records whose value differed
+	uint32_t		first;
+	uint32_t		last;
+	uint32_t		gap_min;
+	uint32_t		gap_max;
+	uint32_t		len_min;
+	uint32_t		len_max;
+	uint8_t			data[ PROP_TRACE_BYTES ];
+};
+
+static struct prop_summary * props;
+static unsigned num_props;
+
+
+static int
+wanted(
+	uint32_t		property
+)
+{
+	unsigned i;
+	if( num_filters == 0 )
+		return 1;
+
+	for( i=0 ; i<num_filters ; i++ )
+		if( filters[i] == property )
+			return 1;
+	return 0;
+}
+
+
+static inline unsigned
+data_len(
+	const struct prop_trace_record *	rec
+)
+{
+	return rec->len < PROP_TRACE_BYTES ? rec->len : PROP_TRACE_BYTES;
+}
+
+
+static struct prop_summary *
+summary_find(
+	uint32_t		property
+)
+{
+	static unsigned max_props;
+	unsigned i;
+
+	for( i=0 ; i<num_props ; i++ )
+		if( props[i].property == property )
+			return &props[i];
+
+	if( num_props == max_props )
+	{
+		max_props = max_props ? max_props * 2 : 256;
+		props = realloc( props, max_props * sizeof(*props) );
+		if( !props )
+		{
+			perror( "realloc" );
+			exit( EXIT_FAILURE );
+		}
+	}
+
+	struct prop_summary * const s = &props[ num_props++ ];
+	memset( s, 0, sizeof(*s) );
+	s->property	= property;
+	s->gap_min	= UINT32_MAX;
+	s->len_min	= UINT32_MAX;
+	return s;
+}
+
+
+static void
+summary_add(
+	const struct prop_trace_record *	rec
+)
+{
+	struct prop_summary * const s = summary_find( rec->property );
+	const unsigned len = data_len( rec );
+
+	if( s->count == 0 )
+	{
+		s->first = rec->usec;
+		s->changes = 1;
+	} else {
+		const uint32_t gap = rec->usec - s->last;
+		if( gap < s->gap_min )
+			s->gap_min = gap;
+		if( gap > s->gap_max )
+			s->gap_max = gap;
+		if( memcmp( s->data, rec->data, len ) != 0 )
+			s->changes++;
+	}
+
+	s->count++;
+	s->last = rec->usec;
+	if( rec->len < s->len_min )
+		s->len_min = rec->len;
+	if( rec->len > s->len_max )
+		s->len_max = rec->len;
+	memcpy( s->data, rec->data, len );
+}
+
+
+static int
+summary_cmp(
+	const void *		a_ptr,
+	const void *		b_ptr
+)
+{
+	const struct prop_summary * const a = a_ptr;
+	const struct prop_summary * const b = b_ptr;
+
+	if( a->count != b->count )
+		return a->count < b->count ? 1 : -1;
+	return a->property < b->property ? -1 : a->property > b->property;
+}
+
+
+static void
+print_record(
+	const struct prop_trace_record *	rec,
+	double				clock_hz
+)
+{
+	const unsigned len = data_len( rec );
+	unsigned i;
+
+	printf( "%12.6f %08x %4u:",
+		rec->usec / clock_hz,
+		rec->property,
+		rec->len
+	);
+
+	for( i=0 ; i<len ; i++ )
+		printf( "%s%02x", i % 4 ? "" : " ", rec->data[i] );
+	printf( "%s\n", rec->len > len ? " ..." : "" );
+}
+
+
+static void
+print_summary(
+	double			clock_hz,
+	double			span
+)
+{
+	unsigned i;
+
+	qsort( props, num_props, sizeof(*props), summary_cmp );
+
+	printf( "property,count,changes,rate_hz,gap_min_ms,gap_mean_ms,gap_max_ms,len_min,len_max\n" );
+
+	for( i=0 ; i<num_props ; i++ )
+	{
+		const struct prop_summary * const s = &props[i];
+		const double ms = 1000.0 / clock_hz;
+		const int gaps = s->count > 1;
+
+		printf( "%08x,%u,%u,%.3f,%.3f,%.3f,%.3f,%u,%u\n",
+			s->property,
+			s->count,
+			s->changes,
+			span > 0 ? s->count / span : 0,
+			gaps ? s->gap_min * ms : 0,
+			gaps ? (double)(s->last - s->first) * ms / (s->count - 1) : 0,
+			gaps ? s->gap_max * ms : 0,
+			s->len_min,
+			s->len_max
+		);
+	}
+}
+
+
+int main( int argc, char ** argv )
+{
+	int dump = 0;
+	int opt;
+
+	while( (opt = getopt( argc, argv, "dp:" )) != -1 )
+	{
+		switch( opt )
+		{
+		case 'd': dump = 1; break;
+		case 'p':
+			if( num_filters < MAX_FILTERS )
+				filters[ num_filters++ ] = strtoul( optarg, 0, 16 );
+			break;
+		default:
+			goto usage;
+		}
+	}
+
+	if( optind != argc - 1 )
+		goto usage;
+
+	const char * const name = argv[optind];
+	FILE * const file = fopen( name, "rb" );
+	if( !file )
+	{
+		perror( name );
+		return EXIT_FAILURE;
+	}
+
+	struct prop_trace_header hdr;
+	if( fread( &hdr, sizeof(hdr), 1, file ) != 1
+	||  hdr.magic != PROP_TRACE_MAGIC
+	||  hdr.version != PROP_TRACE_VERSION
+	||  hdr.record_size != sizeof(struct prop_trace_record)
+	) {
+		fprintf( stderr, "%s: not a version %d property trace\n",
+			name,
+			PROP_TRACE_VERSION
+		);
+		return EXIT_FAILURE;
+	}
+
+	const double clock_hz = hdr.clock_hz ? hdr.clock_hz : 1000000;
+	struct prop_trace_record rec;
+	unsigned count = 0;
+	unsigned matched = 0;
+	uint32_t first = 0;
+	uint32_t last = 0;
+
+	while( count < hdr.count && fread( &rec, sizeof(rec), 1, file ) == 1 )
+	{
+		if( count++ == 0 )
+			first = rec.usec;
+		last = rec.usec;
+
+		if( !wanted( rec.property ) )
+			continue;
+
+		matched++;
+		if( dump )
+			print_record( &rec, clock_hz );
+		else
+			summary_add( &rec );
+	}
+
+	fclose( file );
+
+	// Rates are over the whole trace so filtered ones still compare
+	const double span = (last - first) / clock_hz;
+
+	if( !dump )
+		print_summary( clock_hz, span );
+
+	fprintf( stderr, "%s: %u records%s, %u shown, %.3f s, %u overwritten, %u dropped\n",
+		name,
+		count,
+		count < hdr.count ? " (truncated)" : "",
+		matched,
+		span,
+		hdr.overwritten,
+		hdr.dropped
+	);
+
+	return 0;
+
+usage:
+	fprintf( stderr,
+		"Usage: %s [-d] [-p property] ... proptrace.bin\n",
+		argv[0]
+	);
+	return -1;
+}
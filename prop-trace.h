@@ -0,0 +1,72 @@
+#ifndef _prop_trace_h_
+#define _prop_trace_h_
+
+/** \file
+ * Binary property trace format.
+ *
+ * The debug property handler stores one fixed size record, instead
+ * of formatting it, into a ring in RAM for every property it is
+ * registered for.  That is the debug slave's list in debug_init(),
+ * 0x80000000 to 0x8008003F less a few that are too noisy, not every
+ * property the firmware broadcasts.  "Dump prop trace" writes the
+ * ring to the card oldest first behind a short header, and the
+ * prop-trace host tool decodes, filters and summarizes it.
+ *
+ * Everything is little endian, which is what both the camera and
+ * the host use, so the structures are written and read as they are.
+ */
+/*
+ * Copyright (C) 2009 Trammell Hudson <hudson+ml@osresearch.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include <stdint.h>
+
+#define PROP_TRACE_MAGIC	0x5054524D	// "MRTP"
+#define PROP_TRACE_VERSION	1
+
+/** Records in the ring; must be a power of two */
+#define PROP_TRACE_RECORDS	1024
+
+/** Bytes of the property value kept in each record */
+#define PROP_TRACE_BYTES	20
+
+
+struct prop_trace_header
+{
+	uint32_t		magic;
+	uint16_t		version;
+	uint16_t		record_size;
+	uint32_t		count;		//!< Records that follow
+	uint32_t		overwritten;	//!< Lost because the ring wrapped
+	uint32_t		dropped;	//!< Lost while the dump was writing
+	uint32_t		clock_hz;	//!< Units of the record timestamps
+	uint32_t		reserved[2];
+};
+
+
+struct prop_trace_record
+{
+	uint32_t		property;
+	uint32_t		usec;		//!< Since recording was enabled
+	uint32_t		len;		//!< Full length of the value
+	uint8_t			data[ PROP_TRACE_BYTES ];
+};
+
+
+#endif
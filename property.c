@@ -3,19 +3,534 @@
  *
  * These handlers are registered to allow Magic Lantern to interact with
  * the Canon "properties" that are used to exchange globals.
+ *
+ * All of the PROP_HANDLER() subscribers share one slave.  Several
+ * files watch the same properties, and a slave per handler meant a
+ * token handshake per handler for every delivery.  The bus also
+ * keeps the last value of each property, see struct prop_cache,
+ * and queues the changes that are requested through it.
  */
 
 #include "dryos.h"
 #include "property.h"
 
 
-// This must be two instructions long!
+struct prop_bus_stats		prop_bus_stats;
+struct prop_queue_stats		prop_queue_stats;
+
+static struct prop_cache **	prop_bus_table;
+static unsigned			prop_bus_mask;
+static void *			prop_bus_token;
+
+
+static inline unsigned
+prop_bus_hash(
+	unsigned		property
+)
+{
+	// Properties differ mostly in the low bits of each half
+	return ( property ^ (property >> 13) ) * 0x9E3779B1;
+}
+
+
+/** Returns the slot for property, which is empty if nothing
+ * observes it.  The table is never more than half full.
+ */
+static struct prop_cache **
+prop_bus_slot(
+	unsigned		property
+)
+{
+	unsigned i = prop_bus_hash( property ) >> 16;
+
+	while( 1 )
+	{
+		struct prop_cache ** const slot = &prop_bus_table[ i & prop_bus_mask ];
+		if( !*slot || (*slot)->property == property )
+			return slot;
+		i++;
+	}
+}
+
+
+const struct prop_cache *
+prop_cache_find(
+	unsigned		property
+)
+{
+	if( !prop_bus_table )
+		return NULL;
+	return *prop_bus_slot( property );
+}
+
+
+/** Only the bus writes, so there is a single writer */
 static void
-prop_token_handler_generic(
-	void * token
+prop_cache_store(
+	struct prop_cache *	cache,
+	const void *		buf,
+	unsigned		len
 )
 {
-	asm( "str r0, [pc, #-12]" );
+	const unsigned copy = (cache->seq + 1) & 1;
+	const unsigned bytes = len < sizeof(cache->value[0])
+		? len : sizeof(cache->value[0]);
+
+	memcpy( cache->value[ copy ], buf, bytes );
+	cache->len[ copy ] = len;
+
+	barrier();
+	cache->seq++;
+}
+
+
+/** Request queue.
+ *
+ * There is a slot for each property that has been requested, with
+ * at most one value waiting to be sent and one request in flight.
+ * The few properties that are changed are changed over and over, so
+ * slots are never freed and keep the time of the last send for the
+ * rate limit.  The bus only sets acked, everything else is under
+ * prop_queue_lock, and the property manager and the callbacks are
+ * called without holding it.
+ *
+ * An ack only counts once prop_request_change() has returned, and a
+ * request that is acked by its own property only completes when the
+ * bus has the value that was sent, so a broadcast of the old value,
+ * or of one from a dial, does not complete it early.
+ */
+#define PROP_QUEUE_POLL		10	// ms
+
+struct prop_request
+{
+	unsigned		property;	//!< 0 if the slot is unused
+	int			pending;
+	int			inflight;
+	volatile int		armed;		//!< Sent, so acks count
+	volatile int		acked;
+	unsigned		ack;
+	unsigned		inflight_ack;
+	uint32_t		interval;	//!< usec
+	uint32_t		sent;		//!< timer_read() of the last send
+	unsigned		len;
+	uint32_t		value[ PROP_REQUEST_WORDS ];
+	unsigned		sent_len;
+	uint32_t		sent_value[ PROP_REQUEST_WORDS ];
+
+	void			(*done)( unsigned, void *, int );
+	void *			arg;
+	void			(*inflight_done)( unsigned, void *, int );
+	void *			inflight_arg;
+};
+
+/** A send, made after the lock is released */
+struct prop_request_send
+{
+	struct prop_request *	req;
+	unsigned		property;
+	void			(*done)( unsigned, void *, int );
+	void *			arg;
+	unsigned		len;
+	uint32_t		value[ PROP_REQUEST_WORDS ];
+};
+
+/** A completion, reported after the lock is released */
+struct prop_request_call
+{
+	unsigned		property;
+	int			status;
+	void			(*done)( unsigned, void *, int );
+	void *			arg;
+};
+
+static struct prop_request	prop_requests[ PROP_REQUEST_SLOTS ];
+static struct semaphore *	prop_queue_lock;
+static struct semaphore *	prop_queue_sem;
+static volatile unsigned	prop_queue_waiting;	//!< Requests waiting for an ack
+
+
+/** Does a value match the first len bytes of want? */
+static int
+prop_request_matches(
+	const uint32_t *	want,
+	unsigned		want_len,
+	const void *		buf,
+	unsigned		len
+)
+{
+	const uint8_t * const a = (const uint8_t *) want;
+	const uint8_t * const b = buf;
+	unsigned i;
+
+	if( len < want_len )
+		return 0;
+
+	for( i=0 ; i<want_len ; i++ )
+		if( a[i] != b[i] )
+			return 0;
+	return 1;
+}
+
+
+/** Does the bus already have this value for the property? */
+static int
+prop_request_cached(
+	unsigned		property,
+	const uint32_t *	value,
+	unsigned		len
+)
+{
+	uint32_t buf[ PROP_REQUEST_WORDS ];
+	const int cached = prop_cache_read(
+		prop_cache_find( property ),
+		buf,
+		sizeof(buf)
+	);
+
+	return cached >= 0 && prop_request_matches( value, len, buf, cached );
+}
+
+
+/** Called by the bus for every delivery while an ack is expected */
+static void
+prop_queue_ack(
+	unsigned		property,
+	const void *		buf,
+	unsigned		len
+)
+{
+	unsigned i;
+	int wake = 0;
+
+	for( i=0 ; i<PROP_REQUEST_SLOTS ; i++ )
+	{
+		struct prop_request * const req = &prop_requests[i];
+		if( !req->armed || req->inflight_ack != property )
+			continue;
+
+		// Some other value of the property itself
+		if( property == req->property
+		&&  !prop_request_matches( req->sent_value, req->sent_len, buf, len )
+		)
+			continue;
+
+		req->acked = 1;
+		wake = 1;
+	}
+
+	if( wake )
+		give_semaphore( prop_queue_sem );
+}
+
+
+int
+prop_request_queue(
+	unsigned	property,
+	const void *	addr,
+	size_t		len,
+	unsigned	ack,
+	unsigned	interval,
+	void		(*done)(
+		unsigned		property,
+		void *			arg,
+		int			status
+	),
+	void *		arg
+)
+{
+	struct prop_request * req = NULL;
+	void (*replaced)( unsigned, void *, int ) = NULL;
+	void * replaced_arg = NULL;
+	unsigned i;
+
+	if( !prop_queue_lock || len > sizeof(req->value) )
+		goto direct;
+
+	// An ack that the bus never sees would always time out
+	if( ack && !prop_cache_find( ack ) )
+		ack = 0;
+
+	take_semaphore( prop_queue_lock, 0 );
+
+	for( i=0 ; i<PROP_REQUEST_SLOTS ; i++ )
+	{
+		struct prop_request * const slot = &prop_requests[i];
+		if( slot->property == property )
+		{
+			req = slot;
+			break;
+		}
+
+		if( !slot->property && !req )
+			req = slot;
+	}
+
+	if( !req )
+	{
+		prop_queue_stats.overflows++;
+		give_semaphore( prop_queue_lock );
+		goto direct;
+	}
+
+	if( !req->property )
+	{
+		// Nothing to rate limit against yet
+		req->property	= property;
+		req->sent	= timer_read() - interval * 1000;
+	}
+
+	if( req->pending )
+	{
+		replaced	= req->done;
+		replaced_arg	= req->arg;
+		prop_queue_stats.coalesced++;
+	}
+
+	memcpy( req->value, addr, len );
+	req->len	= len;
+	req->ack	= ack;
+	req->interval	= interval * 1000;
+	req->done	= done;
+	req->arg	= arg;
+	req->pending	= 1;
+	prop_queue_stats.queued++;
+
+	give_semaphore( prop_queue_lock );
+
+	if( replaced )
+		replaced( property, replaced_arg, PROP_REQUEST_COALESCED );
+
+	give_semaphore( prop_queue_sem );
+	return 0;
+
+direct:
+	prop_request_change( property, (void*) addr, len );
+	if( done )
+		done( property, arg, PROP_REQUEST_SENT );
+	return -1;
+}
+
+
+int
+prop_request_wait(
+	unsigned		property,
+	unsigned		timeout
+)
+{
+	unsigned waited = 0;
+
+	if( !prop_queue_lock )
+		return 0;
+
+	while( 1 )
+	{
+		int busy = 0;
+		unsigned i;
+
+		take_semaphore( prop_queue_lock, 0 );
+		for( i=0 ; i<PROP_REQUEST_SLOTS ; i++ )
+		{
+			const struct prop_request * const req = &prop_requests[i];
+			if( req->property == property )
+				busy = req->pending || req->inflight;
+		}
+		give_semaphore( prop_queue_lock );
+
+		if( !busy )
+			return 0;
+		if( waited >= timeout )
+			return -1;
+
+		msleep( PROP_QUEUE_POLL );
+		waited += PROP_QUEUE_POLL;
+	}
+}
+
+
+/** Complete the requests that were acked or timed out and send every
+ * value that is no longer rate limited.  Returns non-zero if anything
+ * is still waiting.
+ */
+static int
+prop_queue_run( void )
+{
+	struct prop_request_send sends[ PROP_REQUEST_SLOTS ];
+	struct prop_request_call calls[ 2 * PROP_REQUEST_SLOTS ];
+	unsigned num_sends = 0;
+	unsigned num_calls = 0;
+	int busy = 0;
+	unsigned i;
+
+	take_semaphore( prop_queue_lock, 0 );
+
+	const uint32_t now = timer_read();
+
+	for( i=0 ; i<PROP_REQUEST_SLOTS ; i++ )
+	{
+		struct prop_request * const req = &prop_requests[i];
+		if( !req->property )
+			break;
+
+		if( req->inflight )
+		{
+			int status;
+
+			// The delivery may have come before the ack was armed
+			if( req->acked
+			||  ( req->armed
+			&&    req->inflight_ack == req->property
+			&&    prop_request_cached( req->property, req->sent_value, req->sent_len ) )
+			) {
+				status = PROP_REQUEST_DONE;
+				prop_queue_stats.acked++;
+			} else
+			if( timer_delta( req->sent, now ) >= PROP_REQUEST_TIMEOUT * 1000 )
+			{
+				status = PROP_REQUEST_SENT;
+				prop_queue_stats.timeouts++;
+			} else {
+				busy = 1;
+				continue;
+			}
+
+			req->armed = 0;
+			req->inflight = 0;
+			prop_queue_waiting--;
+
+			struct prop_request_call * const call = &calls[ num_calls++ ];
+			call->property	= req->property;
+			call->status	= status;
+			call->done	= req->inflight_done;
+			call->arg	= req->inflight_arg;
+		}
+
+		if( !req->pending )
+			continue;
+
+		// Nothing to change; the broadcast might never come
+		if( req->ack == req->property
+		&&  prop_request_cached( req->property, req->value, req->len )
+		) {
+			req->pending = 0;
+			prop_queue_stats.unchanged++;
+
+			struct prop_request_call * const call = &calls[ num_calls++ ];
+			call->property	= req->property;
+			call->status	= PROP_REQUEST_DONE;
+			call->done	= req->done;
+			call->arg	= req->arg;
+			continue;
+		}
+
+		if( timer_delta( req->sent, now ) < req->interval )
+		{
+			busy = 1;
+			continue;
+		}
+
+		struct prop_request_send * const send = &sends[ num_sends++ ];
+		send->req	= req;
+		send->property	= req->property;
+		send->len	= req->len;
+		memcpy( send->value, req->value, req->len );
+
+		req->pending	= 0;
+		req->sent	= now;
+
+		if( req->ack )
+		{
+			// Completed by the ack instead of the send
+			send->done		= NULL;
+			req->inflight_ack	= req->ack;
+			req->inflight_done	= req->done;
+			req->inflight_arg	= req->arg;
+			req->sent_len		= req->len;
+			memcpy( req->sent_value, req->value, req->len );
+			req->acked		= 0;
+			req->armed		= 0;
+			req->inflight		= 1;
+			prop_queue_waiting++;
+			busy = 1;
+		} else {
+			send->req	= NULL;
+			send->done	= req->done;
+			send->arg	= req->arg;
+		}
+	}
+
+	give_semaphore( prop_queue_lock );
+
+	for( i=0 ; i<num_calls ; i++ )
+		if( calls[i].done )
+			calls[i].done( calls[i].property, calls[i].arg, calls[i].status );
+
+	for( i=0 ; i<num_sends ; i++ )
+	{
+		struct prop_request_send * const send = &sends[i];
+		prop_request_change( send->property, send->value, send->len );
+		prop_queue_stats.sent++;
+
+		// Only the queue task completes requests, so it is still
+		// the same one in flight
+		if( send->req )
+			send->req->armed = 1;
+
+		if( send->done )
+			send->done( send->property, send->arg, PROP_REQUEST_SENT );
+	}
+
+	return busy;
+}
+
+
+static void
+prop_queue_task( void * priv )
+{
+	while( 1 )
+	{
+		// Poll while anything is rate limited or waiting for an ack
+		const int busy = prop_queue_run();
+		take_semaphore( prop_queue_sem, busy ? PROP_QUEUE_POLL : 0 );
+	}
+}
+
+TASK_CREATE( "prop_queue", prop_queue_task, 0, 0x18, 0x1000 );
+
+
+static void
+prop_bus_token_handler(
+	void *			token
+)
+{
+	prop_bus_token = token;
+}
+
+
+static void *
+prop_bus_handler(
+	unsigned		property,
+	void *			priv,
+	void *			buf,
+	unsigned		len
+)
+{
+	struct prop_cache * const cache = *prop_bus_slot( property );
+	if( !cache )
+		goto ack;
+
+	prop_cache_store( cache, buf, len );
+
+	if( prop_queue_waiting )
+		prop_queue_ack( property, buf, len );
+
+	struct prop_handler * handler = cache->handlers;
+	for( ; handler ; handler = handler->next )
+		if( handler->handler )
+			handler->handler( property, priv, buf, len );
+
+ack:
+	prop_bus_stats.deliveries++;
+	return prop_cleanup( prop_bus_token, property );
 }
 
 
@@ -26,23 +541,71 @@ prop_init( void )
 	extern struct prop_handler _prop_handlers_end[];
 	struct prop_handler * handler = _prop_handlers_start;
 
+	const unsigned count = _prop_handlers_end - _prop_handlers_start;
+	unsigned slots = 8;
+	while( slots < 2 * count )
+		slots <<= 1;
+
+	// The firmware keeps the property list, so none of it is freed
+	prop_queue_lock = create_named_semaphore( "prop_queue_lock", 1 );
+	prop_queue_sem = create_named_semaphore( "prop_queue", 0 );
+
+	unsigned * const property_list = malloc( count * sizeof(*property_list) );
+	struct prop_cache * const caches = malloc( count * sizeof(*caches) );
+	struct prop_cache ** const table = malloc( slots * sizeof(*table) );
+	if( !property_list || !caches || !table )
+	{
+		DebugMsg( DM_MAGIC, 3, "%s: malloc failed", __func__ );
+		return;
+	}
+
+	unsigned i;
+	for( i=0 ; i<slots ; i++ )
+		table[i] = NULL;
+	prop_bus_table = table;
+	prop_bus_mask = slots - 1;
+
+	unsigned properties = 0;
 	for( ; handler < _prop_handlers_end ; handler++ )
 	{
-		// Copy the generic token handler into the structure
-		memcpy(
-			handler->token_handler,
-			prop_token_handler_generic,
-			8
-		);
-
-		prop_register_slave(
-			&handler->property,
-			1,
-			handler->handler,
-			&handler->token,
-			&handler->token_handler
-		);
+		struct prop_cache ** const slot = prop_bus_slot( handler->property );
+		handler->next = NULL;
+
+		if( !*slot )
+		{
+			struct prop_cache * const cache = &caches[ properties ];
+			cache->property	= handler->property;
+			cache->handlers	= NULL;
+			cache->seq	= 0;
+
+			property_list[ properties++ ] = handler->property;
+			*slot = cache;
+		}
+
+		// Keep the link order within a chain
+		struct prop_handler ** link = &(*slot)->handlers;
+		while( *link )
+			link = &(*link)->next;
+		*link = handler;
 	}
+
+	prop_bus_stats.handlers		= count;
+	prop_bus_stats.properties	= properties;
+	prop_bus_stats.slots		= slots;
+
+	DebugMsg( DM_MAGIC, 3, "%s: %d handlers for %d properties",
+		__func__,
+		count,
+		properties
+	);
+
+	prop_register_slave(
+		property_list,
+		properties,
+		prop_bus_handler,
+		0,
+		prop_bus_token_handler
+	);
 }
 
 
@@ -172,6 +172,66 @@ prop_request_change(
 );
 
 
+/** Queued property changes.
+ *
+ * prop_request_queue() copies the value and returns without calling
+ * the property manager.  A queue task sends it later, so repeated
+ * writes to a property that has not been sent yet are coalesced and
+ * only the last value goes out.  A property is not sent again until
+ * the previous request has completed and at least interval ms have
+ * passed, and everything that is ready is sent in one pass.
+ *
+ * A request completes when the bus delivers the ack property after
+ * it was sent, or after PROP_REQUEST_TIMEOUT ms.  If the ack is the
+ * property itself, only a delivery of the value that was sent counts,
+ * and a value that the bus already has completes without being sent.
+ * The ack must be observed by a PROP_HANDLER() or PROP_WATCH(); if
+ * it is 0 or not observed the request completes as soon as it has
+ * been sent.
+ *
+ * The done callback, if any, gets one of the PROP_REQUEST_ statuses.
+ * Completions are reported from the queue task, but a request that
+ * is replaced gets PROP_REQUEST_COALESCED from the task that replaced
+ * it, inside prop_request_queue().
+ *
+ * Values longer than PROP_REQUEST_WORDS, or requests when every
+ * queue slot is busy, are sent immediately from the caller's task,
+ * which also gets PROP_REQUEST_SENT before it returns -1.
+ */
+#define PROP_REQUEST_SLOTS	16
+#define PROP_REQUEST_WORDS	8
+#define PROP_REQUEST_TIMEOUT	1000	// ms
+
+#define PROP_REQUEST_DONE	0	//!< The ack property was delivered
+#define PROP_REQUEST_SENT	1	//!< Sent, but no ack was seen
+#define PROP_REQUEST_COALESCED	2	//!< Replaced by a later value
+
+extern int
+prop_request_queue(
+	unsigned	property,
+	const void *	addr,
+	size_t		len,
+	unsigned	ack,
+	unsigned	interval,
+	void		(*done)(
+		unsigned		property,
+		void *			arg,
+		int			status
+	),
+	void *		arg
+);
+
+
+/** Wait up to timeout ms until nothing is queued or in flight for
+ * the property.  Returns 0 if it completed, -1 on timeout.
+ */
+extern int
+prop_request_wait(
+	unsigned	property,
+	unsigned	timeout
+);
+
+
 /** Get the current value of a property.
  *
  * \todo Does initial value of len matter?
@@ -185,22 +245,116 @@ prop_get_value(
 
 
 
+/** Property subscriber.
+ *
+ * Every PROP_HANDLER() goes into the .prop_handlers section.  At
+ * init the property bus registers a single slave for the union of
+ * their properties and links the handlers for each property into a
+ * chain in a small hash table.  A delivery runs every handler in the
+ * chain and then acknowledges it with one prop_cleanup(), so the
+ * handlers must not call it themselves.
+ */
 struct prop_handler
 {
 	unsigned	property;
 
-	void *		(*handler)(
+	void		(*handler)(
 		unsigned		property,
 		void *			priv,
 		void *			addr,
 		unsigned		len
 	);
 
-	void *		token; // must be before token_handler
-	uint32_t	token_handler[2]; // function goes here!
+	struct prop_handler *	next;	//!< Same property, set by prop_init
 };
 
-/** Register a property handler with automated token function */
+
+/** Last value of every property on the bus.
+ *
+ * The bus stores each delivery before it runs the handlers.  There
+ * are two copies: the writer fills the one that readers are not
+ * using and then bumps seq to publish it.  A reader copies out the
+ * current one and retries only if seq moved while it was copying,
+ * so it never waits for the writer and never calls DryOS.  Values
+ * longer than PROP_CACHE_WORDS are truncated, but len is the length
+ * that was delivered.  It is large enough for PROP_LV_LENS.
+ */
+#define PROP_CACHE_WORDS	16
+
+struct prop_cache
+{
+	unsigned		property;
+	struct prop_handler *	handlers;
+	volatile unsigned	seq;	//!< 0 until the first delivery
+	unsigned		len[2];
+	uint32_t		value[2][ PROP_CACHE_WORDS ];
+};
+
+
+/** Find the cache entry for a property, which can be kept for later
+ * reads.  NULL if no handler or PROP_WATCH() observes it.
+ */
+extern const struct prop_cache *
+prop_cache_find(
+	unsigned		property
+);
+
+
+/** Consistent copy of up to max bytes of the last value.
+ * Returns the delivered length, or -1 if there has been none yet.
+ * Nothing past the delivered length is copied.
+ */
+static inline int
+prop_cache_read(
+	const struct prop_cache *	cache,
+	void *			buf,
+	size_t			max
+)
+{
+	unsigned seq;
+	unsigned len;
+
+	if( !cache || !cache->seq )
+		return -1;
+
+	do {
+		seq = cache->seq;
+		barrier();
+
+		const unsigned copy = seq & 1;
+		len = cache->len[ copy ];
+
+		// Only the delivered bytes; the rest of the copy is left
+		// over from an older, longer value
+		size_t i;
+		size_t bytes = max < sizeof(cache->value[0])
+			? max : sizeof(cache->value[0]);
+		if( bytes > len )
+			bytes = len;
+		for( i=0 ; i<bytes ; i++ )
+			((uint8_t*) buf)[i] = ((const uint8_t*) cache->value[ copy ])[i];
+
+		barrier();
+	} while( seq != cache->seq );
+
+	return len;
+}
+
+
+/** First word of a property, or def if there has been none */
+static inline uint32_t
+prop_cache_int(
+	unsigned		property,
+	uint32_t		def
+)
+{
+	uint32_t value = 0;	// a shorter value is zero extended
+	if( prop_cache_read( prop_cache_find( property ), &value, sizeof(value) ) < 0 )
+		return def;
+	return value;
+}
+
+/** Register a property handler on the property bus */
 #define REGISTER_PROP_HANDLER( id, func ) \
 __attribute__((section(".prop_handlers"))) \
 __attribute__((used)) \
@@ -210,22 +364,53 @@ static struct prop_handler _prop_handler_##id##_block = { \
 }
 
 #define PROP_HANDLER(id) \
-static void * _prop_handler_##id(); \
+static void _prop_handler_##id(); \
 REGISTER_PROP_HANDLER( id, _prop_handler_##id ); \
-void * _prop_handler_##id( \
+static void _prop_handler_##id( \
 	unsigned		property, \
-	void *			token, \
+	void *			priv, \
 	uint32_t *		buf, \
 	unsigned		len \
 ) \
 
 
+/** Keep a property in the cache without a handler */
+#define PROP_WATCH(id) \
+	REGISTER_PROP_HANDLER( id, NULL )
+
+
 #define PROP_INT(id,name) \
 uint32_t name; \
 PROP_HANDLER(id) { \
 	name = buf[0]; \
-	return prop_cleanup( token, property ); \
 }
 
 
+/** How the property bus is set up, for the debug menu */
+struct prop_bus_stats
+{
+	unsigned		handlers;
+	unsigned		properties;	//!< Registered with one slave
+	unsigned		slots;
+	unsigned		deliveries;
+};
+
+extern struct prop_bus_stats prop_bus_stats;
+
+
+/** What the request queue has saved the property manager */
+struct prop_queue_stats
+{
+	unsigned		queued;
+	unsigned		coalesced;
+	unsigned		sent;
+	unsigned		acked;
+	unsigned		timeouts;
+	unsigned		unchanged;	//!< Already had the value
+	unsigned		overflows;	//!< Sent directly
+};
+
+extern struct prop_queue_stats prop_queue_stats;
+
+
 #endif
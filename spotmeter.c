@@ -27,8 +27,8 @@
 #include "menu.h"
 #include "config.h"
 
-CONFIG_INT( "spotmeter.size",		spotmeter_size,	5 );
-CONFIG_INT( "spotmeter.draw",		spotmeter_draw, 0 );
+CONFIG_INT_RANGE( "spotmeter.size",	spotmeter_size,	5, 1, 50 );
+CONFIG_INT_RANGE( "spotmeter.draw",	spotmeter_draw, 0, 0, 1 );
 
 
 static void
@@ -73,18 +73,27 @@ static struct menu_entry spotmeter_menus[] = {
 };
 
 
+static struct config_observer	spotmeter_observer = {
+	.notify		= config_notify_semaphore,
+};
+
+
 static void
 spotmeter_task( void * priv )
 {
 	menu_add( "Video", spotmeter_menus, COUNT(spotmeter_menus) );
 
+	// Sleep until the menu or a script turns the spotmeter on
+	spotmeter_observer.arg = create_named_semaphore( "spotmeter_wake", 0 );
+	config_observe( CONFIG_VAR( spotmeter_draw ), &spotmeter_observer );
+
 	msleep( 1000 );
 	while(1)
 	{
 		// Draw a few pixels to indicate the center
 		if( !spotmeter_draw )
 		{
-			msleep( 1000 );
+			take_semaphore( spotmeter_observer.arg, 0 );
 			continue;
 		}
 
@@ -1,13 +1,16 @@
 /** \file SMPTE timecode analyzer for the audio port
+ *
+ * The decoder is reentrant and works on blocks of samples or on
+ * edge intervals; see timecode.h.  On the host this builds a test
+ * program that decodes .au files and benchmarks the decoder.
+ * Define TIMECODE_NO_MAIN to link it into other host tools.
  */
 #ifndef __ARM__
 #include <stdio.h>
 #include <stdlib.h>
-#include <unistd.h>
-#include <fcntl.h>
-#include <arpa/inet.h> // for ntohl
-#define con_printf(font,...) /* Nothing */
-unsigned offset;
+#include <time.h>
+#include "au.h"
+#include "compiler.h"
 #else
 #include "dryos.h"
 #include "tasks.h"
@@ -15,299 +18,723 @@ unsigned offset;
 #include "bmp.h"
 #include "config.h"
 #include "menu.h"
-#define printf(fmt,...) /* Nothing */
+#include "property.h"
 #endif
 #include <stdint.h>
+#include "timecode.h"
 
-// SMTPE timecode frame
-static uint8_t smpte_frame[ 8 ];
+
+/** The data bits arrive LSB first but are shifted in at the bottom
+ * of the register, so each byte comes out reversed.
+ */
+static const uint8_t ltc_bitrev[ 256 ] = {
+	0x00, 0x80, 0x40, 0xc0, 0x20, 0xa0, 0x60, 0xe0,
+	0x10, 0x90, 0x50, 0xd0, 0x30, 0xb0, 0x70, 0xf0,
+	0x08, 0x88, 0x48, 0xc8, 0x28, 0xa8, 0x68, 0xe8,
+	0x18, 0x98, 0x58, 0xd8, 0x38, 0xb8, 0x78, 0xf8,
+	0x04, 0x84, 0x44, 0xc4, 0x24, 0xa4, 0x64, 0xe4,
+	0x14, 0x94, 0x54, 0xd4, 0x34, 0xb4, 0x74, 0xf4,
+	0x0c, 0x8c, 0x4c, 0xcc, 0x2c, 0xac, 0x6c, 0xec,
+	0x1c, 0x9c, 0x5c, 0xdc, 0x3c, 0xbc, 0x7c, 0xfc,
+	0x02, 0x82, 0x42, 0xc2, 0x22, 0xa2, 0x62, 0xe2,
+	0x12, 0x92, 0x52, 0xd2, 0x32, 0xb2, 0x72, 0xf2,
+	0x0a, 0x8a, 0x4a, 0xca, 0x2a, 0xaa, 0x6a, 0xea,
+	0x1a, 0x9a, 0x5a, 0xda, 0x3a, 0xba, 0x7a, 0xfa,
+	0x06, 0x86, 0x46, 0xc6, 0x26, 0xa6, 0x66, 0xe6,
+	0x16, 0x96, 0x56, 0xd6, 0x36, 0xb6, 0x76, 0xf6,
+	0x0e, 0x8e, 0x4e, 0xce, 0x2e, 0xae, 0x6e, 0xee,
+	0x1e, 0x9e, 0x5e, 0xde, 0x3e, 0xbe, 0x7e, 0xfe,
+	0x01, 0x81, 0x41, 0xc1, 0x21, 0xa1, 0x61, 0xe1,
+	0x11, 0x91, 0x51, 0xd1, 0x31, 0xb1, 0x71, 0xf1,
+	0x09, 0x89, 0x49, 0xc9, 0x29, 0xa9, 0x69, 0xe9,
+	0x19, 0x99, 0x59, 0xd9, 0x39, 0xb9, 0x79, 0xf9,
+	0x05, 0x85, 0x45, 0xc5, 0x25, 0xa5, 0x65, 0xe5,
+	0x15, 0x95, 0x55, 0xd5, 0x35, 0xb5, 0x75, 0xf5,
+	0x0d, 0x8d, 0x4d, 0xcd, 0x2d, 0xad, 0x6d, 0xed,
+	0x1d, 0x9d, 0x5d, 0xdd, 0x3d, 0xbd, 0x7d, 0xfd,
+	0x03, 0x83, 0x43, 0xc3, 0x23, 0xa3, 0x63, 0xe3,
+	0x13, 0x93, 0x53, 0xd3, 0x33, 0xb3, 0x73, 0xf3,
+	0x0b, 0x8b, 0x4b, 0xcb, 0x2b, 0xab, 0x6b, 0xeb,
+	0x1b, 0x9b, 0x5b, 0xdb, 0x3b, 0xbb, 0x7b, 0xfb,
+	0x07, 0x87, 0x47, 0xc7, 0x27, 0xa7, 0x67, 0xe7,
+	0x17, 0x97, 0x57, 0xd7, 0x37, 0xb7, 0x77, 0xf7,
+	0x0f, 0x8f, 0x4f, 0xcf, 0x2f, 0xaf, 0x6f, 0xef,
+	0x1f, 0x9f, 0x5f, 0xdf, 0x3f, 0xbf, 0x7f, 0xff,
+};
+
+
+/** Bit counter value while the bit clock is lost, so that the next
+ * sync word only realigns the decoder instead of producing a frame.
+ */
+#define LTC_LOST		0x10000
+
+
+void
+ltc_decoder_init(
+	struct ltc_decoder *	dec,
+	uint32_t		period
+)
+{
+	dec->threshold	= LTC_THRESHOLD;
+	dec->level	= 0;
+	dec->since	= 0;
+
+	dec->period	= period << 8;
+	dec->period_min	= period << 7;
+	dec->period_max	= period << 9;
+	dec->half	= 0;
+
+	dec->lo		= 0;
+	dec->hi		= 0;
+	dec->bits	= LTC_LOST;
+	dec->position	= 0;
+
+	dec->frames	= 0;
+	dec->syncs	= 0;
+	dec->short_frames = 0;
+	dec->bad_edges	= 0;
+}
 
 
-// Returns 1 if there is a new frame available
+static void
+ltc_frame_decode(
+	struct ltc_frame *	frame
+)
+{
+	const uint8_t * const raw = frame->raw;
+
+	frame->frames	= (raw[0] & 0xF) + 10 * (raw[1] & 0x3);
+	frame->seconds	= (raw[2] & 0xF) + 10 * (raw[3] & 0x7);
+	frame->minutes	= (raw[4] & 0xF) + 10 * (raw[5] & 0x7);
+	frame->hours	= (raw[6] & 0xF) + 10 * (raw[7] & 0x3);
+	frame->drop_frame = (raw[1] >> 2) & 1;
+
+	uint32_t user = 0;
+	unsigned i;
+	for( i=0 ; i<8 ; i++ )
+		user |= (uint32_t)( raw[i] >> 4 ) << (4 * i);
+	frame->user	= user;
+}
+
+
+/** Shift in one bit and check for the end of a frame */
 static int
-tc_sample(
-	int16_t			sample
+ltc_decoder_bit(
+	struct ltc_decoder *	dec,
+	int			bit,
+	struct ltc_frame *	frame
 )
 {
-	static uint32_t last_transition;
+	dec->hi = (dec->hi << 1) | (dec->lo >> 63);
+	dec->lo = (dec->lo << 1) | bit;
+	dec->bits++;
 
-	// Hold onto the last bit for hysteris
-	static int bit = 0;
-	static int bit_count = 0;
+	if( (dec->lo & 0xFFFF) != LTC_SYNC )
+		return 0;
+
+	const unsigned bits = dec->bits;
+	dec->bits = 0;
+	dec->syncs++;
+
+	if( bits != LTC_FRAME_BITS )
+	{
+		if( bits < LTC_LOST )
+			dec->short_frames++;
+		return 0;
+	}
+
+	// Frame bit 0 is now bit 63 of the data
+	const uint64_t data = ((uint64_t) dec->hi << 48) | (dec->lo >> 16);
+	unsigned i;
+	for( i=0 ; i<8 ; i++ )
+		frame->raw[i] = ltc_bitrev[ (data >> (56 - 8*i)) & 0xFF ];
+
+	ltc_frame_decode( frame );
+	frame->position = dec->position;
+	dec->frames++;
+	return 1;
+}
 
-	static uint32_t word = 0;
-	static uint32_t raw_word = 0;
-	static int synced = 0;
-	static int byte_count = 0;
 
-	// Use some hysteris to avoid zero crosing errors
-	int old_bit = bit;
-	if( sample > 1000 )
+/** Classify the interval against the tracked bit period.
+ *
+ * Long intervals are a zero and pairs of short intervals are a one;
+ * anything else loses the bit clock until the next sync word.  Each
+ * good interval pulls the period 1/8th of the way towards it, which
+ * follows varispeed and shuttling without being thrown by jitter.
+ */
+int
+ltc_decoder_edge(
+	struct ltc_decoder *	dec,
+	uint32_t		interval,
+	struct ltc_frame *	frame
+)
+{
+	dec->position += interval;
+	if( interval > 0xFFFFFF )
+		interval = 0xFFFFFF;
+
+	const uint32_t d = interval << 8;
+	const uint32_t p = dec->period;
+	uint32_t measured;
+	int bit;
+
+	if( d < p / 4 || d > p + p / 2 )
+		goto lost;
+
+	if( d > (p * 3) / 4 )
+	{
+		// A zero in the middle of a one is a framing error
+		if( dec->half )
+			goto lost;
+		measured = d;
 		bit = 0;
-	else
-	if( sample < -1000 )
+	} else {
+		measured = d * 2;
+		dec->half = !dec->half;
 		bit = 1;
+	}
 
-	static int x, y = 32;
+	int32_t period = p + ( (int32_t)( measured - p ) >> 3 );
+	if( period < (int32_t) dec->period_min )
+		period = dec->period_min;
+	if( period > (int32_t) dec->period_max )
+		period = dec->period_max;
+	dec->period = period;
 
-	// Record any transition to help reconstruct the clock
-	if( bit == old_bit )
+	if( bit && dec->half )
 		return 0;
 
-#ifdef __ARM__
-	unsigned (*read_clock)(void) = (void*) 0xff9948d8;
-	unsigned now = read_clock();
-#else
-	unsigned now = offset;
-#endif
-	int delta = now - last_transition;
-	last_transition = now;
+	return ltc_decoder_bit( dec, bit, frame );
+
+lost:
+	dec->bad_edges++;
+	dec->half = 0;
+	dec->bits = LTC_LOST;
+	return 0;
+}
 
-	// Timer is only 24 bits?
-	delta &= 0x00FFFFFF;
 
-#if 0 //def __ARM__
-	bmp_printf( FONT_SMALL, x, y, "%02x ", delta );
-	x += 3 * 8;
-	if( x > 700 )
+unsigned
+ltc_decoder_block(
+	struct ltc_decoder *	dec,
+	const int16_t *		samples,
+	unsigned		count,
+	unsigned		stride,
+	struct ltc_frame *	frames,
+	unsigned		max_frames
+)
+{
+	struct ltc_frame discard;
+	uint32_t since = dec->since;
+	unsigned n = 0;
+	unsigned i;
+
+	for( i=0 ; i<count ; i++, samples += stride )
 	{
-		x = 0;
-		y += 12;
-		if( y > 400 )
-		{
-			y = 32;
-			msleep( 2000 );
-		}
+		since++;
+		if( !ltc_slice( dec, *samples ) )
+			continue;
+
+		struct ltc_frame * const frame = n < max_frames
+			? &frames[n]
+			: &discard;
+
+		if( ltc_decoder_edge( dec, since, frame ) && frame != &discard )
+			n++;
+		since = 0;
 	}
-	bit_count = 0;
-	return 0;
-#endif
 
-	int new_bit;
+	dec->since = since;
+	return n;
+}
 
-	static unsigned last_bit;
-	//printf( "%08x delta %x\n", offset, delta );
 
-#ifdef __ARM__
-// These deltas are in timer ticks
-// Timer == 500 MHz?  0xD0 ==> 2400 Hz, 0x1A0 => 1200 Hz
-#define ONE_LEN		0xD0
-#define ZERO_LEN	0x1A0
-#define EPS		0x30
-#else
-// These are in byte offsets in the file
-#define ZERO_LEN	0x25
-#define ONE_LEN		0x12
-#define EPS		0x04
-#endif
+#if !defined(__ARM__) && !defined(TIMECODE_NO_MAIN)
+/** Decode a whole .au file and benchmark the decoder.
+ *
+ *	timecode file.au [channel [verbose]]
+ */
+int main( int argc, char ** argv )
+{
+	const char * filename = argc > 1 ? argv[1] : "timecode.au";
+	const unsigned channel = argc > 2 ? strtoul( argv[2], 0, 0 ) : 0;
+	const int verbose = argc > 3;
 
-	if( ZERO_LEN-EPS < delta && delta < ZERO_LEN+EPS )
+	struct au_hdr hdr;
+	int fd = au_open( filename, &hdr );
+	if( fd < 0 )
+		return -1;
+
+	const unsigned channels = hdr.channels ? hdr.channels : 1;
+	if( channel >= channels )
 	{
-		// Full bit width
-		new_bit = 0;
-	} else
-	if( ONE_LEN-EPS < delta && delta < ONE_LEN+EPS )
+		fprintf( stderr, "%s: only %u channels\n", filename, channels );
+		return -1;
+	}
+
+	// Read it all first so that the benchmark does not include I/O
+	size_t len = 0;
+	size_t size = 1 << 20;
+	int16_t * buf = malloc( size * sizeof(*buf) );
+	size_t n;
+	while( (n = au_read( fd, buf + len, size - len )) > 0 )
 	{
-		// Skip the second transition if we're short
-		if( ++last_bit & 1 )
-			return 0;
-		last_bit = 0;
-		new_bit = 1;
-	} else {
-		bmp_printf(
-			FONT(FONT_SMALL,COLOR_RED,0),
-			delta < ONE_LEN ? 10 :
-			delta > ZERO_LEN ? 210 :
-			110,
-			300,
-			"%04x",
-			delta
-		);
-		printf( "%08x: bad delta %x\n", offset, delta );
-		// Lost sync somewhere
-		synced = 0;
-		word = 0;
-		return 0;
+		len += n;
+		if( len < size )
+			continue;
+		size *= 2;
+		buf = realloc( buf, size * sizeof(*buf) );
 	}
 
-	word = (word << 1) | new_bit;
+	const unsigned samples = len / channels;
+	const unsigned block = 1024;
+
+	// Nominal 30 fps; the tracking range covers 24 and 25 fps too
+	struct ltc_decoder dec;
+	struct ltc_frame frames[ 8 ];
+	struct ltc_frame first = { .position = 0 };
+	struct ltc_frame last = first;
+	unsigned offset;
 
-	//printf( " %04x\n", word & 0xFFFF );
-	//return 0;
+	ltc_decoder_init( &dec, hdr.rate / 2400 );
 
-	// Check for SMPTE sync signal
-	if( !synced )
+	for( offset=0 ; offset<samples ; offset += block )
 	{
-		if( (word & 0xFFFF) == 0x3FFD )
+		const unsigned count = samples - offset < block
+			? samples - offset
+			: block;
+		const unsigned found = ltc_decoder_block(
+			&dec,
+			buf + offset * channels + channel,
+			count,
+			channels,
+			frames,
+			COUNT(frames)
+		);
+
+		unsigned i;
+		for( i=0 ; i<found ; i++ )
 		{
-			//fprintf( stderr, "%x: Got sync!\n", offset );
-			printf( "\n%08x: synced", offset );
-			synced = 1;
-			word = 1;
-			byte_count = 0;
+			if( dec.frames - found + i == 0 )
+				first = frames[i];
+			last = frames[i];
+			if( !verbose )
+				continue;
+
+			printf( "%8u: %02d:%02d:%02d%c%02d user %08x\n",
+				frames[i].position,
+				frames[i].hours,
+				frames[i].minutes,
+				frames[i].seconds,
+				frames[i].drop_frame ? ';' : ':',
+				frames[i].frames,
+				frames[i].user
+			);
 		}
-
-		return 0;
 	}
 
-	// We are locked; wait until we have 8 bits then write it
-	if( (word & 0x100) == 0 )
-		return 0;
+	printf( "%s: %u samples @ %u Hz, %u frames, %u syncs, %u short, %u bad edges\n",
+		filename,
+		samples,
+		hdr.rate,
+		dec.frames,
+		dec.syncs,
+		dec.short_frames,
+		dec.bad_edges
+	);
 
-	//printf( " %02x", word & 0xFF );
-
-	// Reverse the word since we bit banged it in the wrong order
-	word = 0
-		| ( word & 0x01 ) << 7
-		| ( word & 0x02 ) << 5
-		| ( word & 0x04 ) << 3
-		| ( word & 0x08 ) << 1
-		| ( word & 0x10 ) >> 1
-		| ( word & 0x20 ) >> 3
-		| ( word & 0x40 ) >> 5
-		| ( word & 0x80 ) >> 7
-		;
-#ifdef __ARM__
-	//con_printf( FONT_SMALL, "%02x ", word );
-#endif
+	if( dec.frames )
+		printf( "%02d:%02d:%02d:%02d to %02d:%02d:%02d:%02d, bit period %.2f samples\n",
+			first.hours, first.minutes, first.seconds, first.frames,
+			last.hours, last.minutes, last.seconds, last.frames,
+			dec.period / 256.0
+		);
 
-	smpte_frame[ byte_count++ ] = word;
-	word = 1;
-	if( byte_count < 8 )
-		return 0;
+	// Run the whole file through enough times to get a stable time
+	unsigned long total = 0;
+	clock_t start = clock();
+	clock_t elapsed;
+	do {
+		ltc_decoder_init( &dec, hdr.rate / 2400 );
+		for( offset=0 ; offset<samples ; offset += block )
+			ltc_decoder_block(
+				&dec,
+				buf + offset * channels + channel,
+				samples - offset < block ? samples - offset : block,
+				channels,
+				frames,
+				COUNT(frames)
+			);
+		total += samples;
+		elapsed = clock() - start;
+	} while( samples && elapsed < CLOCKS_PER_SEC / 4 );
+
+	const double secs = (double) elapsed / CLOCKS_PER_SEC;
+	if( secs > 0 && hdr.rate )
+		printf( "%.0f samples/sec, %.0fx realtime\n",
+			total / secs,
+			total / secs / hdr.rate
+		);
 
-	// We have a complete frame
-	synced = 0;
-	return 1;
+	return 0;
 }
+#endif
 
 
-#ifndef __ARM__
-struct au_hdr
+#ifdef __ARM__
+/** Bit period at 30 fps in timer ticks (1 MHz) */
+#define LTC_TIMER_PERIOD	416
+
+static struct ltc_decoder tc_decoder;
+
+CONFIG_INT( "timecode.hud",	tc_hud,		1 );
+
+static volatile int tc_lv;
+
+
+/** Timecode clock state.
+ *
+ * The 24 bit timer wraps every 16.7 seconds, so tc_task extends it
+ * to 64 bits of microseconds several times a second.  The frame is
+ * computed from the time since the jam with a frames per microsecond
+ * scale in Q40, which is one multiply and shift per query.
+ *
+ * Only tc_task writes the state.  It fills in the copy that readers
+ * are not using and then flips tc_seq, so a reader that preempts
+ * the writer always finds a consistent copy and never has to spin
+ * waiting for a lower priority task.
+ */
+#define TC_SCALE_SHIFT		40
+#define TC_MAX_ELAPSED		((uint64_t) 1 << 37)	// 38 hours
+#define TC_DISCIPLINE_US	10000000		// 10 seconds
+#define TC_SECONDS_PER_DAY	86400
+
+struct tc_clock
 {
-	uint32_t	magic;
-	uint32_t	offset;
-	uint32_t	len;
-	uint32_t	encoding;
-	uint32_t	rate;
-	uint32_t	channels;
+	int			jammed;
+	uint32_t		fps;
+
+	uint32_t		base_raw;	//!< timer_read() at base_us
+	uint64_t		base_us;
+
+	uint64_t		jam_us;
+	uint32_t		jam_frame;	//!< Frames since midnight
+	uint64_t		scale;		//!< Frames per us, Q40
+	uint64_t		nominal;
+	int			drop_frame;
 };
 
+static struct tc_clock		tc_clocks[2];
+static volatile uint32_t	tc_seq;
 
-int main( int argc, char ** argv )
+
+/** Copy of the clock for the writer to modify */
+static struct tc_clock *
+tc_clock_begin( void )
 {
-	const char * filename = argc > 1 ? argv[1] : "timecode.au";
-	int fd = open( filename, O_RDONLY );
-	if( fd < 0 )
+	struct tc_clock * const next = &tc_clocks[ (tc_seq + 1) & 1 ];
+	*next = tc_clocks[ tc_seq & 1 ];
+	return next;
+}
+
+
+static void
+tc_clock_publish( void )
+{
+	barrier();
+	tc_seq++;
+}
+
+
+static void
+tc_clock_read(
+	struct tc_clock *	clock,
+	uint32_t *		raw
+)
+{
+	uint32_t seq;
+
+	do {
+		seq = tc_seq;
+		barrier();
+		*clock = tc_clocks[ seq & 1 ];
+		*raw = timer_read();
+		barrier();
+	} while( seq != tc_seq );
+}
+
+
+static inline uint64_t
+tc_clock_us(
+	const struct tc_clock *	clock,
+	uint32_t		raw
+)
+{
+	return clock->base_us + timer_delta( clock->base_raw, raw );
+}
+
+
+/** Frames since the jam, in Q8 */
+static uint64_t
+tc_clock_elapsed(
+	const struct tc_clock *	clock,
+	uint64_t		us
+)
+{
+	uint64_t elapsed = us - clock->jam_us;
+	if( elapsed > TC_MAX_ELAPSED )
+		elapsed = TC_MAX_ELAPSED;
+
+	return ( elapsed * clock->scale ) >> (TC_SCALE_SHIFT - 8);
+}
+
+
+/** Extend the timer; must be called at least every 16 seconds */
+static void
+tc_clock_tick( void )
+{
+	struct tc_clock * const clock = tc_clock_begin();
+	const uint32_t now = timer_read();
+
+	clock->base_us = tc_clock_us( clock, now );
+	clock->base_raw = now;
+	tc_clock_publish();
+}
+
+
+/** Drop frame timecode skips frames 0 and 1 at the start of every
+ * minute except each tenth one, so that 30 fps labels follow the
+ * 29.97 fps signal.  That leaves 17982 frames in ten minutes.
+ */
+#define TC_DF_PER_MINUTE	1798
+#define TC_DF_PER_10MINUTES	17982
+#define TC_DF_PER_DAY		( TC_DF_PER_10MINUTES * 6 * 24 )
+
+
+/** Frames since midnight for a timecode label */
+static uint32_t
+tc_frame_number(
+	const struct ltc_frame *	frame,
+	uint32_t			fps,
+	int				drop
+)
+{
+	const uint32_t minutes = frame->minutes + 60 * frame->hours;
+	uint32_t frame_num = frame->frames
+		+ fps * ( frame->seconds + 60 * minutes );
+
+	if( drop )
+		frame_num -= 2 * ( minutes - minutes / 10 );
+
+	return frame_num;
+}
+
+
+/** Jam or discipline the clock from a decoded frame.
+ *
+ * The sync word ends the frame, so at raw the next frame is starting.
+ * If the frame agrees with the running clock to within two frames
+ * the jam point is kept and the rate is recomputed over the whole
+ * time since the jam; otherwise the clock is jammed again.  Rate
+ * corrections are limited to 0.2%, which is far more than the
+ * crystals drift and still lets a 29.97 fps source, drop frame or
+ * not, pull the clock away from the 30 fps nominal.
+ */
+static void
+tc_clock_jam(
+	const struct ltc_frame *	frame,
+	uint32_t			raw,
+	uint32_t			fps
+)
+{
+	struct tc_clock * const clock = tc_clock_begin();
+	const int drop = fps == 30 && frame->drop_frame;
+	const uint32_t frame_num = 1 + tc_frame_number( frame, fps, drop );
+
+	clock->base_us = tc_clock_us( clock, raw );
+	clock->base_raw = raw;
+	const uint64_t us = clock->base_us;
+
+	if( clock->jammed
+	&&  clock->fps == fps
+	&&  clock->drop_frame == drop
+	&&  frame_num >= clock->jam_frame
+	)
 	{
-		perror( filename );
-		return -1;
-	}
+		const int64_t error = ((uint64_t)( frame_num - clock->jam_frame ) << 8)
+			- tc_clock_elapsed( clock, us );
 
-	struct au_hdr hdr;
-	offset = read( fd, &hdr, sizeof(hdr) );
-
-	hdr.magic	= ntohl( hdr.magic );
-	hdr.offset	= ntohl( hdr.offset );
-	hdr.len		= ntohl( hdr.len );
-	hdr.encoding	= ntohl( hdr.encoding );
-	hdr.rate	= ntohl( hdr.rate );
-	hdr.channels	= ntohl( hdr.channels );
-	fprintf( stderr,
-		"magic=%08x encoding=%x\n",
-		hdr.magic,
-		hdr.encoding
-	);
+		if( -512 < error && error < 512 )
+		{
+			const uint64_t elapsed = us - clock->jam_us;
+			if( elapsed >= TC_DISCIPLINE_US && elapsed < TC_MAX_ELAPSED )
+			{
+				uint64_t scale = ((uint64_t)( frame_num - clock->jam_frame )
+					<< TC_SCALE_SHIFT ) / elapsed;
+				const uint64_t limit = clock->nominal >> 9;
+
+				if( scale > clock->nominal + limit )
+					scale = clock->nominal + limit;
+				if( scale < clock->nominal - limit )
+					scale = clock->nominal - limit;
+				clock->scale = scale;
+			}
+
+			tc_clock_publish();
+			return;
+		}
+	}
 
-	if( hdr.magic != 0x2e736e64
-	||  hdr.encoding != 3 )
+	// Keep the learned rate if the frame rate has not changed
+	if( !clock->jammed || clock->fps != fps || clock->drop_frame != drop )
 	{
-		fprintf( stderr, "Bad magic or unsupported format!\n" );
-		return -1;
+		clock->fps	= fps;
+		clock->drop_frame = drop;
+		clock->nominal	= ((uint64_t) fps << TC_SCALE_SHIFT) / 1000000;
+		clock->scale	= clock->nominal;
 	}
 
-	uint16_t sample;
-	uint32_t last_transition = 0;
+	clock->jam_us		= us;
+	clock->jam_frame	= frame_num;
+	clock->jammed		= 1;
+	tc_clock_publish();
+
+	DebugMsg( DM_MAGIC, 3, "%s: %02d:%02d:%02d:%02d @ %d fps",
+		__func__,
+		frame->hours,
+		frame->minutes,
+		frame->seconds,
+		frame->frames,
+		fps
+	);
+}
 
-	// Seek to the start of the data
-	while( offset < hdr.offset )
-		offset += read( fd, &sample, 1 );
 
-	while( offset < hdr.len )
+int
+timecode_now(
+	struct tc_time *	tc
+)
+{
+	struct tc_clock clock;
+	uint32_t raw;
+
+	tc_clock_read( &clock, &raw );
+	if( !clock.jammed )
+		return 0;
+
+	const uint32_t fps = clock.fps;
+	const uint32_t frame = ( clock.jam_frame
+		+ ( tc_clock_elapsed( &clock, tc_clock_us( &clock, raw ) ) >> 8 )
+	) % ( clock.drop_frame ? TC_DF_PER_DAY : fps * TC_SECONDS_PER_DAY );
+
+	// Put the dropped labels back before splitting up the label
+	uint32_t label = frame;
+	if( clock.drop_frame )
 	{
-		ssize_t rc = read( fd, &sample, sizeof(sample) );
-		offset += rc;
-		if( rc < 1 )
-			break;
-
-		sample = ntohs( sample );
-		// Convert to an unsigned value
-		sample += 32768;
-		if( tc_sample( sample ) == 0 )
-			continue;
+		const uint32_t tens = frame / TC_DF_PER_10MINUTES;
+		const uint32_t rem = frame % TC_DF_PER_10MINUTES;
 
-		printf( "%08x", offset );
-		int i;
-		for( i=0 ; i<8 ; i++ )
-			printf( " %02x", smpte_frame[ i ] );
-
-		// Decode it:
-#define BCD_BITS(x) \
-	(smpte_frame[x/8] & 0xF)
-
-		int f = BCD_BITS(0) + 10 * (BCD_BITS(8) & 0x3);
-		int s = BCD_BITS(16) + 10 * (BCD_BITS(24) & 0x7);
-		int m = BCD_BITS(32) + 10 * BCD_BITS(40);
-		int h = BCD_BITS(48) + 10 * (BCD_BITS(56) & 0x3);
-		
-		printf( ": %02d:%02d:%02d.%02d\n", h, m, s, f  );
+		label += 18 * tens;
+		if( rem > 1 )
+			label += 2 * ( ( rem - 2 ) / TC_DF_PER_MINUTE );
 	}
 
-	return 0;
+	const uint32_t secs = label / fps;
+
+	tc->frame	= frame;
+	tc->fps		= fps;
+	tc->drop_frame	= clock.drop_frame;
+	tc->frames	= label % fps;
+	tc->seconds	= secs % 60;
+	tc->minutes	= (secs / 60) % 60;
+	tc->hours	= secs / 3600;
+	return 1;
 }
-#else
 
 
+/** Nearest standard frame rate to the tracked bit period */
+static uint32_t
+ltc_fps(
+	const struct ltc_decoder *	dec
+)
+{
+	// 80 bits per frame at 1 MHz, with the period in Q8
+	const uint32_t fps = ( (1000000 << 8) / 80 + dec->period / 2 ) / dec->period;
+
+	if( fps < 25 )
+		return 24;
+	if( fps < 28 )
+		return 25;
+	return 30;
+}
+
+
+/** How often the HUD is redrawn while the decoder runs */
+#define TC_HUD_PERIOD		100000	// usec
+
+/** Show the running timecode next to the exposure settings */
+static void
+draw_timecode_hud( void )
+{
+	struct tc_time tc;
+
+	if( !tc_hud || !tc_lv || gui_menu_task )
+		return;
+	if( !timecode_now( &tc ) )
+		return;
+
+	bmp_printf(
+		FONT_MED,
+		320, 400,
+		"TC %02d:%02d:%02d:%02d",
+		tc.hours,
+		tc.minutes,
+		tc.seconds,
+		tc.frames
+	);
+}
+
+
+/** Poll the level register until the menu opens.
+ * The register is read as fast as possible and the intervals are
+ * measured with the hardware timer, so the sample rate does not
+ * matter to the decoder.
+ */
 static void
 process_timecode( void )
 {
+	struct ltc_decoder * const dec = &tc_decoder;
+	struct ltc_frame frame;
+	uint32_t last = timer_read();
+	uint32_t last_hud = last;
+	unsigned polls = 0;
+
+	ltc_decoder_init( dec, LTC_TIMER_PERIOD );
+
 	while( !gui_menu_task )
 	{
-		int sample = audio_read_level( 0 );
-		if( tc_sample( sample ) == 0 )
+		// Keep the clock extended even if there is no signal
+		if( (++polls & 0xFFFF) == 0 )
+			tc_clock_tick();
+
+		if( !ltc_slice( dec, audio_read_level( 0 ) ) )
 			continue;
 
-		// Print a timecode result!
-		// Decode it:
-#define BCD_BITS(x) \
-	(smpte_frame[x/8] & 0xF)
-
-		int f = BCD_BITS(0) + 10 * (BCD_BITS(8) & 0x3);
-		int s = BCD_BITS(16) + 10 * (BCD_BITS(24) & 0x7);
-		int m = BCD_BITS(32) + 10 * BCD_BITS(40);
-		int h = BCD_BITS(48) + 10 * (BCD_BITS(56) & 0x3);
-		
-#if 0
-		bmp_printf(
-			FONT(FONT_LARGE,COLOR_WHITE,COLOR_BLUE),
-			180, 150,
-			"             \n"
-			"  SMPTE LTC  \n"
-			" %02d:%02d:%02d.%02d \n"
-			"             \n",
-			h, m, s, f
-		);
-#else
-		bmp_printf(
-			FONT_HUGE,
-			0, 150,
-			//23456789012
-			//hh:mm:ss.ff \n
-			" SMTPE LTC:  \n"
-			" %02d:%02d:%02d.%02d ",
-			h, m, s, f
-		);
-#endif
+		const uint32_t now = timer_read();
+		const uint32_t delta = timer_delta( last, now );
+		last = now;
+
+		if( !ltc_decoder_edge( dec, delta, &frame ) )
+			continue;
+
+		tc_clock_jam( &frame, now, ltc_fps( dec ) );
+
+		// The HUD runs from the clock, a few times a second
+		if( timer_delta( last_hud, now ) < TC_HUD_PERIOD )
+			continue;
+		last_hud = now;
+		draw_timecode_hud();
 	}
 }
 
@@ -322,16 +749,42 @@ timecode_unlock( void * priv )
 }
 
 
+static void
+timecode_hud_display( void * priv, int x, int y, int selected )
+{
+	bmp_printf(
+		selected ? MENU_FONT_SEL : MENU_FONT,
+		x, y,
+		//23456789012
+		"TC display: %s",
+		tc_hud ? "ON " : "OFF"
+	);
+}
+
+
 static struct menu_entry timecode_menu[] = {
 	{
 		.display	= menu_print,
 		.priv		= "Jam timecode",
 		.select		= timecode_unlock,
 	},
+	{
+		.priv		= &tc_hud,
+		.select		= menu_binary_toggle,
+		.display	= timecode_hud_display,
+	},
 };
 
 
+PROP_HANDLER( PROP_LV_ACTION )
+{
+	tc_lv = !buf[0];
+}
+
 
+/** Wait for the menu to start the decoder; in between keep the
+ * clock extended and update the display a few times a second.
+ */
 static void
 tc_task( void )
 {
@@ -340,7 +793,13 @@ tc_task( void )
 
 	while(1)
 	{
-		take_semaphore( timecode_sem, 0 );
+		if( take_semaphore( timecode_sem, 100 ) != 0 )
+		{
+			tc_clock_tick();
+			draw_timecode_hud();
+			continue;
+		}
+
 		process_timecode();
 	}
 }
@@ -348,5 +807,3 @@ tc_task( void )
 
 TASK_CREATE( __FILE__, tc_task, 0, 0x18, 0x1000 );
 #endif
-
-
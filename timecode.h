@@ -0,0 +1,190 @@
+#ifndef _timecode_h_
+#define _timecode_h_
+
+/** \file
+ * SMPTE linear timecode decoder.
+ *
+ * LTC is biphase mark coded: every bit cell starts with a transition
+ * and a one has an extra transition in the middle.  The decoder
+ * measures the intervals between the transitions, classifies them
+ * as long (a zero) or short (half of a one) against a running
+ * estimate of the bit period, and shifts the bits into an 80 bit
+ * register.  A frame is complete when the sync word arrives exactly
+ * 80 bits after the previous one.
+ *
+ * All of the state lives in struct ltc_decoder so several streams
+ * can be decoded at once.  Samples can be fed in blocks of any size,
+ * or the caller can measure the intervals itself, like the camera
+ * does with the hardware timer, and feed them one edge at a time.
+ */
+/*
+ * Copyright (C) 2009 Trammell Hudson <hudson+ml@osresearch.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include <stdint.h>
+
+/** Sync word in the last 16 bits of the frame, newest bit first */
+#define LTC_SYNC		0x3FFD
+#define LTC_FRAME_BITS		80
+
+/** Default slicer hysteresis, in sample units */
+#define LTC_THRESHOLD		1000
+
+
+struct ltc_frame
+{
+	uint8_t			raw[8];		//!< Data bits 0-63, LSB first
+	uint8_t			hours;
+	uint8_t			minutes;
+	uint8_t			seconds;
+	uint8_t			frames;
+	uint8_t			drop_frame;
+	uint32_t		user;		//!< User bits 1-8
+	uint32_t		position;	//!< Input position of the sync word
+};
+
+
+struct ltc_decoder
+{
+	// Slicer
+	int			threshold;
+	int			level;
+	uint32_t		since;		//!< Samples since the last edge
+
+	// Bit clock, in Q8 input units so that it can track slowly
+	uint32_t		period;
+	uint32_t		period_min;
+	uint32_t		period_max;
+	int			half;		//!< Saw the first half of a one
+
+	// 80 bit shift register, newest bit in bit 0 of lo
+	uint64_t		lo;
+	uint16_t		hi;
+	unsigned		bits;		//!< Bits since the last sync word
+	uint32_t		position;	//!< Input samples or ticks consumed
+
+	// Statistics, instead of printing from the decoder
+	unsigned		frames;
+	unsigned		syncs;
+	unsigned		short_frames;	//!< Sync word too early or late
+	unsigned		bad_edges;	//!< Intervals that were not a bit
+};
+
+
+/** Reset the decoder.
+ * period is the nominal length of a bit in input units, which is
+ * samples for the block decoder or ticks for the edge decoder.
+ * The tracked period is allowed to drift to half or twice of it,
+ * so the same setting handles 24 to 30 fps and shuttling.
+ */
+extern void
+ltc_decoder_init(
+	struct ltc_decoder *	dec,
+	uint32_t		period
+);
+
+
+/** Feed the interval since the last transition.
+ * Returns 1 and fills in the frame if it completed one.
+ */
+extern int
+ltc_decoder_edge(
+	struct ltc_decoder *	dec,
+	uint32_t		interval,
+	struct ltc_frame *	frame
+);
+
+
+/** Decode a block of samples; blocks may be split anywhere.
+ * Returns the number of frames written, at most max_frames.  Any
+ * beyond that are counted in the stats but not returned.
+ */
+extern unsigned
+ltc_decoder_block(
+	struct ltc_decoder *	dec,
+	const int16_t *		samples,
+	unsigned		count,
+	unsigned		stride,
+	struct ltc_frame *	frames,
+	unsigned		max_frames
+);
+
+
+/** Time of day from the timecode clock */
+struct tc_time
+{
+	uint32_t		frame;		//!< Frames since midnight
+	uint8_t			fps;
+	uint8_t			drop_frame;
+	uint8_t			hours;
+	uint8_t			minutes;
+	uint8_t			seconds;
+	uint8_t			frames;
+};
+
+
+/** Free-running timecode clock.
+ *
+ * Once "Jam timecode" has decoded a frame, the clock runs from the
+ * hardware timer and keeps the rate it learned from the LTC source,
+ * so any task can stamp timecode without decoding audio.  Returns 0
+ * if the clock has never been jammed.  The call does not block and
+ * takes the same time whenever it is made.
+ *
+ * Without CONFIG_TIMECODE timecode.o is not linked and the clock is
+ * never jammed, so the callers compile down to their fallbacks.
+ */
+#if defined(CONFIG_TIMECODE) || !defined(__ARM__)
+extern int
+timecode_now(
+	struct tc_time *	tc
+);
+#else
+static inline int
+timecode_now(
+	struct tc_time *	tc
+)
+{
+	return 0;
+}
+#endif
+
+
+/** Run one sample through the slicer.
+ * Returns 1 if the signal crossed the hysteresis band.
+ */
+static inline int
+ltc_slice(
+	struct ltc_decoder *	dec,
+	int			sample
+)
+{
+	const int old_level = dec->level;
+
+	if( sample > dec->threshold )
+		dec->level = 0;
+	else
+	if( sample < -dec->threshold )
+		dec->level = 1;
+
+	return dec->level != old_level;
+}
+
+
+#endif
@@ -31,10 +31,34 @@
 #include "property.h"
 
 
-static struct bmp_file_t * cropmarks;
-static volatile unsigned lv_drawn = 0;
+static struct bmp_sprite * cropmarks;
+static struct semaphore * crop_lock;
+static struct semaphore * crop_load_sem;
 static volatile unsigned sensor_cleaning = 1;
 
+/** Live view is on the screen when it has been started and the GUI
+ * is idle.  Both are read from the property cache instead of a flag
+ * that two handlers overwrite, so the last delivery of either one
+ * does not decide it on its own.
+ */
+PROP_WATCH( PROP_LV_ACTION );
+PROP_WATCH( PROP_GUI_STATE );
+
+static const struct prop_cache * lv_action_cache;
+static const struct prop_cache * gui_state_cache;
+
+static int
+lv_drawn( void )
+{
+	uint32_t action = 1;	// LV_START == 0, LV_STOP == 1
+	uint32_t state = 0;	// IDLE == 0
+
+	prop_cache_read( lv_action_cache, &action, sizeof(action) );
+	prop_cache_read( gui_state_cache, &state, sizeof(state) );
+
+	return action == 0 && state == 0;
+}
+
 #define vram_start_line	33
 #define vram_end_line	380
 
@@ -43,16 +67,18 @@ static volatile unsigned sensor_cleaning = 1;
 #define waveform_height			256
 #define waveform_width			(720/2)
 
-CONFIG_INT( "zebra.draw",	zebra_draw,	1 );
+CONFIG_INT_RANGE( "zebra.draw",	zebra_draw,	1, 0, 1 );
 CONFIG_INT( "zebra.level",	zebra_level,	0xF000 );
-CONFIG_INT( "crop.draw",	crop_draw,	1 );
+CONFIG_INT_RANGE( "crop.draw",	crop_draw,	1, 0, 1 );
 CONFIG_STR( "crop.file",	crop_file,	"A:/cropmarks.bmp" );
-CONFIG_INT( "edge.draw",	edge_draw,	0 );
+CONFIG_STR( "crop.dir",		crop_dir,	"A:/CROPMKS" );
+CONFIG_INT( "crop.cache",	crop_cache_kb,	256 );
+CONFIG_INT_RANGE( "edge.draw",	edge_draw,	0, 0, 1 );
 CONFIG_INT( "enable-liveview",	enable_liveview, 1 );
-CONFIG_INT( "hist.draw",	hist_draw,	1 );
+CONFIG_INT_RANGE( "hist.draw",	hist_draw,	1, 0, 1 );
 CONFIG_INT( "hist.x",		hist_x,		720 - hist_width - 4 );
 CONFIG_INT( "hist.y",		hist_y,		100 );
-CONFIG_INT( "waveform.draw",	waveform_draw,	0 );
+CONFIG_INT_RANGE( "waveform.draw",	waveform_draw,	0, 0, 1 );
 CONFIG_INT( "waveform.x",	waveform_x,	720 - waveform_width );
 CONFIG_INT( "waveform.y",	waveform_y,	480 - 50 - waveform_height );
 CONFIG_INT( "waveform.bg",	waveform_bg,	0x26 ); // solid black
@@ -61,6 +87,8 @@ CONFIG_INT( "timecode.y",	timecode_y,	32 );
 CONFIG_INT( "timecode.width",	timecode_width,	160 );
 CONFIG_INT( "timecode.height",	timecode_height, 20 );
 CONFIG_INT( "timecode.warning",	timecode_warning, 120 );
+CONFIG_INT( "guides.draw",	guides_draw,	0 );
+CONFIG_INT( "guides.color",	guides_color,	COLOR_WHITE );
 static unsigned timecode_font	= FONT(FONT_MED, COLOR_RED, COLOR_BG );
 
 
@@ -160,6 +188,84 @@ check_zebra(
 }
 
 
+/** Cropmark cursor.
+ * The cropmarks are a run-length sprite, so the scan in draw_zebra()
+ * walks the runs in step with x instead of indexing a bitmap.
+ * crop_next is the start of row crop_y, the row after the current one.
+ */
+static const struct bmp_sprite * crop_sprite;
+static const uint8_t *	crop_next;
+static uint32_t		crop_y;
+static const uint8_t *	crop_run;
+static uint32_t		crop_end;
+static uint8_t		crop_color;
+
+
+static const uint8_t *
+crop_skip_row(
+	const uint8_t *		run
+)
+{
+	while( *run )
+		run += 2;
+	return run + 1;
+}
+
+
+/** Position the cursor at the start of row y */
+static void
+crop_seek_row(
+	uint32_t		y
+)
+{
+	crop_run = NULL;
+	crop_end = 0;
+	crop_color = COLOR_EMPTY;
+
+	if( !crop_next || y < crop_y || crop_sprite != cropmarks )
+	{
+		crop_sprite = cropmarks;
+		crop_next = cropmarks->runs;
+		crop_y = 0;
+	}
+
+	if( y >= cropmarks->height )
+		return;
+
+	while( crop_y < y )
+	{
+		crop_next = crop_skip_row( crop_next );
+		crop_y++;
+	}
+
+	crop_run = crop_next;
+	crop_next = crop_skip_row( crop_next );
+	crop_y++;
+}
+
+
+static uint8_t
+crop_pixel(
+	uint32_t		x
+)
+{
+	while( x >= crop_end )
+	{
+		if( !crop_run || !crop_run[0] )
+		{
+			crop_run = NULL;
+			return COLOR_EMPTY;
+		}
+
+		crop_end += crop_run[0];
+		crop_color = crop_run[1];
+		crop_run += 2;
+	}
+
+	return crop_color;
+}
+
+
 static unsigned
 check_crop(
 	unsigned		x,
@@ -172,10 +278,9 @@ check_crop(
 	if( !cropmarks )
 		return 0;
 
-	uint8_t * pixbuf = &cropmarks->image[
-		x + cropmarks->width * (cropmarks->height - y)
-	];
-	uint16_t pix = *(uint16_t*) pixbuf;
+	const uint16_t pix = 0
+		| crop_pixel( x + 0 ) << 0
+		| crop_pixel( x + 1 ) << 8;
 	if( pix == 0 )
 		return 0;
 
@@ -385,6 +490,199 @@ waveform_draw_image(
 }
 
 
+/** Framing guides.
+ * These are drawn with the vector primitives instead of being held
+ * as full screen bitmaps.  guides.draw is a mask of these bits.
+ */
+#define GUIDE_THIRDS		0x01
+#define GUIDE_CENTER		0x02
+#define GUIDE_SAFE		0x04	// 90% action safe
+#define GUIDE_CINEMA		0x08	// 2.35:1 frame lines
+#define GUIDE_LEVEL		0x10	// horizon line and center circle
+
+static unsigned guides_seq;
+static unsigned guides_drawn;
+
+#define GUIDE_RADIUS		40
+
+/** Each guide line is a one pixel wide or tall rectangle, so that
+ * the damage check only looks at the pixels the lines cover.
+ */
+struct guide_rect
+{
+	uint32_t		x;
+	uint32_t		y;
+	uint32_t		w;
+	uint32_t		h;
+};
+
+#define GUIDE_RECTS		16
+
+
+static unsigned
+guide_rects(
+	unsigned		mask,
+	struct guide_rect *	r
+)
+{
+	const uint32_t x0 = 0;
+	const uint32_t y0 = vram_start_line;
+	const uint32_t w = bmp_width();
+	const uint32_t h = vram_end_line - vram_start_line;
+	const uint32_t cx = x0 + w/2;
+	const uint32_t cy = y0 + h/2;
+	struct guide_rect * const start = r;
+
+#define GUIDE_HLINE( X0, X1, Y ) \
+	*r++ = (struct guide_rect){ (X0), (Y), (X1) - (X0), 1 }
+#define GUIDE_VLINE( X, Y0, Y1 ) \
+	*r++ = (struct guide_rect){ (X), (Y0), 1, (Y1) - (Y0) }
+
+	if( mask & GUIDE_THIRDS )
+	{
+		GUIDE_VLINE( x0 + (w*1)/3, y0, y0 + h );
+		GUIDE_VLINE( x0 + (w*2)/3, y0, y0 + h );
+		GUIDE_HLINE( x0, x0 + w, y0 + (h*1)/3 );
+		GUIDE_HLINE( x0, x0 + w, y0 + (h*2)/3 );
+	}
+
+	if( mask & GUIDE_CENTER )
+	{
+		GUIDE_HLINE( cx - 16, cx + 16, cy );
+		GUIDE_VLINE( cx, cy - 16, cy + 16 );
+	}
+
+	if( mask & GUIDE_SAFE )
+	{
+		const uint32_t sx = x0 + w/20;
+		const uint32_t sy = y0 + h/20;
+		const uint32_t sw = w - w/10;
+		const uint32_t sh = h - h/10;
+
+		GUIDE_HLINE( sx, sx + sw, sy );
+		GUIDE_HLINE( sx, sx + sw, sy + sh - 1 );
+		GUIDE_VLINE( sx, sy + 1, sy + sh - 1 );
+		GUIDE_VLINE( sx + sw - 1, sy + 1, sy + sh - 1 );
+	}
+
+	if( mask & GUIDE_CINEMA )
+	{
+		// Frame height for 2.35:1 at the full width
+		const uint32_t fh = (w * 100) / 235;
+		GUIDE_HLINE( x0, x0 + w, cy - fh/2 );
+		GUIDE_HLINE( x0, x0 + w, cy + fh/2 );
+	}
+
+	if( mask & GUIDE_LEVEL )
+	{
+		GUIDE_HLINE( x0, cx - GUIDE_RADIUS, cy );
+		GUIDE_HLINE( cx + GUIDE_RADIUS, x0 + w, cy );
+	}
+
+#undef GUIDE_HLINE
+#undef GUIDE_VLINE
+
+	return r - start;
+}
+
+
+static void
+draw_guide_lines(
+	unsigned		mask,
+	uint8_t			color
+)
+{
+	struct guide_rect rects[ GUIDE_RECTS ];
+	const unsigned count = guide_rects( mask, rects );
+	unsigned i;
+
+	for( i=0 ; i<count ; i++ )
+	{
+		const struct guide_rect * const r = &rects[i];
+		if( r->w == 1 )
+			bmp_vline( color, r->x, r->y, r->y + r->h );
+		else
+			bmp_hline( color, r->x, r->x + r->w, r->y );
+	}
+
+	if( mask & GUIDE_LEVEL )
+		bmp_circle(
+			color,
+			bmp_width() / 2,
+			(vram_start_line + vram_end_line) / 2,
+			GUIDE_RADIUS
+		);
+}
+
+
+/** Has anything drawn over the guide lines since the last check?
+ * Text elsewhere in the frame does not count.
+ */
+static int
+guides_damaged(
+	unsigned		mask
+)
+{
+	struct guide_rect rects[ GUIDE_RECTS ];
+	const unsigned count = guide_rects( mask, rects );
+	const unsigned start = guides_seq;
+	int damaged = 0;
+	unsigned i;
+
+	for( i=0 ; i<count ; i++ )
+	{
+		unsigned seq = start;
+		const struct guide_rect * const r = &rects[i];
+		damaged |= bmp_damaged( r->x, r->y, r->w, r->h, &seq );
+		guides_seq = seq;
+	}
+
+	if( mask & GUIDE_LEVEL )
+	{
+		unsigned seq = start;
+		damaged |= bmp_damaged(
+			bmp_width() / 2 - GUIDE_RADIUS,
+			(vram_start_line + vram_end_line) / 2 - GUIDE_RADIUS,
+			2 * GUIDE_RADIUS + 1,
+			2 * GUIDE_RADIUS + 1,
+			&seq
+		);
+		guides_seq = seq;
+	}
+
+	return damaged;
+}
+
+
+/** Redraw the guides if something has drawn over them,
+ * or always if forced (after the zebra pass has wiped them).
+ * Turning them off erases the old lines.
+ */
+static void
+draw_guides(
+	int			force
+)
+{
+	if( guides_drawn != guides_draw )
+	{
+		draw_guide_lines( guides_drawn, COLOR_EMPTY );
+		guides_drawn = guides_draw;
+		force = 1;
+	}
+
+	if( !guides_drawn )
+		return;
+
+	if( !guides_damaged( guides_drawn ) && !force )
+		return;
+
+	draw_guide_lines( guides_drawn, guides_color );
+
+	// Do not count our own lines as damage
+	guides_damaged( guides_drawn );
+}
+
+
 /** Master video overlay drawing code.
  *
  * This routine controls the display of the zebras, histogram,
@@ -409,17 +707,26 @@ draw_zebra( void )
 	if( !bvram )
 		return;
 
-	// If we are not drawing edges, or zebras or crops, nothing to do
+	// If we are not drawing edges, or zebras or crops, only
+	// the guides might need attention
 	if( !edge_draw && !zebra_draw && !hist_draw && !waveform_draw )
 	{
-		if( !crop_draw )
-			return;
-		if( !cropmarks )
+		if( !crop_draw || !cropmarks )
+		{
+			draw_guides( 0 );
 			return;
+		}
 	}
 
 	struct vram_info * vram = &vram_info[ vram_get_number(2) ];
 
+	// Keep the cropmark library from switching or freeing the
+	// current sprite while the scan is walking it.  Once there is
+	// a sprite it is never cleared, only replaced under the lock.
+	const int crop = crop_draw && cropmarks;
+	if( crop )
+		take_semaphore( crop_lock, 0 );
+
 	hist_build();
 
 	// skip the audio meter at the top and the bar at the bottom
@@ -431,6 +738,14 @@ draw_zebra( void )
 		uint32_t * const v_row = (uint32_t*)( vram->vram + y * vram->pitch );
 		uint16_t * const b_row = (uint16_t*)( bvram + y * bmp_pitch() );
 
+		// Live view can stop in the middle of a frame; the cache
+		// is cheap enough to check once per row
+		if( !lv_drawn() )
+			goto abort;
+
+		if( crop )
+			crop_seek_row( y );
+
 		// Iterate over the pixels in the scan row
 		// two at a time to read the pixel buf in 32 bit chunks
 		// otherwise we get err70 aborts while drawing regions
@@ -438,8 +753,8 @@ draw_zebra( void )
 		for( x=2 ; x < vram->width-2 ; x+=2 )
 		{
 			// Abort as soon as the new menu is drawn
-			if( gui_menu_task || !lv_drawn )
-				return;
+			if( gui_menu_task )
+				goto abort;
 
 			// Ignore the regions where the histogram will be drawn
 			if( hist_draw
@@ -467,7 +782,7 @@ draw_zebra( void )
 			)
 				continue;
 
-			if( crop_draw && check_crop( x, y, b_row, v_row, vram->pitch ) )
+			if( crop && check_crop( x, y, b_row, v_row, vram->pitch ) )
 				continue;
 
 			if( edge_draw && check_edge( x, y, b_row, v_row, vram->pitch ) )
@@ -481,13 +796,291 @@ draw_zebra( void )
 		}
 	}
 
+	if( crop )
+		give_semaphore( crop_lock );
+
 	if( hist_draw )
 		hist_draw_image( hist_x, hist_y );
 	if( waveform_draw )
 		waveform_draw_image( waveform_x, waveform_y );
+
+	draw_guides( 1 );
+	return;
+
+abort:
+	if( crop )
+		give_semaphore( crop_lock );
+}
+
+
+/** Cropmark library.
+ *
+ * crop.file and up to CROP_MAX numbered files CROP00.BMP,
+ * CROP01.BMP, ... in crop.dir are found and decoded by crop_task
+ * in the background.  The sprites stay in memory, subject to the
+ * crop.cache limit in KB, so switching between them from the menu
+ * does not touch the card.  When the limit is exceeded the least
+ * recently shown sprite is dropped and reloaded if it is selected
+ * again.  (There is no FIO_FindFirstEx() stub for this firmware,
+ * so the directory is probed by name.)
+ */
+#define CROP_MAX		16
+
+struct crop_entry
+{
+	char			name[ 32 ];
+	struct bmp_sprite *	sprite;
+	unsigned		last_used;
+};
+
+static struct crop_entry	crop_lib[ CROP_MAX + 1 ];
+static unsigned			crop_count;
+static unsigned			crop_current;
+static unsigned			crop_clock;
+static unsigned			crop_bytes;
+
+
+static unsigned
+crop_sprite_bytes(
+	const struct bmp_sprite *	sprite
+)
+{
+	return sizeof(*sprite) + sprite->size;
+}
+
+
+/** Make entry i the current one, and the one that is drawn if it
+ * is in memory.  Called with crop_lock held.
+ */
+static int
+crop_select_locked(
+	unsigned		i
+)
+{
+	struct bmp_sprite * sprite = crop_lib[i].sprite;
+
+	crop_current = i;
+	if( !sprite )
+		return 0;
+
+	crop_lib[i].last_used = ++crop_clock;
+	cropmarks = sprite;
+	return 1;
+}
+
+
+static unsigned
+crop_get_current( void )
+{
+	take_semaphore( crop_lock, 0 );
+	const unsigned i = crop_current;
+	give_semaphore( crop_lock );
+	return i;
+}
+
+
+/** Drop least recently used sprites, never the current one,
+ * until there is room for another one of size bytes.
+ */
+static void
+crop_evict(
+	unsigned		bytes
+)
+{
+	const unsigned limit = crop_cache_kb * 1024;
+
+	while( crop_bytes + bytes > limit )
+	{
+		struct crop_entry * victim = NULL;
+		unsigned i;
+
+		take_semaphore( crop_lock, 0 );
+
+		for( i=0 ; i<crop_count ; i++ )
+		{
+			struct crop_entry * e = &crop_lib[i];
+			if( !e->sprite || i == crop_current || e->sprite == cropmarks )
+				continue;
+			if( !victim || e->last_used < victim->last_used )
+				victim = e;
+		}
+
+		struct bmp_sprite * sprite = NULL;
+		if( victim )
+		{
+			sprite = victim->sprite;
+			victim->sprite = NULL;
+		}
+
+		give_semaphore( crop_lock );
+
+		if( !sprite )
+			return;
+
+		DebugMsg( DM_MAGIC, 3, "%s: dropping %s", __func__, victim->name );
+
+		crop_bytes -= crop_sprite_bytes( sprite );
+		free( sprite );
+	}
+}
+
+
+static int
+crop_load(
+	unsigned		i
+)
+{
+	struct crop_entry * e = &crop_lib[i];
+	if( e->sprite )
+		return 1;
+
+	struct bmp_sprite * sprite = bmp_load( e->name );
+	if( !sprite )
+		return 0;
+
+	const unsigned bytes = crop_sprite_bytes( sprite );
+	crop_evict( bytes );
+	if( crop_bytes + bytes > crop_cache_kb * 1024 && i != crop_get_current() )
+	{
+		// Does not fit even after evicting; leave it on the card
+		free( sprite );
+		return 0;
+	}
+
+	e->sprite = sprite;
+	e->last_used = ++crop_clock;
+	crop_bytes += bytes;
+
+	DebugMsg( DM_MAGIC, 3, "%s: %s %dx%d %d bytes, cache %d bytes",
+		__func__,
+		e->name,
+		sprite->width,
+		sprite->height,
+		bytes,
+		crop_bytes
+	);
+
+	return 1;
+}
+
+
+static void
+crop_find( void )
+{
+	unsigned size;
+	unsigned i;
+
+	crop_count = 0;
+
+	if( FIO_GetFileSize( crop_file, &size ) == 0 )
+		snprintf( crop_lib[ crop_count++ ].name, sizeof(crop_lib[0].name),
+			"%s", crop_file );
+
+	for( i=0 ; i<CROP_MAX ; i++ )
+	{
+		struct crop_entry * e = &crop_lib[ crop_count ];
+		snprintf( e->name, sizeof(e->name), "%s/CROP%02d.BMP", crop_dir, i );
+		if( FIO_GetFileSize( e->name, &size ) == 0 )
+			crop_count++;
+	}
+
+	DebugMsg( DM_MAGIC, 3, "%s: %d cropmarks", __func__, crop_count );
+}
+
+
+/** Select the next cropmark.  If it has been dropped from the
+ * cache the loader is asked for it and it will be shown once it
+ * has been decoded.
+ */
+static void
+crop_next_toggle( void * priv )
+{
+	if( !crop_count )
+		return;
+
+	take_semaphore( crop_lock, 0 );
+	const int cached = crop_select_locked( (crop_current + 1) % crop_count );
+	give_semaphore( crop_lock );
+
+	// Not cached; load it in the background
+	if( !cached )
+		give_semaphore( crop_load_sem );
+}
+
+
+static void
+crop_library_display( void * priv, int x, int y, int selected )
+{
+	const char * name = "NONE";
+	if( crop_count )
+	{
+		name = crop_lib[ crop_current ].name;
+		const char * slash = name;
+		while( *slash )
+			if( *slash++ == '/' )
+				name = slash;
+	}
+
+	bmp_printf(
+		selected ? MENU_FONT_SEL : MENU_FONT,
+		x, y,
+		//23456789012
+		"Crop file:  %s%s",
+		name,
+		crop_count && !crop_lib[ crop_current ].sprite ? "..." : ""
+	);
 }
 
 
+static void
+crop_task( void )
+{
+	crop_find();
+
+	// Show the first one as soon as it is available, then fill
+	// the cache with the rest while there is room
+	unsigned i;
+	for( i=0 ; i<crop_count ; i++ )
+	{
+		if( crop_load( i ) && !cropmarks )
+		{
+			take_semaphore( crop_lock, 0 );
+			crop_select_locked( i );
+			give_semaphore( crop_lock );
+		}
+		if( crop_bytes >= crop_cache_kb * 1024 )
+			break;
+	}
+
+	while(1)
+	{
+		take_semaphore( crop_load_sem, 0 );
+
+		const unsigned want = crop_get_current();
+		if( !crop_load( want ) )
+			continue;
+
+		// The menu may have moved on while it was loading
+		take_semaphore( crop_lock, 0 );
+		if( want == crop_current )
+			crop_select_locked( want );
+		give_semaphore( crop_lock );
+	}
+}
+
+TASK_CREATE( "crop_task", crop_task, 0, 0x1f, 0x1000 );
+
+
+static void
+crop_init( void )
+{
+	crop_lock	= create_named_semaphore( "crop_lock", 1 );
+	crop_load_sem	= create_named_semaphore( "crop_load", 0 );
+}
+
+INIT_FUNC( __FILE__, crop_init );
+
+
 static void
 zebra_toggle( void * priv )
 {
@@ -523,15 +1116,12 @@ zebra_draw_display( void * priv, int x, int y, int selected )
 static void
 crop_display( void * priv, int x, int y, int selected )
 {
-	extern int retry_count;
-
 	bmp_printf(
 		selected ? MENU_FONT_SEL : MENU_FONT,
 		x, y,
 		//23456789012
-		"Cropmarks:  %s %d",
-		cropmarks ? (*(unsigned*) priv ? "ON " : "OFF") : "NO FILE",
-		retry_count
+		"Cropmarks:  %s",
+		cropmarks ? (*(unsigned*) priv ? "ON " : "OFF") : "NO FILE"
 	);
 }
 
@@ -574,6 +1164,56 @@ waveform_display( void * priv, int x, int y, int selected )
 }
 
 
+/** Common guide combinations for the menu; any mask can be
+ * set in the config file.
+ */
+static const struct {
+	unsigned		mask;
+	const char *		name;
+} guide_modes[] = {
+	{ 0,					"OFF"    },
+	{ GUIDE_THIRDS,				"THIRDS" },
+	{ GUIDE_THIRDS | GUIDE_CENTER,		"3RDS+X" },
+	{ GUIDE_CINEMA,				"2.35:1" },
+	{ GUIDE_CINEMA | GUIDE_SAFE,		"2.35+SF" },
+	{ GUIDE_SAFE | GUIDE_CENTER,		"SAFE+X" },
+	{ GUIDE_LEVEL,				"LEVEL"  },
+};
+
+
+static void
+guides_toggle( void * priv )
+{
+	unsigned i;
+	for( i=0 ; i<COUNT(guide_modes) ; i++ )
+		if( guide_modes[i].mask == guides_draw )
+			break;
+
+	i = (i + 1) % COUNT(guide_modes);
+	guides_draw = guide_modes[i].mask;
+	config_changed( CONFIG_VAR( guides_draw ) );
+}
+
+
+static void
+guides_display( void * priv, int x, int y, int selected )
+{
+	const char * name = "CUSTOM";
+	unsigned i;
+	for( i=0 ; i<COUNT(guide_modes) ; i++ )
+		if( guide_modes[i].mask == guides_draw )
+			name = guide_modes[i].name;
+
+	bmp_printf(
+		selected ? MENU_FONT_SEL : MENU_FONT,
+		x, y,
+		//23456789012
+		"Guides:     %s",
+		name
+	);
+}
+
+
 struct menu_entry zebra_menus[] = {
 	{
 		.priv		= &zebra_draw,
@@ -590,6 +1230,10 @@ struct menu_entry zebra_menus[] = {
 		.select		= menu_binary_toggle,
 		.display	= crop_display,
 	},
+	{
+		.select		= crop_next_toggle,
+		.display	= crop_library_display,
+	},
 	{
 		.priv		= &edge_draw,
 		.select		= menu_binary_toggle,
@@ -605,30 +1249,20 @@ struct menu_entry zebra_menus[] = {
 		.select		= menu_binary_toggle,
 		.display	= waveform_display,
 	},
+	{
+		.priv		= &guides_draw,
+		.select		= guides_toggle,
+		.display	= guides_display,
+	},
 };
 
 
-PROP_HANDLER( PROP_LV_ACTION )
-{
-	// LV_START==0, LV_STOP=1
-	lv_drawn = !buf[0];
-	return prop_cleanup( token, property );
-}
-
-
-PROP_HANDLER( PROP_GUI_STATE )
-{
-	// PLAYMENU==0, IDLE==1
-	lv_drawn = !buf[0];
-	return prop_cleanup( token, property );
-}
 
 
 PROP_HANDLER( PROP_ACTIVE_SWEEP_STATUS )
 {
 	// Let us know when the sensor is done cleaning
 	sensor_cleaning = buf[0];
-	return prop_cleanup( token, property );
 }
 
 
@@ -641,7 +1275,6 @@ PROP_HANDLER( PROP_MVR_REC_START )
 			timecode_y,
 			"REC: "
 		);
-	return prop_cleanup( token, property );
 }
 
 
@@ -657,35 +1290,52 @@ PROP_HANDLER( PROP_REC_TIME )
 		value / 60,
 		value % 60
 	);
-	return prop_cleanup( token, property );
+}
+
+
+/** The overlays that zebra_task draws.  When they are all off it
+ * sleeps on zebra_wake until one of them is turned on.
+ */
+static struct config_var * const zebra_vars[] = {
+	CONFIG_VAR( zebra_draw ),
+	CONFIG_VAR( edge_draw ),
+	CONFIG_VAR( hist_draw ),
+	CONFIG_VAR( waveform_draw ),
+	CONFIG_VAR( crop_draw ),
+	CONFIG_VAR( guides_draw ),
+};
+
+static struct config_observer	zebra_observers[ COUNT(zebra_vars) ];
+static struct semaphore *	zebra_wake;
+
+
+static int
+zebra_idle( void )
+{
+	unsigned i;
+	for( i=0 ; i<COUNT(zebra_vars) ; i++ )
+		if( *(unsigned*) zebra_vars[i]->value )
+			return 0;
+
+	// The old guides still have to be erased
+	return !guides_drawn;
 }
 
 
 static void
 zebra_task( void )
 {
-	lv_drawn = 0;
-	cropmarks = bmp_load( crop_file );
+	lv_action_cache = prop_cache_find( PROP_LV_ACTION );
+	gui_state_cache = prop_cache_find( PROP_GUI_STATE );
 
 	DebugMsg( DM_MAGIC, 3,
-		"%s: Zebras=%s threshold=%x cropmarks=%x liveview=%d",
+		"%s: Zebras=%s threshold=%x liveview=%d",
 		__func__,
 		zebra_draw ? "ON " : "OFF",
 		zebra_level,
-		(unsigned) cropmarks,
 		enable_liveview
 	);
 
-	if( cropmarks )
-	{
-		DebugMsg( DM_MAGIC, 3,
-			"Cropmarks: %dx%d @ %d",
-			cropmarks->width,
-			cropmarks->height,
-			cropmarks->bits_per_pixel
-		);
-	}
-
 	if( enable_liveview )
 	{
 /*
@@ -703,9 +1353,25 @@ zebra_task( void )
 
 	menu_add( "Video", zebra_menus, COUNT(zebra_menus) );
 
+	zebra_wake = create_named_semaphore( "zebra_wake", 0 );
+
+	unsigned i;
+	for( i=0 ; i<COUNT(zebra_vars) ; i++ )
+	{
+		zebra_observers[i].notify	= config_notify_semaphore;
+		zebra_observers[i].arg		= zebra_wake;
+		config_observe( zebra_vars[i], &zebra_observers[i] );
+	}
+
 	while(1)
 	{
-		if( !gui_menu_task && lv_drawn )
+		if( zebra_idle() )
+		{
+			take_semaphore( zebra_wake, 0 );
+			continue;
+		}
+
+		if( !gui_menu_task && lv_drawn() )
 		{
 			draw_zebra();
 			msleep( 100 );